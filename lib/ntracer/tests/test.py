@@ -1,9 +1,13 @@
 import unittest
 import random
 import pickle
+import struct
+import threading
+import time
+import math
 
 from ..wrapper import NTracer,CUBE,SPHERE
-from ..render import Material,Color
+from ..render import Material,Color,Channel,ImageFormat,BlockingRenderer,CallbackRenderer,LockedError
 
 
 def pydot(a,b):
@@ -37,6 +41,42 @@ def rand_triangle_verts(nt):
             [0 for j in range(i+1,d)]))
     return points
 
+# Matrix.rotation only gives a rotation if its vectors are orthonormal
+def rand_rotation(nt):
+    return nt.Matrix.rotation(
+        nt.Vector.axis(0),
+        nt.Vector([0] + [random.uniform(-1,1) for i in range(nt.dimension-1)]).unit(),
+        random.uniform(0,3))
+
+def rand_triangles(nt,count,translucent=False):
+    return [nt.TrianglePrototype(
+            rand_triangle_verts(nt),
+            Material((random.random(),random.random(),1),opacity=random.choice([1,0.5]) if translucent else 1))
+        for i in range(count)]
+
+# Where most tests look at their scenes from, in front of any random triangles.
+# One face of every triangle from rand_triangle_verts lies where the last
+# coordinate is 0, so the view is moved off of it, where rays would only graze
+# the triangles.
+FRONT_VIEW = (3,3,-25,0.5)
+
+# one 32-bit float per channel, which keeps colors unrounded
+def float_format(w,h):
+    return ImageFormat(w,h,[
+        Channel(32,1,0,0,tfloat=True),
+        Channel(32,0,1,0,tfloat=True),
+        Channel(32,0,0,1,tfloat=True)])
+
+# the top-left corner of the "size" wide block, within chunks of
+# "chunk_size", that "v" falls in
+def chunk_corner(v,size,chunk_size):
+    return v//chunk_size*chunk_size + v%chunk_size//size*size
+
+def set_front_view(scene):
+    cam = scene.get_camera()
+    cam.origin = FRONT_VIEW
+    scene.set_camera(cam)
+
 def walk_bounds(n,aabb,nt,f):
     f(aabb,n)
     if isinstance(n,nt.KDBranch):
@@ -76,7 +116,7 @@ class Tests(unittest.TestCase):
         return r
 
     _aabb_equal = object_equal_method('start','end')
-    _material_equal = object_equal_method('color','opacity','reflectivity','specular_intensity','specular_exp','specular')
+    _material_equal = object_equal_method('color','opacity','reflectivity','specular_intensity','specular_exp','specular','casts_shadow')
     _kdbranch_equal = object_equal_method('axis','split','left','right')
 
     def listlike_equal(self,a,b,msg=None):
@@ -93,6 +133,29 @@ class Tests(unittest.TestCase):
         for a,b in zip(va,vb):
             self.assertAlmostEqual(a,b,4)
 
+    # The colors of "scene", seen from FRONT_VIEW, row by row. The image is
+    # drawn by "renderer" if given, otherwise each pixel is traced with
+    # "calculate_color". Either way, the colors are clamped like a renderer
+    # does.
+    def image(self,scene,renderer=None,w=19,h=13):
+        set_front_view(scene)
+        if renderer is None:
+            return [tuple(min(max(c,0),1) for c in scene.calculate_color(x,y,w,h))
+                for y in range(h) for x in range(w)]
+
+        buf = bytearray(w*h*12)
+        renderer.render(buf,float_format(w,h),scene)
+        return list(struct.iter_unpack('>3f',buf))
+
+    def assert_images_equal(self,a,b):
+        self.assertEqual(len(a),len(b))
+        for ca,cb in zip(a,b):
+            for x,y in zip(ca,cb): self.assertAlmostEqual(x,y,4)
+
+    def assert_same_image(self,a,b,renderer=None):
+        # "b" is drawn by "renderer", if given
+        self.assert_images_equal(self.image(a),self.image(b,renderer))
+
     #def check_kdtree(self,nt,scene):
     #    prims = set()
     #    leaf_boundaries = []
@@ -210,7 +273,7 @@ class Tests(unittest.TestCase):
 
         self.assertFalse(box.intersects(nt.SolidPrototype(
             CUBE,
-            nt.Vector(1.356136,1.717844,1.577731),
+            nt.Vector(-7.21513,-2.649142,0.3491488),
             nt.Matrix(-0.01922399,-0.3460019,0.8615935,
                       -0.03032121,-0.6326356,-0.5065715,
                       0.03728577,-0.6928598,0.03227519),
@@ -218,7 +281,7 @@ class Tests(unittest.TestCase):
 
         self.assertFalse(box.intersects(nt.SolidPrototype(
             CUBE,
-            nt.Vector(1.444041,1.433598,1.975453),
+            nt.Vector(0.4818701,-2.775447,0.3279766),
             nt.Matrix(0.3780299,-0.3535482,0.8556266,
                       -0.7643852,-0.6406123,0.07301452,
                       0.5223108,-0.6816301,-0.5124177),
@@ -226,7 +289,7 @@ class Tests(unittest.TestCase):
 
         self.assertFalse(box.intersects(nt.SolidPrototype(
             CUBE,
-            nt.Vector(-0.31218,-3.436678,1.473133),
+            nt.Vector(1.7909,0.05102631,-1.153712),
             nt.Matrix(0.8241131,-0.2224413,1.540015,
                       -1.461101,-0.7099018,0.6793453,
                       0.5350775,-1.595884,-0.516849),
@@ -234,7 +297,7 @@ class Tests(unittest.TestCase):
 
         self.assertFalse(box.intersects(nt.SolidPrototype(
             CUBE,
-            nt.Vector(0.7697315,-3.758033,1.847144),
+            nt.Vector(1.45661,0.515983,-1.859839),
             nt.Matrix(0.6002195,-1.608681,-0.3900863,
                       -1.461104,-0.7098908,0.6793506,
                       -0.7779449,0.0921175,-1.576897),
@@ -242,7 +305,7 @@ class Tests(unittest.TestCase):
 
         self.assertTrue(box.intersects(nt.SolidPrototype(
             CUBE,
-            nt.Vector(0.4581598,-1.56134,0.5541568),
+            nt.Vector(1.656106,0.460502,-0.00594644),
             nt.Matrix(0.3780299,-0.3535482,0.8556266,
                       -0.7643852,-0.6406123,0.07301452,
                       0.5223108,-0.6816301,-0.5124177),
@@ -266,6 +329,20 @@ class Tests(unittest.TestCase):
             nt.Matrix.identity(),
             mat)))
 
+        # a box that isn't centered at the origin
+        box = nt.AABB((4,4,4),(6,6,6))
+        self.assertTrue(box.intersects(nt.SolidPrototype(
+            SPHERE,
+            nt.Vector(5,5,6.5),
+            nt.Matrix.identity(),
+            mat)))
+
+        self.assertFalse(box.intersects(nt.SolidPrototype(
+            SPHERE,
+            nt.Vector(6.8,6.8,5),
+            nt.Matrix.identity(),
+            mat)))
+
     @and_generic
     def test_batch_interface(self,generic):
         nt = self.get_ntracer(4,generic)
@@ -290,6 +367,81 @@ class Tests(unittest.TestCase):
                 self.assertEqual(protos[i].point_data[j].edge_normal,bproto.point_data[j].edge_normal[i])
             self.assertEqual(protos[i].material,bproto.material[i])
 
+    @and_generic
+    def test_partial_batch(self,generic):
+        nt = self.get_ntracer(4,generic)
+        if nt.BATCH_SIZE == 1: return
+
+        mat = Material((1,0.5,1))
+        count = nt.BATCH_SIZE - 1
+        tris = [nt.Triangle.from_points(rand_triangle_verts(nt),mat) for i in range(count)]
+        batch = nt.TriangleBatch(tris)
+        self.assertEqual(len(batch),count)
+        for a,b in zip(batch,tris): self.assertEqual(a,b)
+        self.assertEqual(len(pickle.loads(pickle.dumps(batch))),count)
+        self.assertEqual(len(nt.TriangleBatchPrototype(nt.TrianglePrototype(t) for t in tris).material),count)
+        with self.assertRaises(ValueError):
+            nt.TriangleBatch(tris + tris)
+
+        # the unused lanes must not produce any hits
+        bound = nt.AABB(nt.Vector(-10,-10,-10,-10),nt.Vector(10,10,10,10))
+        self.assert_same_image(
+            nt.CompositeScene(bound,nt.KDLeaf(tris)),
+            nt.CompositeScene(bound,nt.KDLeaf([batch])))
+
+    @and_generic
+    def test_solid_batch(self,generic):
+        nt = self.get_ntracer(4,generic)
+        if nt.BATCH_SIZE == 1: return
+
+        def rand_solid(type):
+            return nt.Solid(
+                type,
+                rand_vector(nt,-5,5),
+                rand_rotation(nt)
+                    * nt.Matrix.scale(random.uniform(0.5,2)),
+                Material((random.random(),1,1)))
+
+        cubes = [rand_solid(CUBE) for i in range(nt.BATCH_SIZE)]
+        spheres = [rand_solid(SPHERE) for i in range(nt.BATCH_SIZE-1)]
+        batches = [nt.SolidBatch(cubes),nt.SolidBatch(spheres)]
+        self.assertEqual(batches[0].type,CUBE)
+        self.assertEqual(len(batches[1]),len(spheres))
+        for a,b in zip(batches[1],spheres):
+            self.assertEqual(a.position,b.position)
+            self.assertEqual(a.orientation,b.orientation)
+        self.assertEqual(len(pickle.loads(pickle.dumps(batches[1]))),len(spheres))
+        with self.assertRaises(ValueError):
+            nt.SolidBatch([cubes[0],spheres[0]])
+
+        s_leaf = nt.KDLeaf(cubes + spheres)
+        b_leaf = nt.KDLeaf(batches)
+        origin = nt.Vector(0,0,-15,0)
+
+        # Where a ray that grazes a sphere hits it, if at all, depends too much
+        # on rounding to compare. This is how close the ray comes to the
+        # center of each sphere, in the sphere's local space.
+        def grazes_sphere(direction):
+            for s in spheres:
+                inv = s.orientation.inverse()
+                lo = inv * origin - s.position
+                ld = inv * direction
+                if abs(pydot(lo,lo) - pydot(lo,ld)**2/pydot(ld,ld) - 1) < 0.02: return True
+            return False
+
+        for y in range(-5,6):
+            for x in range(-5,6):
+                direction = nt.Vector(x*0.05,y*0.05,1,0).unit()
+                if grazes_sphere(direction): continue
+
+                h1 = s_leaf.intersects(origin,direction)
+                h2 = b_leaf.intersects(origin,direction)
+                self.assertEqual(len(h1),len(h2))
+                if h1:
+                    self.assertAlmostEqual(h1[-1].dist,h2[-1].dist,3)
+                    for a,b in zip(h1[-1].normal.unit(),h2[-1].normal.unit()):
+                        self.assertAlmostEqual(a,b,3)
+
     @and_generic
     def test_buffer_interface(self,generic):
         nt = self.get_ntracer(7,generic)
@@ -368,6 +520,7 @@ class Tests(unittest.TestCase):
     def test_pickle(self):
         mat = Material((1,1,1))
         self.check_pickle_roundtrip(mat)
+        self.check_pickle_roundtrip(Material((1,0,1),0.5,casts_shadow=False))
         self.check_pickle_roundtrip(Color(0.2,0.1,1))
         for d in [3,5,12]:
             with self.subTest(dimension=d):
@@ -405,6 +558,455 @@ class Tests(unittest.TestCase):
             nt,
             [rand_triangle_verts(nt) for i in range(nt.BATCH_SIZE)])
 
+    def render_scene(self,nt):
+        # translucent triangles and a solid, seen from the front
+        protos = rand_triangles(nt,nt.BATCH_SIZE * 6,True)
+        protos.append(nt.SolidPrototype(SPHERE,nt.Vector(2,3,4,1),nt.Matrix.identity(),Material((1,1,0))))
+        scene = nt.build_composite_scene(protos)
+        set_front_view(scene)
+        return scene
+
+    @and_generic
+    def test_render(self,generic):
+        # the renderer traces rays in packets, which must give the same result
+        # as tracing each ray individually
+        nt = self.get_ntracer(4,generic)
+        scene = self.render_scene(nt)
+
+        w,h = 37,21
+        expected = self.image(scene,w=w,h=h)
+
+        # every pixel must be drawn exactly once, whatever the chunk size
+        for chunk_size in (1,5,16,64):
+            buf = bytearray(w*h*12)
+            r = BlockingRenderer(2,chunk_size)
+            r.render(buf,float_format(w,h),scene,progressive=1)
+            self.assert_images_equal(expected,list(struct.iter_unpack('>3f',buf)))
+
+            # every chunk is reported once, after its final pass
+            covered = [0] * (w*h)
+            for x,y,cw,ch in r.finished_chunks():
+                for j in range(y,y+ch):
+                    for i in range(x,x+cw): covered[j*w + i] += 1
+            self.assertEqual(covered,[1] * (w*h))
+            self.assertEqual(r.finished_chunks(),[])
+
+        with self.assertRaises(ValueError):
+            BlockingRenderer(chunk_size=0)
+
+    @and_generic
+    def test_render_progressive(self,generic):
+        # Each pass of a progressive render fills every block with the color
+        # of its top-left pixel. The blocks are aligned to the chunks. Pixels
+        # traced by one pass are never redrawn, so they already have their
+        # final values.
+        nt = self.get_ntracer(4,generic)
+        scene = self.render_scene(nt)
+
+        w,h = 37,21
+        levels = []
+        def on_level(renderer,size):
+            levels.append((size,bytes(buf)))
+
+        buf = bytearray(w*h*12)
+        BlockingRenderer(2,5).render(buf,float_format(w,h),scene,progressive=3,level_callback=on_level)
+        self.assertEqual([size for size,data in levels],[8,4,2])
+        for size,data in levels:
+            for y in range(h):
+                for x in range(w):
+                    i = (y*w + x)*12
+                    j = (chunk_corner(y,size,5)*w + chunk_corner(x,size,5))*12
+                    self.assertEqual(data[i:i+12],buf[j:j+12])
+
+        self.assert_images_equal(self.image(scene,w=w,h=h),list(struct.iter_unpack('>3f',buf)))
+
+    def test_render_frame_budget(self):
+        nt = self.get_ntracer(4)
+        scene = self.render_scene(nt)
+
+        # with an impossible frame budget, the second frame is drawn at the
+        # lowest resolution
+        w,h = 37,21
+        fmt = float_format(w,h)
+        buf = bytearray(w*h*12)
+        r = BlockingRenderer(2,5)
+        r.target_frame_ms = 1e-9
+        for scale in (1,16):
+            r.render(buf,fmt,scene)
+            self.assertEqual(r.scale,scale)
+        for y in range(h):
+            for x in range(w):
+                i = (y*w + x)*12
+                j = (chunk_corner(y,16,5)*w + chunk_corner(x,16,5))*12
+                self.assertEqual(buf[i:i+12],buf[j:j+12])
+
+        # a budget of 0 means no budget
+        r.target_frame_ms = 0
+        r.render(buf,fmt,scene)
+        self.assertEqual(r.scale,1)
+        with self.assertRaises(ValueError):
+            r.target_frame_ms = -1
+
+    def test_render_queue(self):
+        # queued jobs are drawn in order, each into its own buffer
+        nt = self.get_ntracer(4)
+        scene = self.render_scene(nt)
+
+        w,h = 37,21
+        bufs = [bytearray(w*h*12) for i in range(3)]
+        done = []
+        finished = threading.Event()
+        def on_done(i):
+            def inner(renderer):
+                done.append(i)
+                if i == len(bufs)-1: finished.set()
+            return inner
+
+        r = CallbackRenderer(2,5,max_pending=2)
+        for i,b in enumerate(bufs):
+            r.begin_render(b,float_format(w,h),scene,on_done(i))
+        self.assertTrue(finished.wait(30))
+        self.assertEqual(done,[0,1,2])
+        for b in bufs: self.assertEqual(b,bufs[0])
+
+    def test_finished_chunks_scaled(self):
+        # When the scale doesn't divide the chunk size, the pixels of a
+        # reported chunk must still not change afterwards
+        nt = self.get_ntracer(4)
+        scene = nt.build_composite_scene(rand_triangles(nt,nt.BATCH_SIZE * 6))
+        set_front_view(scene)
+
+        w,h = 300,300
+        fmt = ImageFormat(w,h,[Channel(8,1,0,0),Channel(8,0,1,0),Channel(8,0,0,1)])
+        r = BlockingRenderer(2,7)
+        buf = bytearray(w*h*3)
+
+        # with an impossible frame budget, the frame after the first is drawn
+        # at a scale of 16
+        r.target_frame_ms = 1e-9
+        r.render(buf,fmt,scene)
+
+        # chunks from the previous frame
+        r.finished_chunks()
+
+        buf[:] = b'\xff' * len(buf)
+        snapshots = []
+        done = False
+        def poll():
+            while True:
+                finished = done
+                for x,y,cw,ch in r.finished_chunks():
+                    snapshots.append((x,y,cw,ch,[bytes(buf[(j*w + x)*3:(j*w + x + cw)*3]) for j in range(y,y+ch)]))
+                if finished: break
+                time.sleep(0.001)
+        poller = threading.Thread(target=poll)
+        poller.start()
+        try:
+            r.render(buf,fmt,scene)
+        finally:
+            done = True
+            poller.join()
+        self.assertEqual(r.scale,16)
+
+        covered = [0] * (w*h)
+        for x,y,cw,ch,rows in snapshots:
+            for j,row in enumerate(rows):
+                self.assertEqual(row,buf[((y+j)*w + x)*3:((y+j)*w + x + cw)*3])
+                for i in range(x,x+cw): covered[(y+j)*w + i] += 1
+        self.assertEqual(covered,[1] * (w*h))
+
+    def test_render_threads(self):
+        # Starting a job builds a list of every chunk. With a large image and
+        # small chunks, the worker threads of a new renderer are likely to
+        # start while that is happening.
+        nt = self.get_ntracer(4)
+        scene = nt.build_composite_scene(rand_triangles(nt,nt.BATCH_SIZE * 2))
+        set_front_view(scene)
+
+        w,h = 300,300
+        fmt = ImageFormat(w,h,[Channel(8,1,0,0),Channel(8,0,1,0),Channel(8,0,0,1)])
+        expected = bytearray(w*h*3)
+        BlockingRenderer(0).render(expected,fmt,scene)
+
+        def check(buf):
+            self.assertLessEqual(max(abs(a-b) for a,b in zip(buf,expected)),1)
+
+        for i in range(3):
+            buf = bytearray(w*h*3)
+            self.assertTrue(BlockingRenderer(2,2).render(buf,fmt,scene))
+            check(buf)
+
+            buf = bytearray(w*h*3)
+            finished = threading.Event()
+            r = CallbackRenderer(3,2)
+            r.begin_render(buf,fmt,scene,lambda renderer: finished.set())
+            self.assertTrue(finished.wait(60))
+            check(buf)
+
+    @and_generic
+    def test_frozen_scene(self,generic):
+        nt = self.get_ntracer(4,generic)
+        mats = [Material((random.random(),random.random(),1),opacity=o) for o in (1,0.5)]
+        protos = [nt.TrianglePrototype(rand_triangle_verts(nt),random.choice(mats))
+            for i in range(nt.BATCH_SIZE * 6)]
+        protos.append(nt.SolidPrototype(CUBE,nt.Vector(2,3,4,1),nt.Matrix.identity(),mats[0]))
+        scenes = [nt.build_composite_scene(protos,frozen=f) for f in (False,True)]
+        self.assertIsNone(scenes[1].root)
+
+        expected = self.image(scenes[0])
+
+        # a frozen scene keeps copies of the materials
+        for m in mats: m.opacity = 0.25
+
+        self.assert_images_equal(expected,self.image(scenes[1]))
+
+    @and_generic
+    def test_many_transparent_layers(self,generic):
+        # more transparent hits along one ray than the list of hits has room
+        # for before it grows
+        nt = self.get_ntracer(4,generic)
+        opacity = 0.1
+        mat = Material((0.5,0.5,0.5),opacity=opacity)
+        def layer(z):
+            # a hyperplane facing the camera, large enough to fill the view
+            corner = nt.Vector(-100,-100,z,-100)
+            return nt.TrianglePrototype(
+                [corner] + [corner + nt.Vector.axis(i,400) for i in (0,1,3)],
+                mat).primitive
+
+        # A single leaf keeps the triangles out of batches, which only report
+        # their nearest transparent hit. The first scene's layer is behind the
+        # camera.
+        boundary = nt.AABB((-100,-100,-60,-100),(300,300,30,300))
+        bg,single,many = (self.image(nt.CompositeScene(boundary,nt.KDLeaf(p))) for p in (
+            [layer(-50)],
+            [layer(0)],
+            [layer(z) for z in range(25)]))
+
+        # every layer has the same color, "c", so drawing it over "b" gives
+        # c*opacity + b*(1-opacity)
+        for b,s,m in zip(bg,single,many):
+            for cb,cs,cm in zip(b,s,m):
+                c = (cs - cb*(1-opacity))/opacity
+                t = (1-opacity)**25
+                self.assertAlmostEqual(cm,c*(1-t) + cb*t,4)
+
+    @and_generic
+    def test_point_light_side(self,generic):
+        # a point light lights the side of a surface that faces it
+        nt = self.get_ntracer(4,generic)
+        corner = nt.Vector(-100,-100,0,-100)
+        scene = nt.build_composite_scene([nt.TrianglePrototype(
+            [corner] + [corner + nt.Vector.axis(i,400) for i in (0,1,3)],
+            Material((1,1,1)))])
+        unlit = self.image(scene)
+
+        scene.add_light(nt.PointLight(nt.Vector(3,3,10,0.5),(100,100,100)))
+        self.assertEqual(self.image(scene),unlit)
+
+        scene.add_light(nt.PointLight(nt.Vector(3,3,-10,0.5),(100,100,100)))
+        for a,b in zip(self.image(scene),unlit):
+            self.assertGreater(a[0],b[0])
+
+    @and_generic
+    def test_split_params(self,generic):
+        nt = self.get_ntracer(4,generic)
+        protos = rand_triangles(nt,nt.BATCH_SIZE * 40)
+        expected = nt.build_composite_scene(protos)
+        for kw in ({'split_method':'binned','bins':4},{'split_axes':0}):
+            self.assert_same_image(expected,nt.build_composite_scene(protos,**kw))
+
+        with self.assertRaises(ValueError):
+            nt.build_kdtree(protos,split_method='sorted')
+
+    @and_generic
+    def test_bvh(self,generic):
+        nt = self.get_ntracer(4,generic)
+        protos = rand_triangles(nt,nt.BATCH_SIZE * 20,True)
+        scenes = [nt.build_composite_scene(protos,**kw)
+            for kw in ({},{'accel':'bvh'},{'accel':'bvh','frozen':True})]
+        self.assertIsInstance(scenes[1].root,nt.BVH)
+        self.assertIsNone(scenes[2].root)
+
+        # unpickled objects always belong to the specialized module
+        if not generic:
+            bvh = pickle.loads(pickle.dumps(scenes[1].root))
+            scenes.append(nt.CompositeScene(scenes[1].boundary,bvh))
+
+        for s in scenes[1:]:
+            self.assert_same_image(scenes[0],s)
+        self.assert_same_image(scenes[0],scenes[1],BlockingRenderer(1))
+
+        with self.assertRaises(ValueError):
+            nt.build_composite_scene(protos,accel='octree')
+
+        # the k-d tree options don't apply to a BVH
+        for kw in ({'split_method':'binned'},{'split_axes':0}):
+            with self.assertRaises(TypeError):
+                nt.build_composite_scene(protos,accel='bvh',**kw)
+
+        # a BVH still updates the list of primitives
+        updated = list(protos)
+        nt.build_composite_scene(updated,accel='bvh',update_primitives=True)
+        if nt.BATCH_SIZE > 1:
+            self.assertTrue(all(isinstance(p,nt.TriangleBatchPrototype) for p in updated))
+
+    @and_generic
+    def test_shadows(self,generic):
+        nt = self.get_ntracer(4,generic)
+        protos = rand_triangles(nt,nt.BATCH_SIZE * 6)
+
+        # a cube behind the camera, between it and the light (the position is
+        # scaled along with the cube)
+        blocker = Material((1,1,1))
+        scenes = [nt.build_composite_scene(p) for p in (
+            protos,
+            protos + [nt.SolidPrototype(CUBE,nt.Vector(3,3,-40,0)/8,nt.Matrix.scale(8),blocker)])]
+
+        for s in scenes:
+            s.set_shadows(True)
+            s.add_light(nt.PointLight(nt.Vector(3,3,-60,0),(300000,300000,300000)))
+
+        self.assertNotEqual(self.image(scenes[0]),self.image(scenes[1]))
+
+        # a renderer reuses the occluders found for one pixel for the next
+        self.assert_same_image(scenes[1],scenes[1],BlockingRenderer(1))
+
+        blocker.casts_shadow = False
+        self.assert_same_image(scenes[0],scenes[1])
+
+    @and_generic
+    def test_solid_shadows(self,generic):
+        # The shadows found by a renderer, which remembers the last solid
+        # that blocked a light, must match tracing each pixel on its own,
+        # including for scaled and rotated solids.
+        nt = self.get_ntracer(4,generic)
+        protos = []
+        for i in range(60):
+            scale = random.uniform(0.5,3)
+            protos.append(nt.SolidPrototype(
+                random.choice([CUBE,SPHERE]),
+                rand_vector(nt,-8,8)/scale,
+                rand_rotation(nt) * nt.Matrix.scale(scale),
+                Material((1,1,1))))
+        scene = nt.build_composite_scene(protos)
+        scene.set_shadows(True)
+        scene.add_light(nt.PointLight(nt.Vector(10,15,-20,3),(3000,3000,3000)))
+
+        w,h = 60,60
+        self.assert_images_equal(self.image(scene,w=w,h=h),self.image(scene,BlockingRenderer(0),w,h))
+
+    @and_generic
+    def test_camera_inside(self,generic):
+        # With the camera inside the geometry, the primary rays start partway
+        # down the k-d tree and use the cached local origins of the solids.
+        # Every pixel must still see what the k-d tree finds when traversed
+        # from its root.
+        nt = self.get_ntracer(4,generic)
+        mat = Material((1,1,1),specular_intensity=0)
+
+        def rand_center():
+            return nt.Vector(random.uniform(-10,10),random.uniform(-10,10),random.uniform(-10,10),random.uniform(-1,1))
+
+        protos = [nt.TrianglePrototype([p*0.2 + rand_center() for p in rand_triangle_verts(nt)],mat)
+            for i in range(nt.BATCH_SIZE * 5)]
+        protos += [nt.SolidPrototype(CUBE,rand_center(),nt.Matrix.identity(),mat)
+            for i in range(100)]
+        root = nt.build_kdtree(protos)[-1]
+
+        w,h = 30,30
+        fmt = float_format(w,h)
+        buf = bytearray(w*h*12)
+        for frozen in (False,True):
+            scene = nt.build_composite_scene(protos,frozen=frozen)
+            scene.set_background((0,0,0))
+
+            # the second view checks that nothing is left over from the first
+            for origin in ((1,1,1,0),(-3,2,-1,0.5)):
+                cam = scene.get_camera()
+                cam.origin = origin
+                scene.set_camera(cam)
+                BlockingRenderer(0).render(buf,fmt,scene)
+
+                # the primary rays, as the renderer creates them
+                right,up,forward = [list(cam.axes[i]) for i in range(3)]
+                fov_i = math.tan(scene.fov/2) / (w/2)
+                for y in range(h):
+                    for x in range(w):
+                        direction = nt.Vector([f + r*fov_i*(x - w/2) - u*fov_i*(y - h/2)
+                            for f,r,u in zip(forward,right,up)]).unit()
+                        hits = root.intersects(cam.origin,direction)
+                        expected = max(-pydot(direction,hits[-1].normal),0) if hits else 0
+
+                        actual = struct.unpack_from('>3f',buf,(y*w + x)*12)
+                        for a in actual:
+                            self.assertAlmostEqual(a,min(expected,1),4)
+
+    @and_generic
+    def test_many_lights(self,generic):
+        nt = self.get_ntracer(4,generic)
+        protos = rand_triangles(nt,nt.BATCH_SIZE * 6)
+        scenes = [nt.build_composite_scene(protos) for i in range(2)]
+
+        def rand_point(z):
+            return nt.Vector(random.uniform(-20,20),random.uniform(-20,20),z,random.uniform(-20,20))
+
+        near = [nt.PointLight(rand_point(random.uniform(-40,-5)),(2000,2000,2000)) for i in range(5)]
+
+        # lights too dim to reach anything
+        far = [nt.PointLight(rand_point(random.uniform(100,200)),(1,1,1)) for i in range(200)]
+
+        for s in scenes: s.set_shadows(True)
+        scenes[0].point_lights.extend(near)
+        scenes[1].point_lights.extend(far)
+
+        dark = self.image(scenes[1])
+
+        # the lights are indexed when rendering starts, so adding more after
+        # rendering once must still be taken into account
+        scenes[1].point_lights.extend(near)
+        self.assertNotEqual(self.image(scenes[0]),dark)
+        self.assert_same_image(scenes[0],scenes[1])
+
+    def test_lights_changed_while_rendering(self):
+        # A renderer indexes the lights before drawing. Another thread adding
+        # and removing lights in between used to leave the index out of date,
+        # which crashed the renderer. This can only fail by chance, so it
+        # draws as many frames as it can in a few seconds.
+        nt = self.get_ntracer(4)
+        mat = Material((1,1,1))
+        scene = nt.build_composite_scene([nt.TrianglePrototype([rand_vector(nt,-5,5) for j in range(4)],mat)
+            for i in range(40)])
+        scene.set_shadows(True)
+        light = nt.PointLight(nt.Vector(0,0,-5,0),(500,500,500))
+        scene.point_lights.extend([light] * 65)
+
+        done = False
+        def mutate():
+            lights = scene.point_lights
+            while not done:
+                try:
+                    for i in range(70): lights.append(light)
+                except LockedError:
+                    pass
+                try:
+                    for i in range(min(70,len(lights))): del lights[len(lights)-1]
+                except LockedError:
+                    pass
+        mutator = threading.Thread(target=mutate)
+        mutator.start()
+        try:
+            w,h = 8,8
+            fmt = float_format(w,h)
+            buf = bytearray(w*h*12)
+            r = BlockingRenderer(1)
+            end = time.perf_counter() + 3
+            while time.perf_counter() < end:
+                r.render(buf,fmt,scene)
+        finally:
+            done = True
+            mutator.join()
+
     #@and_generic
     #def test_kd_tree_gen(self,generic):
     #    mat = Material((1,1,1))
@@ -122,11 +122,14 @@ class NTracer:
             'KDNode',
             'KDLeaf',
             'KDBranch',
+            'BVH',
             'Primitive',
             'PrimitiveBatch',
             'PrimitivePrototype',
             'Solid',
+            'SolidBatch',
             'SolidPrototype',
+            'SolidBatchPrototype',
             'Triangle',
             'TriangleBatch',
             'TrianglePrototype',
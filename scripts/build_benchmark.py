@@ -0,0 +1,52 @@
+#!python
+
+import argparse
+import os
+import random
+import time
+from ntracer import NTracer,Material
+
+
+def positive_int(x):
+    x = int(x,10)
+    if x < 1: raise argparse.ArgumentTypeError('a positive number is required')
+    return x
+
+parser = argparse.ArgumentParser(
+    description='Measure how the speed of building a k-d tree scales with the number of threads used.')
+parser.add_argument('-d','--dimension',metavar='D',type=positive_int,default=4,help='the dimension of the scene')
+parser.add_argument('-n','--count',metavar='N',type=positive_int,default=20000,help='the number of triangles in the scene')
+parser.add_argument('-t','--threads',metavar='T',type=positive_int,default=os.cpu_count() or 1,
+    help='the maximum number of threads to measure (the default is the number of processing cores)')
+parser.add_argument('-r','--repeat',metavar='R',type=positive_int,default=3,help='how many times to build the tree per thread count (the fastest time is reported)')
+parser.add_argument('--seed',type=int,default=0,help='the random number seed used to create the scene')
+parser.add_argument('--no-special',action='store_true',help='use the slower generic version of library even if a specialized version exists')
+args = parser.parse_args()
+
+random.seed(args.seed)
+nt = NTracer(args.dimension,args.no_special)
+mat = Material((1,1,1))
+
+def small_triangle():
+    c = [random.uniform(-12,12) for i in range(args.dimension)]
+    return [nt.Vector([x + random.uniform(-1,1) for x in c]) for i in range(args.dimension)]
+
+primitives = [nt.TrianglePrototype(small_triangle(),mat) for i in range(args.count)]
+
+# Grouping triangles into batches is done on one thread. Do it up front so
+# only the parallel part is measured. A maximum depth of 0 produces a single
+# leaf.
+nt.build_kdtree(primitives,0,update_primitives=True,max_depth=0)
+
+base = None
+print('threads    time  speed-up')
+for threads in range(1,args.threads+1):
+    best = None
+    for i in range(args.repeat):
+        t = time.perf_counter()
+        nt.build_kdtree(primitives,threads-1)
+        t = time.perf_counter() - t
+        if best is None or t < best: best = t
+
+    if base is None: base = best
+    print('{:7} {:7.3f} {:9.2f}'.format(threads,best,base/best))
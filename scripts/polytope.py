@@ -2,7 +2,6 @@
 
 import math
 import fractions
-import pygame
 import argparse
 import os.path
 import sys
@@ -10,7 +9,6 @@ import subprocess
 import time
 from itertools import combinations,islice
 from ntracer import NTracer,Material,ImageFormat,Channel,BlockingRenderer,CUBE
-from ntracer.pygame_render import PygameRenderer
 
 
 ROT_SENSITIVITY = 0.005
@@ -36,7 +34,7 @@ def schlafli_component(x):
     s = int(x[2],10)
     if s < 1: raise argparse.ArgumentTypeError('for component p/q: q cannot be less than 1')
     if s >= p: raise argparse.ArgumentTypeError('for component p/q: q must be less than p')
-    if fractions.gcd(s,p) != 1: raise argparse.ArgumentTypeError('for component p/q: p and q must be co-prime')
+    if math.gcd(s,p) != 1: raise argparse.ArgumentTypeError('for component p/q: p and q must be co-prime')
     return fractions.Fraction(p,s)
 
 def positive_int(x):
@@ -71,9 +69,16 @@ parser.add_argument('-d','--cam-dist',metavar='DIST',type=float,default=4,
     help='How far the view-port is from the center of the polytope. The '+
         'value is a multiple of the outer raidius of the polytope.')
 parser.add_argument('--benchmark',action='store_true',help='measure the speed of rendering the scene')
+parser.add_argument('--headless',action='store_true',
+    help='when benchmarking, render to memory instead of a window (Pygame is '+
+        'not required)')
 parser.add_argument('--no-special',action='store_true',help='use the slower generic version of library even if a specialized version exists')
 args = parser.parse_args()
 
+if not (args.benchmark and args.headless and args.output is None):
+    import pygame
+    from ntracer.pygame_render import PygameRenderer
+
 
 material = Material((1,0.5,0.5))
 nt = NTracer(max(len(args.schlafli)+1,3),force_generic=args.no_special)
@@ -660,6 +665,25 @@ if args.output is not None:
                 render.abort_render()
                 break
 
+elif args.benchmark and args.headless:
+    render = BlockingRenderer()
+    format = ImageFormat(
+        args.screen[0],
+        args.screen[1],
+        [Channel(8,1,0,0),
+         Channel(8,0,1,0),
+         Channel(8,0,0,1)])
+
+    surf = bytearray(args.screen[0]*args.screen[1]*format.bytes_per_pixel)
+
+    with RotatingCamera() as rc:
+        while True:
+            rc.start_timer()
+            render.render(surf,format,scene)
+            rc.end_timer()
+
+            if not rc.advance_camera(): break
+
 else:
     pygame.display.init()
     render = PygameRenderer()
@@ -235,7 +235,7 @@ class CustomBuildExt(build_ext):
         n = str(n)
         return Extension(
             'tracer'+n,
-            ['src/py_common.cpp'],
+            ['src/py_common.cpp','src/geom_allocator.cpp'],
             depends=['src/simd.hpp.in','src/ntracer_body.hpp',
                 'src/py_common.hpp','src/pyobject.hpp','src/geometry.hpp',
                 'src/fixed_geometry.hpp','src/tracer.hpp','src/light.hpp',
@@ -62,6 +62,26 @@ used. */
 #endif
 
 
+#if defined(_MSC_VER) && defined(_M_X64)
+  #include <intrin.h>
+#endif
+
+// the index of the lowest set bit of "x", which must not be zero
+inline unsigned int count_trailing_zeros(unsigned long long x) {
+#if defined(__GNUC__)
+    return static_cast<unsigned int>(__builtin_ctzll(x));
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long r;
+    _BitScanForward64(&r,x);
+    return r;
+#else
+    unsigned int r = 0;
+    for(; !(x & 1); x >>= 1) ++r;
+    return r;
+#endif
+}
+
+
 #if defined(_WIN32) || defined(__CYGWIN__) || defined(__BEOS__)
   #define SHARED(RET) __declspec(dllexport) RET
 #elif defined(__GNUC__)
@@ -31,7 +31,9 @@ typedef camera<module_store> n_camera;
 typedef solid_prototype<module_store> n_solid_prototype;
 typedef triangle_prototype<module_store> n_triangle_prototype;
 typedef triangle_batch_prototype<module_store> n_triangle_batch_prototype;
+typedef solid_batch_prototype<module_store> n_solid_batch_prototype;
 typedef aabb<module_store> n_aabb;
+typedef bvh_data<module_store> n_bvh_data;
 typedef point_light<module_store> n_point_light;
 typedef global_light<module_store> n_global_light;
 typedef vector<module_store,v_real> n_vector_batch;
@@ -99,6 +101,22 @@ void sized_iter::finished() const {
     }
 }
 
+/* Read between 1 and v_real::size items from "obj" into "dest" and return the
+   number of items read */
+template<typename T,typename F> size_t read_batch_items(PyObject *obj,py::pyptr<T> *dest,F convert) {
+    auto itr = py::iter(obj);
+    size_t count = 0;
+    while(auto item = py::next(itr)) {
+        if(count == v_real::size) {
+            PyErr_Format(PyExc_ValueError,"too many items in object, expected at most %d",int(v_real::size));
+            throw py_error_set();
+        }
+        dest[count++] = convert(*item);
+    }
+    if(!count) THROW_PYERR_STRING(ValueError,"at least one item is required");
+    return count;
+}
+
 template<typename T1,typename T2> inline bool compatible(const T1 &a,const T2 &b) {
     return a.dimension() == b.dimension();
 }
@@ -262,6 +280,7 @@ typedef solid<module_store> obj_Solid;
 typedef triangle<module_store> obj_Triangle;
 
 typedef triangle_batch<module_store> obj_TriangleBatch;
+typedef solid_batch<module_store> obj_SolidBatch;
 
 template<> primitive<module_store> *checked_py_cast<primitive<module_store>>(PyObject *o) {
     if(UNLIKELY(Py_TYPE(o) != solid_obj_common::pytype() && Py_TYPE(o) != triangle_obj_common::pytype())) {
@@ -355,6 +374,19 @@ template<> obj_KDNode *checked_py_cast<obj_KDNode>(PyObject *o) {
     return reinterpret_cast<obj_KDNode*>(o);
 }
 
+/* BVH data is immutable once built, so instead of the parent/child scheme of
+   the k-d tree wrappers, the wrapper and any scenes using it share it */
+struct obj_BVH : py::pyobj_subclass {
+    CONTAINED_PYTYPE_DEF
+    PyObject_HEAD
+    PY_MEM_NEW_DELETE
+    std::shared_ptr<const n_bvh_data> data;
+
+    obj_BVH(std::shared_ptr<const n_bvh_data> data) : data(std::move(data)) {
+        PyObject_Init(py::ref(this),pytype());
+    }
+};
+
 
 int intersection_index(const intersection_target<module_store,false>&) { return -1; }
 int intersection_index(const intersection_target<module_store,true> &t) { return t.index; }
@@ -580,6 +612,7 @@ typedef py::obj_array_adapter<triangle_point<module_store,v_real>,triangle_batch
 
 
 SIMPLE_WRAPPER(solid_prototype);
+SIMPLE_WRAPPER(solid_batch_prototype);
 
 primitive_prototype<module_store> &obj_PrimitivePrototype::get_base() {
     if(PyObject_TypeCheck(py::ref(this),obj_TrianglePrototype::pytype()))
@@ -588,6 +621,9 @@ primitive_prototype<module_store> &obj_PrimitivePrototype::get_base() {
     if(PyObject_TypeCheck(py::ref(this),obj_TriangleBatchPrototype::pytype()))
         return reinterpret_cast<obj_TriangleBatchPrototype*>(this)->get_base();
 
+    if(PyObject_TypeCheck(py::ref(this),wrapped_type<n_solid_batch_prototype>::pytype()))
+        return reinterpret_cast<wrapped_type<n_solid_batch_prototype>*>(this)->get_base();
+
     assert(PyObject_TypeCheck(py::ref(this),wrapped_type<n_solid_prototype>::pytype()));
     return reinterpret_cast<wrapped_type<n_solid_prototype>*>(this)->get_base();
 }
@@ -849,20 +885,32 @@ FIX_STACK_ALIGN PyObject *obj_CompositeScene_new(PyTypeObject *type,PyObject *ar
     if(ptr) {
         try {
             try {
-                auto&& [boundary,d_node] = get_arg::get_args("CompositeScene.__new__",args,kwds,
+                auto&& [boundary,data] = get_arg::get_args("CompositeScene.__new__",args,kwds,
                     param<n_aabb&>(P(boundary)),
-                    param<obj_KDNode*>(P(data)));
+                    param<PyObject*>(P(data)));
 
-                if(d_node->parent) THROW_PYERR_STRING(ValueError,"\"data\" must not be already attached to another node");
+                if(Py_TYPE(data) == obj_BVH::pytype()) {
+                    auto bvh = reinterpret_cast<obj_BVH*>(data);
+                    if(boundary.dimension() != bvh->data->dimension)
+                        THROW_PYERR_STRING(TypeError,"\"boundary\" and \"data\" must have the same dimesion");
 
-                if(boundary.dimension() != d_node->dimension())
-                    THROW_PYERR_STRING(TypeError,"\"boundary\" and \"data\" must have the same dimesion");
+                    auto &base = reinterpret_cast<obj_CompositeScene*>(ptr)->alloc_base();
 
-                auto &base = reinterpret_cast<obj_CompositeScene*>(ptr)->alloc_base();
+                    new(&base) composite_scene<module_store>(boundary,bvh->data);
+                    reinterpret_cast<obj_CompositeScene*>(ptr)->_get_base = &obj_CompositeScene::scene_get_base;
+                } else {
+                    auto d_node = checked_py_cast<obj_KDNode>(data);
+                    if(d_node->parent) THROW_PYERR_STRING(ValueError,"\"data\" must not be already attached to another node");
+
+                    if(boundary.dimension() != d_node->dimension())
+                        THROW_PYERR_STRING(TypeError,"\"boundary\" and \"data\" must have the same dimesion");
 
-                new(&base) composite_scene<module_store>(boundary,d_node->_data);
-                reinterpret_cast<obj_CompositeScene*>(ptr)->_get_base = &obj_CompositeScene::scene_get_base;
-                d_node->parent = py::borrowed_ref(ptr);
+                    auto &base = reinterpret_cast<obj_CompositeScene*>(ptr)->alloc_base();
+
+                    new(&base) composite_scene<module_store>(boundary,d_node->_data);
+                    reinterpret_cast<obj_CompositeScene*>(ptr)->_get_base = &obj_CompositeScene::scene_get_base;
+                    d_node->parent = py::borrowed_ref(ptr);
+                }
             } catch(...) {
                 Py_DECREF(ptr);
                 throw;
@@ -881,6 +929,12 @@ PyObject *new_obj_node(PyObject *parent,kd_node<module_store> *node,size_t dimen
     return py::ref(new obj_KDBranch(py::borrowed_ref(parent),static_cast<kd_branch<module_store>*>(node),dimension));
 }
 
+PyObject *new_obj_root(obj_CompositeScene *scene) {
+    auto &base = scene->get_base();
+    if(base.bvh_root) return py::ref(new obj_BVH(base.bvh_root));
+    return new_obj_node(py::ref(scene),base.root.get(),base.dimension());
+}
+
 FIX_STACK_ALIGN PyObject *obj_CompositeScene_get_ambient_color(obj_CompositeScene *self,void*) {
     try {
         return to_pyobject(self->get_base().ambient);
@@ -919,9 +973,7 @@ PyGetSetDef obj_CompositeScene_getset[] = {
     {"boundary",OBJ_GETTER(
         obj_CompositeScene,
         py::new_ref(new wrapped_type<n_aabb>(obj_self,self->get_base().boundary))),NULL,NULL,NULL},
-    {"root",OBJ_GETTER(
-        obj_CompositeScene,
-        py::new_ref(new_obj_node(obj_self,self->get_base().root.get(),self->get_base().dimension()))),NULL,NULL,NULL},
+    {"root",OBJ_GETTER(obj_CompositeScene,py::new_ref(new_obj_root(self))),NULL,NULL,NULL},
     {"point_lights",OBJ_GETTER(
         obj_CompositeScene,
         py::new_ref(new cs_light_list<point_light_list_base>(self))),NULL,NULL,NULL},
@@ -1226,7 +1278,7 @@ template<typename T> FIX_STACK_ALIGN PyObject *obj_Triangle_reduce(T *self,PyObj
         for(size_t i=0; i<self->dimension()-1; ++i) values.data()[i+2] = to_real_array(self->items()[i].data());
 
         if constexpr(std::is_same_v<T,obj_TriangleBatch>) {
-            return (*package_common_data.triangle_batch_reduce)(v_real::size,self->dimension(),values.data(),self->m);
+            return (*package_common_data.triangle_batch_reduce)(v_real::size,self->lanes,self->dimension(),values.data(),self->m);
         } else {
             return (*package_common_data.triangle_reduce)(self->dimension(),values.data(),self->m.get());
         }
@@ -1324,7 +1376,7 @@ PyTypeObject triangle_obj_common::_pytype = make_pytype(
 
 FIX_STACK_ALIGN PyObject *obj_TriangleBatch_sequence_getitem(obj_TriangleBatch *self,Py_ssize_t index) {
     try {
-        if(UNLIKELY(index < 0 || index >= static_cast<Py_ssize_t>(v_real::size))) {
+        if(UNLIKELY(index < 0 || index >= static_cast<Py_ssize_t>(self->lanes))) {
             PyErr_SetString(PyExc_IndexError,"index out of range");
             return nullptr;
         }
@@ -1337,7 +1389,7 @@ FIX_STACK_ALIGN PyObject *obj_TriangleBatch_sequence_getitem(obj_TriangleBatch *
 }
 
 PySequenceMethods obj_TriangleBatch_sequence_methods = {
-    .sq_length = [](PyObject*){ return static_cast<Py_ssize_t>(v_real::size); },
+    .sq_length = [](PyObject *self){ return static_cast<Py_ssize_t>(reinterpret_cast<obj_TriangleBatch*>(self)->lanes); },
     .sq_item = reinterpret_cast<ssizeargfunc>(&obj_TriangleBatch_sequence_getitem)};
 
 FIX_STACK_ALIGN PyObject *obj_TriangleBatch_new(PyTypeObject *type,PyObject *args,PyObject *kwds) {
@@ -1346,18 +1398,14 @@ FIX_STACK_ALIGN PyObject *obj_TriangleBatch_new(PyTypeObject *type,PyObject *arg
         auto arg = std::get<0>(get_arg::get_args("TriangleBatch.__new__",args,kwds,
             param(P(triangles))));
 
-        auto tris = sized_iter(py::borrowed_ref(arg),v_real::size);
-
         py::pyptr<obj_Triangle> tmp[v_real::size];
-
-        for(size_t i=0; i<v_real::size; ++i) {
-            tmp[i] = py::borrowed_ref(checked_py_cast<obj_Triangle>(tris.next().ref()));
-        }
-        tris.finished();
+        size_t lanes = read_batch_items(arg,tmp,[](const py::object &item) {
+            return py::pyptr<obj_Triangle>(py::borrowed_ref(checked_py_cast<obj_Triangle>(item.ref())));
+        });
 
         /* TriangleBatch objects have special alignment requirements and don't
            use Python's memory allocator */
-        return py::ref(obj_TriangleBatch::from_triangles([&](size_t i){ return tmp[i].get(); }));
+        return py::ref(obj_TriangleBatch::from_triangles([&](size_t i){ return tmp[i].get(); },lanes));
     } PY_EXCEPT_HANDLERS(nullptr)
 }
 
@@ -1382,6 +1430,85 @@ PyTypeObject triangle_batch_obj_common::_pytype = make_pytype(
     .tp_free = reinterpret_cast<freefunc>(&dealloc_uninitialized<obj_TriangleBatch>)});
 
 
+FIX_STACK_ALIGN PyObject *obj_SolidBatch_sequence_getitem(obj_SolidBatch *self,Py_ssize_t index) {
+    try {
+        if(UNLIKELY(index < 0 || index >= static_cast<Py_ssize_t>(self->lanes))) {
+            PyErr_SetString(PyExc_IndexError,"index out of range");
+            return nullptr;
+        }
+        return py::ref(self->get_solid(index));
+    } PY_EXCEPT_HANDLERS(nullptr)
+}
+
+PySequenceMethods obj_SolidBatch_sequence_methods = {
+    .sq_length = [](PyObject *self){ return static_cast<Py_ssize_t>(reinterpret_cast<obj_SolidBatch*>(self)->lanes); },
+    .sq_item = reinterpret_cast<ssizeargfunc>(&obj_SolidBatch_sequence_getitem)};
+
+FIX_STACK_ALIGN PyObject *obj_SolidBatch_new(PyTypeObject *type,PyObject *args,PyObject *kwds) {
+    auto idata = get_instance_data();
+    try {
+        auto arg = std::get<0>(get_arg::get_args("SolidBatch.__new__",args,kwds,
+            param(P(solids))));
+
+        py::pyptr<obj_Solid> tmp[v_real::size];
+        size_t lanes = read_batch_items(arg,tmp,[](const py::object &item) {
+            return py::pyptr<obj_Solid>(py::borrowed_ref(checked_py_cast<obj_Solid>(item.ref())));
+        });
+
+        for(size_t i=1; i<lanes; ++i) {
+            if(tmp[i]->dimension() != tmp[0]->dimension())
+                THROW_PYERR_STRING(TypeError,"the items must all have the same dimension");
+            if(tmp[i]->type != tmp[0]->type)
+                THROW_PYERR_STRING(ValueError,"the items must all have the same type");
+        }
+
+        /* SolidBatch objects have special alignment requirements and don't
+           use Python's memory allocator */
+        return py::ref(obj_SolidBatch::from_solids([&](size_t i){ return tmp[i].get(); },lanes));
+    } PY_EXCEPT_HANDLERS(nullptr)
+}
+
+FIX_STACK_ALIGN PyObject *obj_SolidBatch_reduce(obj_SolidBatch *self,PyObject*) {
+    try {
+        struct item_size {
+            static constexpr size_t get(size_t d) { return d+1; }
+        };
+
+        module_store::type<item_size,const real*> values(self->dimension());
+        values.data()[0] = to_real_array(self->position.data());
+        for(size_t i=0; i<self->dimension(); ++i) values.data()[i+1] = to_real_array(self->orientation()[i].data());
+
+        return (*package_common_data.solid_batch_reduce)(v_real::size,self->lanes,self->dimension(),self->type,values.data(),self->m);
+    } PY_EXCEPT_HANDLERS(nullptr)
+}
+
+PyMethodDef obj_SolidBatch_methods[] = {
+    {"__reduce__",reinterpret_cast<PyCFunction>(&obj_SolidBatch_reduce),METH_NOARGS,NULL},
+    immutable_copy,
+    immutable_deepcopy,
+    {NULL}
+};
+
+PyGetSetDef obj_SolidBatch_getset[] = {
+    {"type",OBJ_GETTER(obj_SolidBatch,int(self->type)),NULL,NULL,NULL},
+    {NULL}
+};
+
+PyTypeObject solid_batch_obj_common::_pytype = make_pytype(
+    FULL_MODULE_STR ".SolidBatch",
+    obj_SolidBatch::base_size,
+    PyTypeObject{
+    .tp_itemsize = static_cast<Py_ssize_t>(obj_SolidBatch::item_size),
+    .tp_dealloc = destructor_dealloc<obj_SolidBatch>::value,
+    .tp_as_sequence = &obj_SolidBatch_sequence_methods,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = obj_SolidBatch_methods,
+    .tp_getset = obj_SolidBatch_getset,
+    .tp_base = obj_PrimitiveBatch::pytype(),
+    .tp_new = &obj_SolidBatch_new,
+    .tp_free = reinterpret_cast<freefunc>(&dealloc_uninitialized<obj_SolidBatch>)});
+
+
 size_t fill_ray_intersections(const ray_intersections<module_store> &hits,PyObject *list) {
     auto data = hits.data();
     size_t i = 0;
@@ -1744,6 +1871,139 @@ PyTypeObject obj_KDBranch::_pytype = make_pytype(
     .tp_new = &obj_KDBranch_new});
 
 
+inline size_t item_dimension(PyObject *item) {
+    if(PyObject_TypeCheck(item,obj_PrimitiveBatch::pytype()))
+        return reinterpret_cast<primitive_batch<module_store>*>(item)->dimension();
+    return reinterpret_cast<primitive<module_store>*>(item)->dimension();
+}
+
+/* Check that the nodes of "data" form a single tree in depth-first order,
+   whose leaves refer to consecutive ranges of the items, and return the index
+   after the last node of the subtree at "n". "next_item" is the first item
+   that the next leaf must refer to. */
+size_t check_bvh_subtree(const n_bvh_data &data,size_t n,int depth,size_t &next_item) {
+    if(depth > BVH_MAX_DEPTH) THROW_PYERR_STRING(ValueError,"the BVH is too deep");
+    if(n >= data.nodes.size()) THROW_PYERR_STRING(ValueError,"a node index is out of range");
+
+    const bvh_node &node = data.nodes[n];
+    if(node.size) {
+        if(node.index != next_item || node.size > data.items.size() - next_item)
+            THROW_PYERR_STRING(ValueError,"the leaves must refer to consecutive ranges of the primitives");
+        next_item += node.size;
+        return n + 1;
+    }
+
+    if(check_bvh_subtree(data,n+1,depth+1,next_item) != node.index)
+        THROW_PYERR_STRING(ValueError,"the nodes must be in depth-first order");
+    return check_bvh_subtree(data,node.index,depth+1,next_item);
+}
+
+FIX_STACK_ALIGN PyObject *obj_BVH_new(PyTypeObject *type,PyObject *args,PyObject *kwds) {
+    auto idata = get_instance_data();
+    try {
+        auto [nodes_obj,primitives_obj] = get_arg::get_args("BVH.__new__",args,kwds,
+            param<PyObject*>(P(nodes)),
+            param<PyObject*>(P(primitives)));
+
+        auto nodes = py::tuple(py::object(py::borrowed_ref(nodes_obj)));
+        auto primitives = py::tuple(py::object(py::borrowed_ref(primitives_obj)));
+        if(!nodes.size()) THROW_PYERR_STRING(ValueError,"a BVH requires at least one node");
+
+        std::shared_ptr<n_bvh_data> data;
+        for(Py_ssize_t i=0; i<nodes.size(); ++i) {
+            py::tuple node_obj(nodes[i]);
+            if(node_obj.size() != 4) THROW_PYERR_STRING(TypeError,"each node must be a tuple with four items");
+
+            auto start = from_pyobject<n_vector>(node_obj[0]);
+            auto end = from_pyobject<n_vector>(node_obj[1]);
+            if(!data) data = std::make_shared<n_bvh_data>(start.dimension());
+            if(start.dimension() != data->dimension || end.dimension() != data->dimension)
+                THROW_PYERR_STRING(TypeError,"every vector of a BVH must have the same dimension");
+
+            bvh_node node;
+            node.index = from_pyobject<uint32_t>(node_obj[2]);
+            node.size = from_pyobject<uint32_t>(node_obj[3]);
+            node.batches = 0;
+            data->nodes.push_back(node);
+            for(size_t j=0; j<data->dimension; ++j) data->bounds.push_back(start[j]);
+            for(size_t j=0; j<data->dimension; ++j) data->bounds.push_back(end[j]);
+        }
+
+        for(Py_ssize_t i=0; i<primitives.size(); ++i) {
+            auto item = primitives[i];
+            if(!PyObject_TypeCheck(item.ref(),obj_Primitive::pytype())
+                    && (v_real::size == 1 || !PyObject_TypeCheck(item.ref(),obj_PrimitiveBatch::pytype()))) {
+                if(v_real::size == 1) THROW_PYERR_STRING(TypeError,"each primitive must be an instance of Primitive");
+                THROW_PYERR_STRING(TypeError,"each primitive must be an instance of Primitive or PrimitiveBatch");
+            }
+            if(item_dimension(item.ref()) != data->dimension)
+                THROW_PYERR_STRING(TypeError,"every member of BVH must have the same dimension");
+            data->items.push_back(item);
+        }
+
+        size_t next_item = 0;
+        if(check_bvh_subtree(*data,0,0,next_item) != data->nodes.size() || next_item != data->items.size())
+            THROW_PYERR_STRING(ValueError,"every node and primitive must belong to the tree");
+
+        if constexpr(v_real::size > 1) {
+            for(auto &node : data->nodes) {
+                if(node.size) {
+                    auto first = data->items.begin() + node.index;
+                    node.batches = static_cast<uint32_t>(std::stable_partition(
+                        first,
+                        first + node.size,
+                        [](const py::object &x) { return is_primitive_batch(x.ref()); }) - first);
+                }
+            }
+        }
+
+        return py::ref(new obj_BVH(std::move(data)));
+    } PY_EXCEPT_HANDLERS(nullptr)
+}
+
+FIX_STACK_ALIGN PyObject *obj_BVH_getnewargs(obj_BVH *self,PyObject*) {
+    try {
+        const n_bvh_data &data = *self->data;
+        size_t d = data.dimension;
+
+        py::tuple nodes(static_cast<Py_ssize_t>(data.nodes.size()));
+        for(size_t i=0; i<data.nodes.size(); ++i) {
+            const real *start = data.start(i);
+            const real *end = data.end(i);
+            nodes.set_unsafe(static_cast<Py_ssize_t>(i),py::make_tuple(
+                n_vector(d,[=](size_t j) { return start[j]; }),
+                n_vector(d,[=](size_t j) { return end[j]; }),
+                data.nodes[i].index,
+                data.nodes[i].size).new_ref());
+        }
+
+        return py::make_tuple(nodes,py::tuple(data.items.begin(),data.items.end())).new_ref();
+    } PY_EXCEPT_HANDLERS(nullptr)
+}
+
+PyMethodDef obj_BVH_methods[] = {
+    {"__getnewargs__",reinterpret_cast<PyCFunction>(&obj_BVH_getnewargs),METH_NOARGS,NULL},
+    immutable_copy,
+    immutable_deepcopy,
+    {NULL}
+};
+
+PyGetSetDef obj_BVH_getset[] = {
+    {"dimension",OBJ_GETTER(obj_BVH,self->data->dimension),NULL,NULL,NULL},
+    {NULL}
+};
+
+PyTypeObject obj_BVH::_pytype = make_pytype(
+    FULL_MODULE_STR ".BVH",
+    sizeof(obj_BVH),
+    PyTypeObject{
+    .tp_dealloc = destructor_dealloc<obj_BVH>::value,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = obj_BVH_methods,
+    .tp_getset = obj_BVH_getset,
+    .tp_new = &obj_BVH_new});
+
+
 FIX_STACK_ALIGN PyObject *obj_RayIntersection_get_origin(wrapped_type<py_ray_intersection> *self,void*) {
     try {
         return to_pyobject(self->get_base().origin);
@@ -2512,6 +2772,8 @@ FIX_STACK_ALIGN PyObject *obj_AABB_intersects(wrapped_type<n_aabb> *self,PyObjec
         if(r) return r;
         r = try_intersects<n_solid_prototype>(base,obj,callback);
         if(r) return r;
+        r = try_intersects<n_solid_batch_prototype>(base,obj,callback);
+        if(r) return r;
 
         if(PyObject_TypeCheck(obj,obj_Primitive::pytype()))
             set_primitive_instead_of_proto_error();
@@ -2777,7 +3039,7 @@ FIX_STACK_ALIGN PyObject *obj_TriangleBatchPrototype_new(PyTypeObject *type,PyOb
                 for(size_t i=0; i<dim-1; ++i) {
                     for(size_t j=0; j<dim; ++j) {
                         base.boundary.end[j] = simd::max(base.boundary.end[j],simd::reduce_max(points[i][j]));
-                        base.boundary.start[j] = simd::min(base.boundary.end[j],simd::reduce_min(points[i][j]));
+                        base.boundary.start[j] = simd::min(base.boundary.start[j],simd::reduce_min(points[i][j]));
                     }
                 }
 
@@ -2798,19 +3060,14 @@ FIX_STACK_ALIGN PyObject *obj_TriangleBatchPrototype_new(PyTypeObject *type,PyOb
             }
         } else {
             py::pyptr<obj_TrianglePrototype> vals[v_real::size];
-            sized_iter itr{py::borrowed_ref(arg),v_real::size};
-            for(size_t i=0; i<v_real::size; ++i) {
-                auto val = itr.next();
-                if(!PyObject_TypeCheck(val.ref(),obj_TrianglePrototype::pytype())) {
-                    PyErr_SetString(PyExc_TypeError,"items must be instances of TrianglePrototype");
-                    return nullptr;
-                }
-                vals[i] = py::pyptr<obj_TrianglePrototype>(val);
-            }
-            itr.finished();
+            size_t lanes = read_batch_items(arg,vals,[](const py::object &val) {
+                if(!PyObject_TypeCheck(val.ref(),obj_TrianglePrototype::pytype()))
+                    THROW_PYERR_STRING(TypeError,"items must be instances of TrianglePrototype");
+                return py::pyptr<obj_TrianglePrototype>(val);
+            });
 
             size_t dimension = vals[0]->get_base().dimension();
-            for(size_t i=1; i<v_real::size; ++i) {
+            for(size_t i=1; i<lanes; ++i) {
                 if(vals[i]->get_base().dimension() != dimension) {
                     PyErr_SetString(PyExc_TypeError,"the items must all have the same dimension");
                     return nullptr;
@@ -2820,7 +3077,7 @@ FIX_STACK_ALIGN PyObject *obj_TriangleBatchPrototype_new(PyTypeObject *type,PyOb
             auto ptr = py::check_obj(type->tp_alloc(type,obj_TriangleBatchPrototype::item_size() ? dimension : 0));
             try {
                 new(&reinterpret_cast<obj_TriangleBatchPrototype*>(ptr)->alloc_base(dimension))
-                    n_triangle_batch_prototype(dimension,[&](size_t i){ return &vals[i]->get_base(); });
+                    n_triangle_batch_prototype(dimension,[&](size_t i){ return &vals[i]->get_base(); },lanes);
                 return ptr;
             } catch(...) {
                 Py_DECREF(ptr);
@@ -2847,7 +3104,7 @@ PyGetSetDef obj_TriangleBatchPrototype_getset[] = {
         py::new_ref(new wrapped_type<n_aabb>(obj_self,self->get_base().boundary))),NULL,NULL,NULL},
     {"material",OBJ_GETTER(
         obj_TriangleBatchPrototype,
-        py::tuple(self->get_base().pt()->m,self->get_base().pt()->m+v_real::size).new_ref()),NULL,NULL,NULL},
+        py::tuple(self->get_base().pt()->m,self->get_base().pt()->m+self->get_base().pt()->lanes).new_ref()),NULL,NULL,NULL},
     {"primitive",OBJ_GETTER(obj_TriangleBatchPrototype,self->get_base().p),NULL,NULL,NULL},
     {NULL}
 };
@@ -2929,29 +3186,23 @@ FIX_STACK_ALIGN PyObject *obj_SolidPrototype_new(PyTypeObject *type,PyObject *ar
 
             new(&base.p) py::pyptr<obj_Solid>(new obj_Solid(type,orientation,position,m));
 
+            /* The solid is the unit cube or sphere, offset by "position" and
+               then transformed by "orientation", so its center is
+               "orientation * position". */
+            const n_vector &center = base.ps()->world_position;
+            n_vector extent{position.dimension(),real(0)};
             if(type == CUBE) {
-                n_vector extent{position.dimension(),real(0)};
                 for(size_t i=0; i<position.dimension(); ++i) v_expr(extent) += v_expr(base.ps()->cube_component(i)).abs();
-
-                new(&base.boundary) n_aabb(position - extent,position + extent);
             } else {
                 assert(type == SPHERE);
 
-                new(&base.boundary) n_aabb(position.dimension());
-
-                for(size_t i=0; i<position.dimension(); ++i) {
-                    // equivalent to: (orientation.transpose() * n_vector::axis(position->dimension(),i)).unit()
-                    n_vector normal = orientation[i].unit();
-
-                    real max = dot(n_vector::axis(position.dimension(),i) - position,normal);
-                    real min = dot(n_vector::axis(position.dimension(),i,-1) - position,normal);
-                    if(min > max) std::swap(max,min);
-
-                    base.boundary.end[i] = max;
-                    base.boundary.start[i] = min;
-                }
+                /* the unit sphere reaches furthest along axis "i" in the
+                   direction of row "i" of "orientation" */
+                for(size_t i=0; i<position.dimension(); ++i) extent[i] = n_vector{orientation[i]}.absolute();
             }
 
+            new(&base.boundary) n_aabb(center - extent,center + extent);
+
             return ptr;
         } catch(...) {
             Py_DECREF(ptr);
@@ -3003,6 +3254,62 @@ PyTypeObject solid_prototype_obj_base::_pytype = make_pytype(
     .tp_new = &obj_SolidPrototype_new});
 
 
+FIX_STACK_ALIGN PyObject *obj_SolidBatchPrototype_new(PyTypeObject *type,PyObject *args,PyObject *kwds) {
+    auto idata = get_instance_data();
+    try {
+        auto arg = std::get<0>(get_arg::get_args("SolidBatchPrototype.__new__",args,kwds,
+            param(P(s_prototypes))));
+
+        py::pyptr<wrapped_type<n_solid_prototype>> vals[v_real::size];
+        size_t lanes = read_batch_items(arg,vals,[](const py::object &val) {
+            if(!PyObject_TypeCheck(val.ref(),wrapped_type<n_solid_prototype>::pytype()))
+                THROW_PYERR_STRING(TypeError,"items must be instances of SolidPrototype");
+            return py::pyptr<wrapped_type<n_solid_prototype>>(val);
+        });
+
+        for(size_t i=1; i<lanes; ++i) {
+            if(vals[i]->get_base().dimension() != vals[0]->get_base().dimension())
+                THROW_PYERR_STRING(TypeError,"the items must all have the same dimension");
+            if(vals[i]->get_base().ps()->type != vals[0]->get_base().ps()->type)
+                THROW_PYERR_STRING(ValueError,"the items must all have the same type");
+        }
+
+        auto ptr = py::check_obj(type->tp_alloc(type,0));
+        try {
+            new(&reinterpret_cast<wrapped_type<n_solid_batch_prototype>*>(ptr)->alloc_base())
+                n_solid_batch_prototype([&](size_t i){ return &vals[i]->get_base(); },lanes);
+            return ptr;
+        } catch(...) {
+            Py_DECREF(ptr);
+            throw;
+        }
+    } PY_EXCEPT_HANDLERS(nullptr)
+}
+
+PyGetSetDef obj_SolidBatchPrototype_getset[] = {
+    {"dimension",OBJ_GETTER(wrapped_type<n_solid_batch_prototype>,self->get_base().dimension()),NULL,NULL,NULL},
+    {"type",OBJ_GETTER(wrapped_type<n_solid_batch_prototype>,int(self->get_base().pb()->type)),NULL,NULL,NULL},
+    {"material",OBJ_GETTER(
+        wrapped_type<n_solid_batch_prototype>,
+        py::tuple(self->get_base().pb()->m,self->get_base().pb()->m+self->get_base().pb()->lanes).new_ref()),NULL,NULL,NULL},
+    {"boundary",OBJ_GETTER(
+        wrapped_type<n_solid_batch_prototype>,
+        py::new_ref(new wrapped_type<n_aabb>(obj_self,self->get_base().boundary))),NULL,NULL,NULL},
+    {"primitive",OBJ_GETTER(wrapped_type<n_solid_batch_prototype>,self->get_base().p),NULL,NULL,NULL},
+    {NULL}
+};
+
+PyTypeObject solid_batch_prototype_obj_base::_pytype = make_pytype(
+    FULL_MODULE_STR ".SolidBatchPrototype",
+    sizeof(wrapped_type<n_solid_batch_prototype>),
+    PyTypeObject{
+    .tp_dealloc = destructor_dealloc<wrapped_type<n_solid_batch_prototype>>::value,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_getset = obj_SolidBatchPrototype_getset,
+    .tp_base = obj_PrimitivePrototype::pytype(),
+    .tp_new = &obj_SolidBatchPrototype_new});
+
+
 FIX_STACK_ALIGN PyObject *obj_PointLight_new(PyTypeObject *type,PyObject *args,PyObject *kwds) {
     auto idata = get_instance_data();
     auto ptr = type->tp_alloc(type,0);
@@ -3244,10 +3551,50 @@ py::pyptr<obj_PrimitivePrototype> p_proto_cast(PyObject *obj) {
 
     if(v_real::size == 1 && Py_TYPE(obj) == obj_TriangleBatchPrototype::pytype())
         THROW_PYERR_STRING(TypeError,"instances of TriangleBatchPrototype cannot be used to construct a k-d tree when BATCH_SIZE is 1");
+    if(v_real::size == 1 && Py_TYPE(obj) == wrapped_type<n_solid_batch_prototype>::pytype())
+        THROW_PYERR_STRING(TypeError,"instances of SolidBatchPrototype cannot be used to construct a k-d tree when BATCH_SIZE is 1");
     return py::pyptr<obj_PrimitivePrototype>{py::borrowed_ref{p}};
 }
 
-std::tuple<n_aabb,kd_node_unique_ptr<module_store>> build_kdtree(const char *func,PyObject *args,PyObject *kwds,PyObject *mod) {
+/* The arguments of build_kdtree and build_composite_scene, after they have
+   been checked */
+struct accel_args {
+    PyObject *p_iterable;
+    std::vector<py::pyptr<obj_PrimitivePrototype>> primitives;
+    int extra_threads;
+    kd_tree_params kd_params;
+    bvh_params b_params;
+    bool update_p = false;
+    bool frozen = false;
+    bool use_bvh = false;
+
+    accel_args(PyObject *p_iterable,std::vector<py::pyptr<obj_PrimitivePrototype>> &&primitives,int extra_threads) :
+        p_iterable(p_iterable),
+        primitives(std::move(primitives)),
+        extra_threads(extra_threads),
+        kd_params(this->primitives[0]->get_base().dimension()) {}
+
+    /* if "update_primitives" was true, make the list that was passed as
+       "primitives" hold the prototypes that were actually used */
+    void update_primitives() const {
+        if(!update_p) return;
+
+        py::list p_iterable_obj{py::borrowed_ref(p_iterable)};
+        assert(p_iterable_obj.size() >= Py_ssize_t(primitives.size()));
+        if(p_iterable_obj.size() > Py_ssize_t(primitives.size())) {
+            if(PyList_SetSlice(
+                p_iterable,
+                Py_ssize_t(primitives.size()),
+                PyList_GET_SIZE(p_iterable),
+                nullptr)) throw py_error_set{};
+        }
+        for(size_t i = 0; i<primitives.size(); ++i) p_iterable_obj[i] = primitives[i].obj();
+    }
+};
+
+/* If "scene" is true, the "frozen" and "accel" keyword arguments are also
+   accepted. */
+accel_args get_accel_args(const char *func,PyObject *args,PyObject *kwds,bool scene) {
     auto idata = get_instance_data();
     PyObject *names[] = {
         P(primitives),
@@ -3257,6 +3604,11 @@ std::tuple<n_aabb,kd_node_unique_ptr<module_store>> build_kdtree(const char *fun
         P(traversal_cost),
         P(intersection_cost),
         P(update_primitives),
+        P(split_method),
+        P(bins),
+        P(split_axes),
+        scene ? P(frozen) : nullptr,
+        scene ? P(accel) : nullptr,
         nullptr};
 
     get_arg ga{args,kwds,names,func};
@@ -3272,61 +3624,104 @@ std::tuple<n_aabb,kd_node_unique_ptr<module_store>> build_kdtree(const char *fun
     auto traversal = ga(get_arg::KEYWORD_ONLY);
     auto intersection = ga(get_arg::KEYWORD_ONLY);
     auto update_p_obj = ga(get_arg::KEYWORD_ONLY);
-    bool update_p = false;
+    auto split_method = ga(get_arg::KEYWORD_ONLY);
+    auto bins = ga(get_arg::KEYWORD_ONLY);
+    auto split_axes = ga(get_arg::KEYWORD_ONLY);
+    bool frozen = false;
+    bool use_bvh = false;
+
+    if(scene) {
+        auto frozen_obj = ga(get_arg::KEYWORD_ONLY);
+        frozen = frozen_obj && py::is_true(frozen_obj);
+
+        auto accel = ga(get_arg::KEYWORD_ONLY);
+        if(accel) {
+            if(!PyUnicode_Check(accel)) THROW_PYERR_STRING(TypeError,"accel must be a string");
+            if(PyUnicode_CompareWithASCIIString(accel,"bvh") == 0) use_bvh = true;
+            else if(PyUnicode_CompareWithASCIIString(accel,"kdtree") != 0)
+                THROW_PYERR_STRING(ValueError,"accel must be \"kdtree\" or \"bvh\"");
+        }
+    }
 
     ga.finished();
 
+    if(use_bvh && (split_method || split_axes))
+        THROW_PYERR_STRING(TypeError,"split_method and split_axes only apply to a k-d tree and cannot be combined with accel=\"bvh\"");
+
     std::vector<py::pyptr<obj_PrimitivePrototype>> primitives;
     collect_into(primitives,p_iterable,&p_proto_cast);
     if(UNLIKELY(primitives.empty())) THROW_PYERR_STRING(ValueError,"cannot build tree from empty sequence");
 
     size_t dimension = primitives[0]->get_base().dimension();
 
-    kd_tree_params kd_params(dimension);
+    accel_args r{p_iterable,std::move(primitives),extra_threads};
+    r.frozen = frozen;
+    r.use_bvh = use_bvh;
 
     if(max_depth) {
-        kd_params.max_depth = from_pyobject<int>(max_depth);
-        if(kd_params.max_depth < 0) THROW_PYERR_STRING(ValueError,"max_depth cannot be less than 0");
+        r.kd_params.max_depth = r.b_params.max_depth = from_pyobject<int>(max_depth);
+        if(r.kd_params.max_depth < 0) THROW_PYERR_STRING(ValueError,"max_depth cannot be less than 0");
+        if(use_bvh && r.b_params.max_depth > BVH_MAX_DEPTH) {
+            PyErr_Format(PyExc_ValueError,"max_depth cannot be greater than %d for a BVH",BVH_MAX_DEPTH);
+            throw py_error_set();
+        }
     }
 
     if(split_threshold) {
-        kd_params.split_threshold = from_pyobject<int>(split_threshold);
-        if(kd_params.split_threshold < 1) THROW_PYERR_STRING(ValueError,"split_threshold cannot be less than 1");
+        r.kd_params.split_threshold = r.b_params.split_threshold = from_pyobject<int>(split_threshold);
+        if(r.kd_params.split_threshold < 1) THROW_PYERR_STRING(ValueError,"split_threshold cannot be less than 1");
     }
 
-    if(traversal) kd_params.traversal = from_pyobject<real>(traversal);
-    if(intersection) kd_params.intersection = from_pyobject<real>(intersection);
+    if(traversal) r.kd_params.traversal = r.b_params.traversal = from_pyobject<real>(traversal);
+    if(intersection) r.kd_params.intersection = r.b_params.intersection = from_pyobject<real>(intersection);
+
+    if(split_method) {
+        if(!PyUnicode_Check(split_method)) THROW_PYERR_STRING(TypeError,"split_method must be a string");
+        if(PyUnicode_CompareWithASCIIString(split_method,"exact") == 0) r.kd_params.split_method = kd_tree_params::EXACT;
+        else if(PyUnicode_CompareWithASCIIString(split_method,"binned") == 0) r.kd_params.split_method = kd_tree_params::BINNED;
+        else THROW_PYERR_STRING(ValueError,"split_method must be \"exact\" or \"binned\"");
+    }
+
+    if(bins) {
+        r.kd_params.bins = r.b_params.bins = from_pyobject<int>(bins);
+        if(r.kd_params.bins < 2) THROW_PYERR_STRING(ValueError,"bins cannot be less than 2");
+    }
+
+    if(split_axes) {
+        r.kd_params.split_axes = from_pyobject<int>(split_axes);
+        if(r.kd_params.split_axes < 0) THROW_PYERR_STRING(ValueError,"split_axes cannot be less than 0");
+    }
 
     if(update_p_obj && py::is_true(update_p_obj)) {
         if(!PyList_Check(p_iterable)) THROW_PYERR_STRING(
             TypeError,
             "\"primitives\" must be an instance of \"list\" if \"update_primitives\" is true");
-        update_p = true;
+        r.update_p = true;
     }
 
-    for(size_t i=1; i<primitives.size(); ++i) {
-        if(primitives[i]->get_base().dimension() != dimension) THROW_PYERR_STRING(TypeError,"the primitive prototypes must all have the same dimension");
+    for(size_t i=1; i<r.primitives.size(); ++i) {
+        if(r.primitives[i]->get_base().dimension() != dimension) THROW_PYERR_STRING(TypeError,"the primitive prototypes must all have the same dimension");
     }
 
-    auto r = build_kdtree<module_store>(primitives,extra_threads,kd_params);
-    if(update_p) {
-        py::list p_iterable_obj{py::borrowed_ref(p_iterable)};
-        assert(p_iterable_obj.size() >= Py_ssize_t(primitives.size()));
-        if(p_iterable_obj.size() > Py_ssize_t(primitives.size())) {
-            if(PyList_SetSlice(
-                p_iterable,
-                Py_ssize_t(primitives.size()),
-                PyList_GET_SIZE(p_iterable),
-                nullptr)) throw py_error_set{};
-        }
-        for(size_t i = 0; i<primitives.size(); ++i) p_iterable_obj[i] = primitives[i].obj();
-    }
+    return r;
+}
+
+std::tuple<n_aabb,kd_node_unique_ptr<module_store>> build_kdtree(accel_args &a) {
+    auto r = build_kdtree<module_store>(a.primitives,a.extra_threads,a.kd_params);
+    a.update_primitives();
+    return r;
+}
+
+std::tuple<n_aabb,std::shared_ptr<const n_bvh_data>> build_bvh(accel_args &a) {
+    auto r = build_bvh<module_store>(a.primitives,a.b_params);
+    a.update_primitives();
     return r;
 }
 
 FIX_STACK_ALIGN PyObject *obj_build_kdtree(PyObject *mod,PyObject *args,PyObject *kwds) {
     try {
-        auto [boundary,root] = build_kdtree("build_kdtree",args,kwds,mod);
+        auto a = get_accel_args("build_kdtree",args,kwds,false);
+        auto [boundary,root] = build_kdtree(a);
         py::object pyroot{py::new_ref(new_obj_node(nullptr,root.release(),boundary.dimension()))};
         return py::make_tuple(boundary.start,boundary.end,pyroot).new_ref();
     } PY_EXCEPT_HANDLERS(nullptr)
@@ -3334,8 +3729,13 @@ FIX_STACK_ALIGN PyObject *obj_build_kdtree(PyObject *mod,PyObject *args,PyObject
 
 FIX_STACK_ALIGN PyObject *obj_build_composite_scene(PyObject *mod,PyObject *args,PyObject *kwds) {
     try {
-        auto [boundary,root] = build_kdtree("build_composite_scene",args,kwds,mod);
-        return py::ref(new obj_CompositeScene(boundary,std::move(root)));
+        auto a = get_accel_args("build_composite_scene",args,kwds,true);
+        if(a.use_bvh) {
+            auto [boundary,bvh] = build_bvh(a);
+            return py::ref(new obj_CompositeScene(boundary,std::move(bvh),a.frozen));
+        }
+        auto [boundary,root] = build_kdtree(a);
+        return py::ref(new obj_CompositeScene(boundary,std::move(root),a.frozen));
     } PY_EXCEPT_HANDLERS(nullptr)
 }
 
@@ -3390,6 +3790,30 @@ template<typename T> void triangle_extra(PyObject *tri) {
     reinterpret_cast<T*>(tri)->recalculate_d();
 }
 
+void triangle_batch_extra(PyObject *tri,size_t lanes) {
+    reinterpret_cast<obj_TriangleBatch*>(tri)->set_lanes(lanes);
+    triangle_extra<obj_TriangleBatch>(tri);
+}
+
+wrapped_arrays solid_batch_constructor(size_t dimension,int type,material **mat) {
+    wrapped_arrays r;
+    r.data.reset(new float*[dimension+1]);
+
+    auto s = obj_SolidBatch::create(dimension,static_cast<solid_type>(type),mat);
+    r.obj = py::new_ref(s);
+
+    r.data[0] = to_real_array(s->position.data());
+    for(size_t i=0; i<dimension; ++i) r.data[i+1] = to_real_array(s->orientation()[i].data());
+
+    return r;
+}
+
+void solid_batch_extra(PyObject *sobj,size_t lanes) {
+    auto s = reinterpret_cast<obj_SolidBatch*>(sobj);
+    s->set_lanes(lanes);
+    s->recalculate_transform();
+}
+
 /* TODO: do something so that changing "real" to something other than float
    won't cause compile errors */
 tracerx_constructors module_constructors = {
@@ -3399,7 +3823,7 @@ tracerx_constructors module_constructors = {
     &triangle_constructor<obj_Triangle,material>,
     &triangle_constructor<obj_TriangleBatch,material*>,
     &triangle_extra<obj_Triangle>,
-    &triangle_extra<obj_TriangleBatch>,
+    &triangle_batch_extra,
     [](size_t dimension,int type,material *mat) -> wrapped_solid {
         wrapped_solid r;
 
@@ -3419,9 +3843,10 @@ tracerx_constructors module_constructors = {
         return r;
     },
     [](PyObject *sobj) -> void {
-        auto s = reinterpret_cast<obj_Solid*>(sobj);
-        s->inv_orientation = s->orientation.inverse();
-    }
+        reinterpret_cast<obj_Solid*>(sobj)->recalculate_transform();
+    },
+    &solid_batch_constructor,
+    &solid_batch_extra
 };
 
 
@@ -3433,10 +3858,12 @@ PyTypeObject *classes[] = {
     obj_Solid::pytype(),
     obj_Triangle::pytype(),
     obj_TriangleBatch::pytype(),
+    obj_SolidBatch::pytype(),
     obj_FrozenVectorView::pytype(),
     obj_KDNode::pytype(),
     obj_KDLeaf::pytype(),
     obj_KDBranch::pytype(),
+    obj_BVH::pytype(),
     wrapped_type<py_ray_intersection>::pytype(),
     wrapped_type<n_vector>::pytype(),
     wrapped_type<n_vector_batch>::pytype(),
@@ -3453,6 +3880,7 @@ PyTypeObject *classes[] = {
     wrapped_type<n_detatched_triangle_point<v_real> >::pytype(),
     obj_TriangleBatchPointData::pytype(),
     wrapped_type<n_solid_prototype>::pytype(),
+    wrapped_type<n_solid_batch_prototype>::pytype(),
     wrapped_type<n_point_light>::pytype(),
     wrapped_type<n_global_light>::pytype(),
     cs_light_list<point_light_list_base>::pytype(),
@@ -160,12 +160,12 @@ namespace py {
 
     #if !defined(Py_LIMITED_API) && PY_VERSION_HEX >= 0x03090000
         template<typename... Args> PyObject *vectorcall(Args*... args) const {
-            PyObject **argarray[] = {nullptr,args...};
-            return check_new_ref(PyObject_Vectorcall(
+            PyObject *argarray[] = {nullptr,args...};
+            return PyObject_Vectorcall(
                 _ptr,
                 argarray+1,
                 sizeof...(Args) | PY_VECTORCALL_ARGUMENTS_OFFSET,
-                nullptr));
+                nullptr);
         }
     #endif
 
@@ -5,11 +5,15 @@
 #include <exception>
 #include <assert.h>
 #include <vector>
+#include <deque>
+#include <string>
 #include <thread>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include <memory>
+#include <algorithm>
 #include <unordered_map>
 
 #include "pyobject.hpp"
@@ -40,7 +44,23 @@ typedef char py_bool;
 typedef unsigned char byte;
 
 
-const int RENDER_CHUNK_SIZE = 32;
+// the default width and height of the squares that an image is divided into
+const int RENDER_CHUNK_SIZE = 16;
+
+/* Each time a rendering thread needs more work, it takes the remaining chunks
+   divided by the number of threads and this (but at least one chunk). Taking
+   big runs at the start keeps each thread on neighboring pixels, while the
+   single chunks at the end keep the threads from finishing at different
+   times. */
+const unsigned int RENDER_CHUNK_SHARE_DIVISOR = 2;
+
+/* the most passes a progressive render can make before the one at full
+   resolution */
+const int MAX_PROGRESSIVE_LEVELS = 8;
+
+/* the largest block of pixels that a single traced pixel can stand in for,
+   when rendering at a lower resolution to meet "target_frame_ms" */
+const int MAX_RENDER_SCALE = 16;
 const int DEFAULT_SPECULAR_EXP = 8;
 
 /* this is number of bits of the largest number that can be stored in a "long"
@@ -73,6 +93,7 @@ struct instance_data_t {
     PyObject *triangle_unpickle;
     PyObject *triangle_batch_unpickle;
     PyObject *solid_unpickle;
+    PyObject *solid_batch_unpickle;
     PyObject *aabb_unpickle;
     interned_strings istrings;
 };
@@ -321,7 +342,25 @@ PyTypeObject obj_ChannelList::_pytype = make_pytype(
     }});
 
 
+/* Interleave the bits of "x" and "y". Sorting points by this value orders
+   them along a Z-order curve. */
+uint64_t morton_code(uint32_t x,uint32_t y) {
+    auto spread = [](uint64_t v) {
+        v = (v | (v << 16)) & 0x0000ffff0000ffffu;
+        v = (v | (v << 8)) & 0x00ff00ff00ff00ffu;
+        v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0fu;
+        v = (v | (v << 2)) & 0x3333333333333333u;
+        v = (v | (v << 1)) & 0x5555555555555555u;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
 struct renderer {
+    struct chunk_pos {
+        int x, y;
+    };
+
     volatile unsigned int busy_threads;
     volatile unsigned int job;
     image_format format;
@@ -332,20 +371,232 @@ struct renderer {
     std::atomic<unsigned int> chunk;
     volatile enum state_t {NORMAL,CANCEL,QUIT} state;
 
+    int chunk_size;
+
+    // the number of threads that call "worker_draw" for each job
+    unsigned int draw_threads;
+
+    /* The top-left corner of every chunk of the image, in the order they are
+       handed out. Consecutive chunks are usually adjacent, so a thread taking
+       several at once works on one area of the scene. */
+    std::vector<chunk_pos> chunks;
+
+    /* For progressive rendering, the number of passes before the one at full
+       resolution. With "step" equal to "scale" times 2 to the power of
+       "levels - level", each pass traces the pixels that are a multiple of
+       "step" away from the top-left corner of their chunk and that no earlier
+       pass traced, and copies each one over the "step" by "step" block that
+       it is the top-left corner of. */
+    int levels;
+    int level;
+    unsigned int level_waiting;
+    std::condition_variable level_cond;
+
+    /* If not null, this is called after each pass but the last, with "owner"
+       and the size of the blocks */
+    PyObject *level_callback;
+    PyObject *owner;
+
+    /* If greater than zero, each job is drawn at the largest resolution that
+       the time taken by the previous job suggests can be drawn in this many
+       milliseconds. This is only accessed while holding the GIL. */
+    double target_frame_ms;
+
+    /* Every pass, including the last, only traces one pixel per "scale" by
+       "scale" block. This is picked by "prepare_job". */
+    int scale;
+
+    /* the time it took to draw the previous job, divided by the number of
+       pixels traced, or zero if it's unknown */
+    double pixel_ms;
+    std::chrono::steady_clock::time_point job_start;
+
+    /* The chunks that the last pass finished drawing, as indices into
+       "chunks" plus one, in the order they were finished. A drawing thread
+       reserves an entry by incrementing "finished_end" and then stores the
+       index. An entry of zero hasn't been stored yet. */
+    std::unique_ptr<std::atomic<unsigned int>[]> finished;
+    std::atomic<unsigned int> finished_end;
+
+    // the number of entries of "finished" already returned by "take_finished"
+    unsigned int finished_read;
+
+    /* must be called with "format", "levels" and "level_callback" set, before
+       starting the workers */
+    void prepare_job(double target_frame_ms);
+
+    // called by a drawing thread when it finishes "chunks[i]" in the last pass
+    void chunk_finished(unsigned int i) {
+        finished[finished_end.fetch_add(1,std::memory_order_relaxed)].store(i+1,std::memory_order_release);
+    }
+
+    /* Append the chunks finished since the last call to "out". This must be
+       called while holding "mut". */
+    void take_finished(std::vector<chunk_pos> &out);
+
+    /* Called once the workers have finished a job. If the job wasn't
+       canceled, this updates "pixel_ms". */
+    void finish_job();
+
+    /* Called by each drawing thread after it runs out of chunks to draw.
+       Waits for the other threads to finish the pass and returns true if
+       there is another pass to draw. */
+    bool finish_level();
+
 protected:
-    renderer() : busy_threads(0), job(0), state(NORMAL) {}
+    renderer(int chunk_size) : busy_threads(0), job(0), state(NORMAL), chunk_size(chunk_size), draw_threads(0), levels(0), level(0), level_waiting(0), level_callback(nullptr), owner(nullptr), target_frame_ms(0), scale(1), pixel_ms(0), finished_end(0), finished_read(0) {}
     ~renderer() {}
+
+    // the number of pixels traced in a job at the given scale
+    double traced_pixels(int s) const {
+        return double((format.width + s - 1) / s) * double((format.height + s - 1) / s);
+    }
+
+private:
+    int chunks_x = 0;
+    int chunks_y = 0;
 };
 
+void renderer::prepare_job(double target_frame_ms) {
+    chunk.store(0,std::memory_order_relaxed);
+    level = 0;
+    level_waiting = 0;
+
+    scale = 1;
+    if(target_frame_ms > 0 && pixel_ms > 0) {
+        while(scale < MAX_RENDER_SCALE && pixel_ms * traced_pixels(scale) > target_frame_ms) ++scale;
+    }
+    job_start = std::chrono::steady_clock::now();
+
+    int cx = (format.width + chunk_size - 1) / chunk_size;
+    int cy = (format.height + chunk_size - 1) / chunk_size;
+    size_t total = static_cast<size_t>(cx) * static_cast<size_t>(cy);
+    bool same = cx == chunks_x && cy == chunks_y;
+
+    if(!same) finished.reset(new std::atomic<unsigned int>[total]);
+    for(size_t i=0; i<total; ++i) finished[i].store(0,std::memory_order_relaxed);
+    finished_end.store(0,std::memory_order_relaxed);
+    finished_read = 0;
+
+    if(same) return;
+
+    chunks_x = cx;
+    chunks_y = cy;
+    chunks.clear();
+    chunks.reserve(total);
+    for(int y=0; y<cy; ++y) {
+        for(int x=0; x<cx; ++x) chunks.push_back({x*chunk_size,y*chunk_size});
+    }
+
+    /* order the chunks along a Z-order curve over the grid of chunks, which
+       isn't the same as one over their pixel coordinates unless "chunk_size"
+       is a power of two */
+    int size = chunk_size;
+    std::sort(chunks.begin(),chunks.end(),[=](chunk_pos a,chunk_pos b) {
+        return morton_code(static_cast<uint32_t>(a.x/size),static_cast<uint32_t>(a.y/size))
+            < morton_code(static_cast<uint32_t>(b.x/size),static_cast<uint32_t>(b.y/size));
+    });
+}
+
+void renderer::take_finished(std::vector<chunk_pos> &out) {
+    if(!finished) return;
+
+    unsigned int end = finished_end.load(std::memory_order_relaxed);
+    for(; finished_read < end; ++finished_read) {
+        unsigned int i = finished[finished_read].load(std::memory_order_acquire);
+
+        // the thread that reserved this entry hasn't stored it yet
+        if(!i) break;
+
+        out.push_back(chunks[i-1]);
+    }
+}
+
+void renderer::finish_job() {
+    if(state != NORMAL) return;
+
+    std::chrono::duration<double,std::milli> elapsed = std::chrono::steady_clock::now() - job_start;
+    pixel_ms = elapsed.count() / traced_pixels(scale);
+}
+
+bool renderer::finish_level() {
+    std::unique_lock<std::mutex> lock(mut);
+
+    if(level == levels || state != NORMAL) return false;
+
+    if(++level_waiting < draw_threads) {
+        int current = level;
+        level_cond.wait(lock,[=]{ return level != current || state != NORMAL; });
+        return state == NORMAL;
+    }
+
+    // the last thread to finish a pass starts the next one
+
+    level_waiting = 0;
+    if(level_callback) {
+        lock.unlock();
+        {
+            py::acquire_gil gil;
+            try {
+                py::object(py::borrowed_ref(level_callback))(py::object(py::borrowed_ref(owner)),1 << (levels - level));
+            } catch(py_error_set&) {
+                PyErr_Print();
+            } catch(std::exception &e) {
+                PySys_WriteStderr("error: %.500s\n",e.what());
+            }
+        }
+        lock.lock();
+    }
+
+    ++level;
+    chunk.store(0,std::memory_order_relaxed);
+    level_cond.notify_all();
+    return state == NORMAL;
+}
+
 struct callback_renderer_obj_base;
 template<typename Base> struct obj_Renderer;
 
 struct callback_renderer : renderer {
+    /* Everything "begin_render" is given. This is also used to hold on to the
+       running job while its callback is called. */
+    struct job_data {
+        Py_buffer buffer;
+        image_format format;
+        scene *sc;
+        PyObject *scene_obj;
+        PyObject *callback;
+        int levels;
+        PyObject *level_callback;
+        double target_frame_ms;
+    };
+
     std::condition_variable barrier;
     PyObject *callback;
+    PyObject *scene_obj;
+
+    /* Jobs passed to "begin_render" while another job was running. When the
+       workers finish a job, the last one to finish starts the next job in
+       this queue before calling the callback of the finished job. */
+    std::deque<job_data> pending;
+    unsigned int max_pending;
 
-    callback_renderer(obj_Renderer<callback_renderer_obj_base> *self,unsigned int threads=0);
+    callback_renderer(obj_Renderer<callback_renderer_obj_base> *self,unsigned int threads=0,int chunk_size=RENDER_CHUNK_SIZE,unsigned int max_pending=0);
     ~callback_renderer();
+
+    /* Start drawing "j". This must be called while holding "mut" with no job
+       running. Locking the scene is left to the caller. */
+    void start_job(const job_data &j);
+
+    // the job currently running
+    job_data current_job() const {
+        return {buffer,format,sc,scene_obj,callback,levels,level_callback,0};
+    }
+
+    /* Unlock the scene, release the buffer and drop the references of a job
+       that has finished or was canceled. This must be called while holding
+       the GIL. */
+    static void release_job(job_data &j,PyObject *self);
 };
 
 template<> struct _wrapped_type<scene> {
@@ -396,24 +647,32 @@ template<> struct _wrapped_type<callback_renderer> {
 struct process_pixel {
     typedef float item_t;
     static const int v_score = impl::V_SCORE_THRESHHOLD;
-    static const int max_items = RENDER_CHUNK_SIZE;
+
+    // a row of a chunk can be longer or shorter than any vector
+    static constexpr size_t max_items = simd::v_sizes<float>::value[0];
 
     byte *pixels;
     renderer &r;
     geom_allocator *allocator;
     int y;
 
-    template<size_t Size> bool operator()(size_t x) {
+    // pixel "i" is at "x0 + i*stride"
+    int x0;
+    int stride;
+
+    template<size_t Size> bool operator()(size_t i) {
         typedef simd::v_type<float,Size> v_float;
 
         _color<v_float> c;
 
+        if(UNLIKELY(r.state != renderer::NORMAL)) return true;
+
+        color c1[Size];
+        r.sc->calculate_colors(x0 + static_cast<int>(i)*stride,y,static_cast<int>(Size),stride,c1,allocator);
         for(size_t i=0; i<Size; ++i) {
-            if(UNLIKELY(r.state != renderer::NORMAL)) return true;
-            color c1 = r.sc->calculate_color(static_cast<int>(x+i),y,allocator);
-            c.r()[i] = c1.r();
-            c.g()[i] = c1.g();
-            c.b()[i] = c1.b();
+            c.r()[i] = c1[i].r();
+            c.g()[i] = c1[i].g();
+            c.b()[i] = c1[i].b();
         }
 
         int b_offset[Size] = {0};
@@ -459,51 +718,116 @@ struct process_pixel {
                 for(int j = 0; j < r.format.bytes_per_pixel; ++j)
                     *pixels++ = static_cast<byte>(temp[i][j/sizeof(long)] >> ((sizeof(long) - 1 - (j % sizeof(long))) * 8));
             }
+            pixels += (stride - 1) * r.format.bytes_per_pixel;
         }
 
         return false;
     }
 };
 
+int get_levels(PyObject *obj) {
+    if(!obj) return 0;
+
+    int levels = from_pyobject<int>(obj);
+    if(levels < 0 || levels > MAX_PROGRESSIVE_LEVELS) {
+        PyErr_Format(PyExc_ValueError,"\"progressive\" must be between 0 and %d",MAX_PROGRESSIVE_LEVELS);
+        throw py_error_set();
+    }
+    return levels;
+}
+
+PyObject *get_level_callback(PyObject *obj) {
+    return obj == Py_None ? nullptr : obj;
+}
+
+int get_chunk_size(PyObject *obj) {
+    if(!obj) return RENDER_CHUNK_SIZE;
+
+    int chunk_size = from_pyobject<int>(obj);
+    if(chunk_size < 1) THROW_PYERR_STRING(ValueError,"\"chunk_size\" cannot be less than 1");
+    return chunk_size;
+}
+
+/* Draw the pixels of one chunk that belong to the current pass. Returns true
+   if the job was canceled.
+
+   The blocks are aligned to the chunk and cut off at its edges, so that
+   nothing outside of the chunk is written. */
+bool draw_chunk(renderer &r,geom_allocator *allocator,renderer::chunk_pos c) {
+    int step = r.scale << (r.levels - r.level);
+    int end_x = std::min(c.x+r.chunk_size,r.format.width);
+    int end_y = std::min(c.y+r.chunk_size,r.format.height);
+    int bpp = r.format.bytes_per_pixel;
+
+    for(int y = c.y; y < end_y; y += step) {
+        // in rows that an earlier pass went through, only every other pixel is new
+        int x = c.x;
+        int x_step = step;
+        if(r.level && (y - c.y) % (step*2) == 0) {
+            x += step;
+            x_step = step*2;
+        }
+        if(x >= end_x) continue;
+
+        byte *row = reinterpret_cast<byte*>(r.buffer.buf) + y * r.format.pitch;
+        if(UNLIKELY(impl::v_rep_until(
+            static_cast<size_t>((end_x - x + x_step - 1) / x_step),
+            process_pixel{row + x * bpp,r,allocator,y,x,x_step}))) return true;
+
+        if(step > 1) {
+            // copy each new pixel over the rest of its block
+            int h = std::min(step,end_y - y);
+            for(; x < end_x; x += x_step) {
+                byte *pixel = row + x * bpp;
+                int w = std::min(step,end_x - x);
+                for(int j=0; j<h; ++j) {
+                    for(int i=(j ? 0 : 1); i<w; ++i) {
+                        memcpy(pixel + j * r.format.pitch + i * bpp,pixel,static_cast<size_t>(bpp));
+                    }
+                }
+            }
+        }
+    }
+
+    return false;
+}
+
 void worker_draw(renderer &r) {
-    int chunks_x = (r.format.width + RENDER_CHUNK_SIZE - 1) / RENDER_CHUNK_SIZE;
-    int chunks_y = (r.format.height + RENDER_CHUNK_SIZE - 1) / RENDER_CHUNK_SIZE;
+    auto total = static_cast<unsigned int>(r.chunks.size());
+    auto divisor = r.draw_threads * RENDER_CHUNK_SHARE_DIVISOR;
 
     std::unique_ptr<geom_allocator> allocator{r.sc->new_allocator()};
 
-    for(;;) {
-        int chunk = r.chunk.fetch_add(1);
-        int start_y = chunk/chunks_x;
-        int start_x = chunk%chunks_x;
-        if(start_y > chunks_y) break;
-        start_x *= RENDER_CHUNK_SIZE;
-        start_y *= RENDER_CHUNK_SIZE;
-
-        for(int y = start_y; y < std::min(start_y+RENDER_CHUNK_SIZE,r.format.height); ++y) {
-            if(UNLIKELY(impl::v_rep_until(
-                static_cast<size_t>(start_x),
-                static_cast<size_t>(std::min(start_x+RENDER_CHUNK_SIZE,r.format.width)),
-                process_pixel{
-                    reinterpret_cast<byte*>(r.buffer.buf) + y * r.format.pitch + start_x * r.format.bytes_per_pixel,
-                    r,
-                    allocator.get(),
-                    y}))) return;
+    do {
+        unsigned int start = r.chunk.load(std::memory_order_relaxed);
+        while(start < total) {
+            unsigned int count = std::max((total - start) / divisor,1u);
+            if(!r.chunk.compare_exchange_weak(start,start + count,std::memory_order_relaxed)) continue;
+
+            for(unsigned int i=start; i<start+count; ++i) {
+                if(UNLIKELY(draw_chunk(r,allocator.get(),r.chunks[i]))) return;
+                if(r.level == r.levels) r.chunk_finished(i);
+            }
+
+            start = r.chunk.load(std::memory_order_relaxed);
         }
-    }
+    } while(r.finish_level());
 }
 
 FIX_STACK_ALIGN void callback_worker(obj_CallbackRenderer *self) {
     callback_renderer &r = self->base;
 
-    if(!r.busy_threads) {
+    {
+        /* The first job may have been started before this thread got here,
+           so "busy_threads" is checked before waiting. */
         std::unique_lock<std::mutex> lock(r.mut);
 
-        do {
+        while(!r.busy_threads) {
             if(UNLIKELY(r.state == renderer::QUIT)) return;
 
             // wait for the first job
             r.barrier.wait(lock);
-        } while(!r.busy_threads);
+        }
     }
 
     for(;;) {
@@ -519,14 +843,32 @@ FIX_STACK_ALIGN void callback_worker(obj_CallbackRenderer *self) {
             if(--r.busy_threads == 0) {
                 // when all the workers are finished
 
-                r.sc->unlock();
+                r.finish_job();
+                auto done = r.current_job();
 
-                py::acquire_gil gil;
+                /* Start the next job before calling the callback, so the
+                   other workers can begin drawing it right away. If this
+                   fails, the job is dropped and the one after it is tried. */
+                std::vector<std::pair<callback_renderer::job_data,std::string>> dropped;
+                while(r.state == renderer::NORMAL && !r.pending.empty()) {
+                    auto next = r.pending.front();
+                    r.pending.pop_front();
+                    try {
+                        r.start_job(next);
+                        break;
+                    } catch(std::exception &e) {
+                        dropped.emplace_back(next,e.what());
+                    }
+                }
+
+                done.sc->unlock();
 
-                PyBuffer_Release(&r.buffer);
+                py::acquire_gil gil;
 
-                // r.callback may be changed after calling it
-                PyObject *callback = r.callback;
+                for(auto &d : dropped) {
+                    PySys_WriteStderr("error: %.500s\n",d.second.c_str());
+                    callback_renderer::release_job(d.first,reinterpret_cast<PyObject*>(self));
+                }
 
                 if(LIKELY(r.state == renderer::NORMAL)) {
                     // notify the main thread
@@ -534,7 +876,7 @@ FIX_STACK_ALIGN void callback_worker(obj_CallbackRenderer *self) {
                     // in case the callback calls start_render/abort_render
                     lock.unlock();
                     try {
-                        py::object(py::borrowed_ref(callback))(self);
+                        py::object(py::borrowed_ref(done.callback))(self);
                     } catch(py_error_set&) {
                         PyErr_Print();
                     } catch(std::exception &e) {
@@ -548,8 +890,9 @@ FIX_STACK_ALIGN void callback_worker(obj_CallbackRenderer *self) {
                     r.barrier.notify_all();
                 }
 
-                Py_DECREF(callback);
-                Py_DECREF(self);
+                // the scene was already unlocked
+                done.sc = nullptr;
+                callback_renderer::release_job(done,reinterpret_cast<PyObject*>(self));
             }
 
             while(finished == r.job) {
@@ -562,11 +905,14 @@ FIX_STACK_ALIGN void callback_worker(obj_CallbackRenderer *self) {
     }
 }
 
-callback_renderer::callback_renderer(obj_CallbackRenderer *self,unsigned int threads) {
+callback_renderer::callback_renderer(obj_CallbackRenderer *self,unsigned int threads,int chunk_size,unsigned int max_pending) : renderer(chunk_size), callback(nullptr), scene_obj(nullptr), max_pending(max_pending) {
+    owner = reinterpret_cast<PyObject*>(self);
+
     if(threads == 0) {
         threads = std::thread::hardware_concurrency();
         if(threads == 0) threads = 1;
     }
+    draw_threads = threads;
     workers.reserve(threads);
     for(unsigned int i=0; i<threads; ++i) workers.push_back(std::thread(callback_worker,self));
 }
@@ -582,6 +928,43 @@ callback_renderer::~callback_renderer() {
     for(auto &w : workers) w.join();
 }
 
+void callback_renderer::start_job(const job_data &j) {
+    j.sc->set_view_size(j.format.width,j.format.height);
+
+    format = j.format;
+    buffer = j.buffer;
+    callback = j.callback;
+    scene_obj = j.scene_obj;
+    levels = j.levels;
+    level_callback = j.level_callback;
+    prepare_job(j.target_frame_ms);
+    sc = j.sc;
+    busy_threads = static_cast<unsigned int>(workers.size());
+    barrier.notify_all();
+    ++job;
+}
+
+void callback_renderer::release_job(job_data &j,PyObject *self) {
+    if(j.sc) j.sc->unlock();
+    PyBuffer_Release(&j.buffer);
+    Py_XDECREF(j.level_callback);
+    Py_DECREF(j.callback);
+    Py_DECREF(j.scene_obj);
+    Py_DECREF(self);
+}
+
+
+/* Locks a scene for as long as it exists. This must be created while the GIL
+   is held, otherwise another thread could change the scene after it is
+   checked but before it is locked. */
+struct scene_lock {
+    scene *sc;
+    scene_lock(scene &sc) : sc(&sc) { sc.lock(); }
+    ~scene_lock() { if(sc) sc->unlock(); }
+
+    // keep the scene locked after this is destroyed
+    void release() { sc = nullptr; }
+};
 
 FIX_STACK_ALIGN PyObject *obj_Scene_calculate_color(obj_Scene *self,NTRACER_COMPAT_FASTCALL_KEYWORD_PARAMS) {
     auto idata = get_instance_data();
@@ -596,11 +979,7 @@ FIX_STACK_ALIGN PyObject *obj_Scene_calculate_color(obj_Scene *self,NTRACER_COMP
 
         color r;
 
-        struct s_lock {
-            scene &sc;
-            s_lock(scene &sc) : sc(sc) { sc.lock(); }
-            ~s_lock() { sc.unlock(); }
-        } _(sc);
+        scene_lock _(sc);
 
         {
             py::allow_threads __;
@@ -644,6 +1023,60 @@ template<typename T> FIX_STACK_ALIGN void obj_Renderer_dealloc(wrapped_type<T> *
     Py_TYPE(self)->tp_free(py::ref(self));
 }
 
+template<typename T> FIX_STACK_ALIGN PyObject *obj_Renderer_get_target_frame_ms(wrapped_type<T> *self,void*) {
+    try {
+        return to_pyobject(self->get_base().target_frame_ms);
+    } PY_EXCEPT_HANDLERS(nullptr)
+}
+
+template<typename T> FIX_STACK_ALIGN int obj_Renderer_set_target_frame_ms(wrapped_type<T> *self,PyObject *arg,void*) {
+    try {
+        setter_no_delete(arg);
+        double ms = from_pyobject<double>(arg);
+        if(!(ms >= 0)) THROW_PYERR_STRING(ValueError,"\"target_frame_ms\" cannot be negative");
+        self->get_base().target_frame_ms = ms;
+        return 0;
+    } PY_EXCEPT_HANDLERS(-1)
+}
+
+template<typename T> FIX_STACK_ALIGN PyObject *obj_Renderer_get_scale(wrapped_type<T> *self,void*) {
+    try {
+        return to_pyobject(self->get_base().scale);
+    } PY_EXCEPT_HANDLERS(nullptr)
+}
+
+template<typename T> FIX_STACK_ALIGN PyObject *obj_Renderer_finished_chunks(wrapped_type<T> *self,PyObject*) {
+    try {
+        auto &r = self->get_base();
+
+        std::vector<renderer::chunk_pos> found;
+        int size, width, height;
+        {
+            py::allow_threads _;
+            std::lock_guard<std::mutex> lock(r.mut);
+            r.take_finished(found);
+            size = r.chunk_size;
+            width = r.format.width;
+            height = r.format.height;
+        }
+
+        py::list chunks;
+        for(auto c : found) {
+            chunks.append(py::make_tuple(c.x,c.y,std::min(size,width-c.x),std::min(size,height-c.y)));
+        }
+        return chunks.new_ref();
+    } PY_EXCEPT_HANDLERS(nullptr)
+}
+
+template<typename T> struct obj_Renderer_getset {
+    static PyGetSetDef value[];
+};
+template<typename T> PyGetSetDef obj_Renderer_getset<T>::value[] = {
+    {"target_frame_ms",reinterpret_cast<getter>(&obj_Renderer_get_target_frame_ms<T>),reinterpret_cast<setter>(&obj_Renderer_set_target_frame_ms<T>),NULL,NULL},
+    {"scale",reinterpret_cast<getter>(&obj_Renderer_get_scale<T>),NULL,NULL,NULL},
+    {NULL}
+};
+
 void get_writable_buffer(PyObject *obj,Py_buffer &buff) {
     if(PyObject_GetBuffer(obj,&buff,PyBUF_WRITABLE)) throw py_error_set();
 }
@@ -653,45 +1086,62 @@ FIX_STACK_ALIGN PyObject *obj_CallbackRenderer_begin_render(obj_CallbackRenderer
     try {
         callback_renderer &r = self->get_base();
 
-        PyObject *names[] = {P(dest),P(format),P(scene),P(callback),nullptr};
+        PyObject *names[] = {P(dest),P(format),P(scene),P(callback),P(progressive),P(level_callback),nullptr};
         get_arg ga(args,kwds,names,"CallbackRenderer.begin_render");
         auto dest = ga(true);
         auto &format = get_base<image_format>(ga(true));
-        auto &sc = get_base<scene>(ga(true));
+        auto scene_obj = ga(true);
+        auto &sc = get_base<scene>(scene_obj);
         auto callback = ga(true);
+        int levels = get_levels(ga(false));
+        PyObject *level_callback = get_level_callback(ga(false));
         ga.finished();
 
-        Py_buffer view;
-        get_writable_buffer(dest,view);
+        callback_renderer::job_data j;
+        get_writable_buffer(dest,j.buffer);
+        j.format = format;
+        j.sc = &sc;
+        j.scene_obj = scene_obj;
+        j.callback = callback;
+        j.levels = levels;
+        j.level_callback = level_callback;
+        j.target_frame_ms = r.target_frame_ms;
 
         Py_INCREF(self);
+        Py_INCREF(scene_obj);
         Py_INCREF(callback);
+        Py_XINCREF(level_callback);
 
         try {
-            im_check_buffer_size(format,view);
+            im_check_buffer_size(format,j.buffer);
 
-            py::allow_threads _; // without this, a dead-lock can occur
-            std::lock_guard<std::mutex> lock(r.mut);
+            /* The scene is locked while the GIL is still held, so it can't
+               change before "start_job" reads it. It stays locked until the
+               job is released. */
+            scene_lock s_lock(sc);
 
-            if(r.busy_threads) throw already_running_error();
+            {
+                py::allow_threads _; // without this, a dead-lock can occur
+                std::lock_guard<std::mutex> lock(r.mut);
+
+                if(r.busy_threads) {
+                    if(r.pending.size() >= r.max_pending) throw already_running_error();
 
-            assert(r.state == renderer::NORMAL);
+                    r.pending.push_back(j);
+                } else {
+                    assert(r.state == renderer::NORMAL && r.pending.empty());
 
-            sc.set_view_size(format.width,format.height);
+                    r.start_job(j);
+                }
+            }
 
-            r.format = format;
-            r.buffer = view;
-            r.callback = callback;
-            r.busy_threads = static_cast<unsigned int>(r.workers.size());
-            r.chunk.store(0,std::memory_order_relaxed);
-            r.sc = &sc;
-            sc.lock();
-            r.barrier.notify_all();
-            ++r.job;
+            s_lock.release();
         } catch(...) {
+            Py_XDECREF(level_callback);
             Py_DECREF(callback);
+            Py_DECREF(scene_obj);
             Py_DECREF(self);
-            PyBuffer_Release(&view);
+            PyBuffer_Release(&j.buffer);
             throw;
         }
 
@@ -703,20 +1153,33 @@ FIX_STACK_ALIGN PyObject *obj_CallbackRenderer_abort_render(obj_CallbackRenderer
     try {
         callback_renderer &r = self->get_base();
 
+        std::deque<callback_renderer::job_data> dropped;
+
         {
             py::allow_threads _; // without this, a dead-lock can occur
             std::unique_lock<std::mutex> lock(r.mut);
 
             if(r.busy_threads) {
+                /* Callbacks are called from the worker threads. A worker
+                   would wait for itself to finish. */
+                for(auto &w : r.workers) {
+                    if(w.get_id() == std::this_thread::get_id()) throw std::logic_error("abort_render cannot be called from a callback while the renderer is running");
+                }
+
                 r.state = renderer::CANCEL;
                 r.barrier.notify_all();
+                r.level_cond.notify_all();
                 do {
                     r.barrier.wait(lock);
                 } while(r.busy_threads);
                 r.state = renderer::NORMAL;
             }
+
+            dropped.swap(r.pending);
         }
 
+        for(auto &j : dropped) callback_renderer::release_job(j,reinterpret_cast<PyObject*>(self));
+
         Py_RETURN_NONE;
     } PY_EXCEPT_HANDLERS(nullptr)
 }
@@ -724,6 +1187,7 @@ FIX_STACK_ALIGN PyObject *obj_CallbackRenderer_abort_render(obj_CallbackRenderer
 PyMethodDef obj_CallbackRenderer_methods[] = {
     {"begin_render",reinterpret_cast<PyCFunction>(&obj_CallbackRenderer_begin_render),METH_VARARGS|METH_KEYWORDS,NULL},
     {"abort_render",reinterpret_cast<PyCFunction>(&obj_CallbackRenderer_abort_render),METH_NOARGS,NULL},
+    {"finished_chunks",reinterpret_cast<PyCFunction>(&obj_Renderer_finished_chunks<callback_renderer>),METH_NOARGS,NULL},
     {NULL}
 };
 
@@ -741,12 +1205,15 @@ FIX_STACK_ALIGN int obj_CallbackRenderer_init(obj_CallbackRenderer *self,PyObjec
     }
 
     try {
-        PyObject *names[] = {P(threads),nullptr};
+        PyObject *names[] = {P(threads),P(chunk_size),P(max_pending),nullptr};
         get_arg ga(args,kwds,names,"CallbackRenderer.__init__");
         PyObject *temp = ga(false);
         unsigned int threads = temp ? from_pyobject<unsigned int>(temp) : 0;
+        int chunk_size = get_chunk_size(ga(false));
+        temp = ga(false);
+        unsigned int max_pending = temp ? from_pyobject<unsigned int>(temp) : 0;
         ga.finished();
-        new(&self->base) callback_renderer(self,threads);
+        new(&self->base) callback_renderer(self,threads,chunk_size,max_pending);
     } PY_EXCEPT_HANDLERS(-1)
 
     return 0;
@@ -762,6 +1229,7 @@ PyTypeObject callback_renderer_obj_base::_pytype = make_pytype(
     .tp_clear = &clear_idict<obj_CallbackRenderer>,
     .tp_weaklistoffset = offsetof(obj_CallbackRenderer,weaklist),
     .tp_methods = obj_CallbackRenderer_methods,
+    .tp_getset = obj_Renderer_getset<callback_renderer>::value,
     .tp_dictoffset = offsetof(obj_CallbackRenderer,idict),
     .tp_init = reinterpret_cast<initproc>(&obj_CallbackRenderer_init)});
 
@@ -769,7 +1237,7 @@ PyTypeObject callback_renderer_obj_base::_pytype = make_pytype(
 struct blocking_renderer : renderer {
     std::condition_variable start_cond, finish_cond;
 
-    blocking_renderer(int threads=-1);
+    blocking_renderer(int threads=-1,int chunk_size=RENDER_CHUNK_SIZE);
     ~blocking_renderer();
 };
 
@@ -799,9 +1267,14 @@ bool wait_for_job(blocking_renderer &r,std::unique_lock<std::mutex> &lock) {
 }
 
 void blocking_worker(blocking_renderer &r) {
-    if(!r.busy_threads) {
+    {
+        // the same as in "callback_worker"
         std::unique_lock<std::mutex> lock(r.mut);
-        if(!wait_for_job(r,lock)) return;
+
+        while(!r.busy_threads) {
+            if(UNLIKELY(r.state == renderer::QUIT)) return;
+            r.start_cond.wait(lock);
+        }
     }
 
     for(;;) {
@@ -826,11 +1299,15 @@ void blocking_worker(blocking_renderer &r) {
     }
 }
 
-blocking_renderer::blocking_renderer(int threads) : renderer() {
+blocking_renderer::blocking_renderer(int threads,int chunk_size) : renderer(chunk_size) {
     if(threads < 0) {
         threads = int(std::thread::hardware_concurrency()) - 1;
         if(threads < 0) threads = 0;
     }
+
+    // the thread that calls "render" draws too
+    draw_threads = static_cast<unsigned int>(threads) + 1;
+
     if(threads) {
         workers.reserve(threads);
         for(int i=0; i<threads; ++i) workers.push_back(std::thread(blocking_worker,std::ref(*this)));
@@ -855,11 +1332,15 @@ FIX_STACK_ALIGN PyObject *obj_BlockingRenderer_render(obj_BlockingRenderer *self
     try {
         auto &r = self->get_base();
 
-        PyObject *names[] = {P(dest),P(format),P(scene),nullptr};
+        PyObject *names[] = {P(dest),P(format),P(scene),P(progressive),P(level_callback),nullptr};
         get_arg ga(args,kwds,names,"BlockingRenderer.render");
         auto dest = ga(true);
         auto &fmt = get_base<image_format>(ga(true));
         auto &sc = get_base<scene>(ga(true));
+        int levels = get_levels(ga(false));
+
+        // this is kept alive by "args" or "kwds" until rendering is done
+        PyObject *level_callback = get_level_callback(ga(false));
         ga.finished();
 
         struct buffer {
@@ -870,8 +1351,11 @@ FIX_STACK_ALIGN PyObject *obj_BlockingRenderer_render(obj_BlockingRenderer *self
 
         im_check_buffer_size(fmt,buff.data);
 
+        double target_frame_ms = r.target_frame_ms;
         bool finished;
 
+        scene_lock s_lock(sc);
+
         {
             py::allow_threads _;
 
@@ -885,10 +1369,12 @@ FIX_STACK_ALIGN PyObject *obj_BlockingRenderer_render(obj_BlockingRenderer *self
                 r.format = fmt;
                 r.buffer = buff.data;
                 r.state = renderer::NORMAL;
-                r.busy_threads = static_cast<unsigned int>(r.workers.size());
-                r.chunk.store(0,std::memory_order_relaxed);
+                r.levels = levels;
+                r.level_callback = level_callback;
+                r.owner = reinterpret_cast<PyObject*>(self);
+                r.prepare_job(target_frame_ms);
                 r.sc = &sc;
-                sc.lock();
+                r.busy_threads = static_cast<unsigned int>(r.workers.size());
                 r.start_cond.notify_all();
                 ++r.job;
             }
@@ -899,8 +1385,8 @@ FIX_STACK_ALIGN PyObject *obj_BlockingRenderer_render(obj_BlockingRenderer *self
                 std::unique_lock<std::mutex> lock(r.mut);
 
                 while(r.busy_threads) r.finish_cond.wait(lock);
+                r.finish_job();
                 finished = r.state == renderer::NORMAL;
-                sc.unlock();
             }
         }
 
@@ -916,6 +1402,7 @@ FIX_STACK_ALIGN PyObject *obj_BlockingRenderer_signal_abort(obj_BlockingRenderer
             py::allow_threads _;
             std::lock_guard<std::mutex> lock(r.mut);
             r.state = renderer::CANCEL;
+            r.level_cond.notify_all();
         }
 
         Py_RETURN_NONE;
@@ -925,6 +1412,7 @@ FIX_STACK_ALIGN PyObject *obj_BlockingRenderer_signal_abort(obj_BlockingRenderer
 PyMethodDef obj_BlockingRenderer_methods[] = {
     {"render",reinterpret_cast<PyCFunction>(&obj_BlockingRenderer_render),METH_VARARGS|METH_KEYWORDS,NULL},
     {"signal_abort",reinterpret_cast<PyCFunction>(&obj_BlockingRenderer_signal_abort),METH_NOARGS,NULL},
+    {"finished_chunks",reinterpret_cast<PyCFunction>(&obj_Renderer_finished_chunks<blocking_renderer>),METH_NOARGS,NULL},
     {NULL}
 };
 
@@ -941,12 +1429,13 @@ FIX_STACK_ALIGN int obj_BlockingRenderer_init(obj_BlockingRenderer *self,PyObjec
     }
 
     try {
-        PyObject *names[] = {P(threads),nullptr};
+        PyObject *names[] = {P(threads),P(chunk_size),nullptr};
         get_arg ga(args,kwds,names,"BlockingRenderer.__init__");
         PyObject *temp = ga(false);
         int threads = temp ? from_pyobject<int>(temp) : -1;
+        int chunk_size = get_chunk_size(ga(false));
         ga.finished();
-        new(&self->base) blocking_renderer(threads);
+        new(&self->base) blocking_renderer(threads,chunk_size);
     } PY_EXCEPT_HANDLERS(-1)
 
     return 0;
@@ -962,6 +1451,7 @@ PyTypeObject blocking_renderer_obj_base::_pytype = make_pytype(
     .tp_clear = &clear_idict<obj_BlockingRenderer>,
     .tp_weaklistoffset = offsetof(obj_BlockingRenderer,weaklist),
     .tp_methods = obj_BlockingRenderer_methods,
+    .tp_getset = obj_Renderer_getset<blocking_renderer>::value,
     .tp_dictoffset = offsetof(obj_BlockingRenderer,idict),
     .tp_init = reinterpret_cast<initproc>(&obj_BlockingRenderer_init)});
 
@@ -1165,7 +1655,7 @@ std::unique_ptr<char,py_mem_deleter> f_to_s(float x) {
 
 PyObject *obj_Material_repr(material *self) {
     try {
-        return PyUnicode_FromFormat("Material((%s,%s,%s),%s,%s,%s,%s,(%s,%s,%s))",
+        return PyUnicode_FromFormat("Material((%s,%s,%s),%s,%s,%s,%s,(%s,%s,%s)%s)",
             f_to_s(self->c.r()).get(),
             f_to_s(self->c.g()).get(),
             f_to_s(self->c.b()).get(),
@@ -1175,7 +1665,8 @@ PyObject *obj_Material_repr(material *self) {
             f_to_s(self->specular_exp).get(),
             f_to_s(self->specular.r()).get(),
             f_to_s(self->specular.g()).get(),
-            f_to_s(self->specular.b()).get());
+            f_to_s(self->specular.b()).get(),
+            self->casts_shadow ? "" : ",casts_shadow=False");
     } PY_EXCEPT_HANDLERS(nullptr)
 }
 
@@ -1196,13 +1687,15 @@ void read_color(color &to,PyObject *from,PyObject *field) {
 
 PyObject *obj_Material_reduce(material *self,PyObject*) {
     try {
-        py::bytes data(10 * sizeof(float));
+        float casts_shadow = self->casts_shadow;
+        py::bytes data(11 * sizeof(float));
         encode_float_ieee754(data.data(),3,self->c.vals);
         encode_float_ieee754(data.data()+3*sizeof(float),3,self->specular.vals);
         encode_float_ieee754(data.data()+6*sizeof(float),1,&self->opacity);
         encode_float_ieee754(data.data()+7*sizeof(float),1,&self->reflectivity);
         encode_float_ieee754(data.data()+8*sizeof(float),1,&self->specular_intensity);
         encode_float_ieee754(data.data()+9*sizeof(float),1,&self->specular_exp);
+        encode_float_ieee754(data.data()+10*sizeof(float),1,&casts_shadow);
 
         return py::make_tuple(get_instance_data()->material_unpickle,py::make_tuple(data)).new_ref();
     } PY_EXCEPT_HANDLERS(nullptr)
@@ -1223,6 +1716,7 @@ FIX_STACK_ALIGN PyObject *obj_Material_copy(material *self,PyObject*) {
     r->reflectivity = self->reflectivity;
     r->specular_intensity = self->specular_intensity;
     r->specular_exp = self->specular_exp;
+    r->casts_shadow = self->casts_shadow;
 
     return py::ref(r);
 }
@@ -1243,7 +1737,8 @@ FIX_STACK_ALIGN PyObject *obj_Material_new(PyTypeObject *type,PyObject *args,PyO
             P(reflectivity),
             P(specular_intensity),
             P(specular_exp),
-            P(specular_color),nullptr};
+            P(specular_color),
+            P(casts_shadow),nullptr};
         get_arg ga(args,kwds,names,"Material.__new__");
         auto obj_c = ga(true);
         float o = 1;
@@ -1259,6 +1754,9 @@ FIX_STACK_ALIGN PyObject *obj_Material_new(PyTypeObject *type,PyObject *args,PyO
         temp = ga(false);
         if(temp) se = from_pyobject<float>(temp);
         auto obj_s = ga(false);
+        bool cs = true;
+        temp = ga(false);
+        if(temp) cs = from_pyobject<bool>(temp);
         ga.finished();
 
         auto ptr = py::check_obj(type->tp_alloc(type,0));
@@ -1272,6 +1770,7 @@ FIX_STACK_ALIGN PyObject *obj_Material_new(PyTypeObject *type,PyObject *args,PyO
         base->reflectivity = r;
         base->specular_intensity = si;
         base->specular_exp = se;
+        base->casts_shadow = cs;
 
         return ptr;
     } PY_EXCEPT_HANDLERS(nullptr)
@@ -1307,6 +1806,7 @@ PyMemberDef obj_Material_members[] = {
     {"reflectivity",T_FLOAT,offsetof(material,reflectivity),0,NULL},
     {"specular_intensity",T_FLOAT,offsetof(material,specular_intensity),0,NULL},
     {"specular_exp",T_FLOAT,offsetof(material,specular_exp),0,NULL},
+    {"casts_shadow",T_BOOL,offsetof(material,casts_shadow),0,NULL},
     {NULL}
 };
 
@@ -1495,13 +1995,16 @@ namespace impl {
     FIX_STACK_ALIGN PyObject *_material_unpickle(PyObject *mod,PyObject *arg) {
         try {
             auto str = from_pyobject<py::bytes>(arg);
-            if(str.size() != 10 * sizeof(float)) {
+            // data from before "casts_shadow" was added has one less value
+            size_t count = str.size() / sizeof(float);
+            if((count != 10 && count != 11) || str.size() % sizeof(float)) {
                 PyErr_SetString(PyExc_ValueError,"material data is malformed");
                 return static_cast<PyObject*>(nullptr);
             }
 
-            float vals[10];
-            decode_float_ieee754(str.data(),10,vals);
+            float vals[11];
+            vals[10] = 1;
+            decode_float_ieee754(str.data(),count,vals);
             auto m = new material();
             m->c.r() = vals[0];
             m->c.g() = vals[1];
@@ -1513,6 +2016,7 @@ namespace impl {
             m->reflectivity = vals[7];
             m->specular_intensity = vals[8];
             m->specular_exp = vals[9];
+            m->casts_shadow = vals[10] != 0;
             return py::ref(m);
         } PY_EXCEPT_HANDLERS(nullptr)
     }
@@ -1589,7 +2093,14 @@ namespace impl {
                 TypeError,
                 "The TriangleBatch instance was pickled with a different batch size. It cannot be loaded here.");
 
-            if(static_cast<size_t>(args.size()) != 3+item.ctrs->batch_size) THROW_PYERR_STRING(
+            size_t lanes = item.ctrs->batch_size;
+            if(static_cast<size_t>(args.size()) == 4+item.ctrs->batch_size) {
+                lanes = from_pyobject<size_t>(args[3+item.ctrs->batch_size]);
+                if(lanes < 1 || lanes > item.ctrs->batch_size) {
+                    PyErr_SetString(PyExc_ValueError,"triangle batch data is malformed");
+                    return nullptr;
+                }
+            } else if(static_cast<size_t>(args.size()) != 3+item.ctrs->batch_size) THROW_PYERR_STRING(
                 TypeError,
                 "wrong number of arguments");
 
@@ -1603,7 +2114,7 @@ namespace impl {
             auto objdata = (*item.ctrs->triangle_batch)(dim,reinterpret_cast<material**>(args.data()+3));
 
             for(size_t i=0; i<dim+1; ++i) decode_float_ieee754(str.data() + sizeof(float)*width*i,width,objdata.data[i]);
-            (*item.ctrs->triangle_batch_extra)(objdata.obj.ref());
+            (*item.ctrs->triangle_batch_extra)(objdata.obj.ref(),lanes);
 
             return objdata.obj.new_ref();
         } PY_EXCEPT_HANDLERS(nullptr)
@@ -1634,6 +2145,52 @@ namespace impl {
             return objdata.obj.new_ref();
         } PY_EXCEPT_HANDLERS(nullptr)
     }
+    FIX_STACK_ALIGN PyObject *_solid_batch_unpickle(PyObject *mod,PyObject *arg) {
+        try {
+            auto args = from_pyobject<py::tuple>(arg);
+            if(args.size() < 4) THROW_PYERR_STRING(TypeError,"wrong number of arguments");
+
+            size_t dim = get_dimension(args[1].ref());
+            auto item = get_tracerx_cache_item(mod,dim);
+
+            size_t width = dim * item.ctrs->batch_size;
+
+            if(from_pyobject<size_t>(args[0]) != item.ctrs->batch_size) THROW_PYERR_STRING(
+                TypeError,
+                "The SolidBatch instance was pickled with a different batch size. It cannot be loaded here.");
+
+            size_t lanes = item.ctrs->batch_size;
+            if(static_cast<size_t>(args.size()) == 5+item.ctrs->batch_size) {
+                lanes = from_pyobject<size_t>(args[4+item.ctrs->batch_size]);
+                if(lanes < 1 || lanes > item.ctrs->batch_size) {
+                    PyErr_SetString(PyExc_ValueError,"solid batch data is malformed");
+                    return nullptr;
+                }
+            } else if(static_cast<size_t>(args.size()) != 4+item.ctrs->batch_size) THROW_PYERR_STRING(
+                TypeError,
+                "wrong number of arguments");
+
+            int type = from_pyobject<int>(args[2]);
+            if(type != 1 && type != 2) {
+                PyErr_SetString(PyExc_ValueError,"solid batch data is corrupt");
+                return nullptr;
+            }
+
+            auto str = from_pyobject<py::bytes>(args[3]);
+            if(static_cast<size_t>(str.size()) != width * (dim+1) * sizeof(float)) {
+                PyErr_SetString(PyExc_ValueError,"solid batch data is malformed");
+                return nullptr;
+            }
+            for(size_t i=4; i<item.ctrs->batch_size+4; ++i) checked_py_cast<material>(args[i].ref());
+
+            auto objdata = (*item.ctrs->solid_batch)(dim,type,reinterpret_cast<material**>(args.data()+4));
+
+            for(size_t i=0; i<dim+1; ++i) decode_float_ieee754(str.data() + sizeof(float)*width*i,width,objdata.data[i]);
+            (*item.ctrs->solid_batch_extra)(objdata.obj.ref(),lanes);
+
+            return objdata.obj.new_ref();
+        } PY_EXCEPT_HANDLERS(nullptr)
+    }
     FIX_STACK_ALIGN PyObject *_aabb_unpickle(PyObject *mod,PyObject *arg) {
         try {
             auto args = from_pyobject<py::tuple>(arg);
@@ -1669,6 +2226,7 @@ PyMethodDef func_table[] = {
     {"_triangle_unpickle",&impl::_triangle_unpickle,METH_VARARGS,NULL},
     {"_triangle_batch_unpickle",&impl::_triangle_batch_unpickle,METH_VARARGS,NULL},
     {"_solid_unpickle",&impl::_solid_unpickle,METH_VARARGS,NULL},
+    {"_solid_batch_unpickle",&impl::_solid_batch_unpickle,METH_VARARGS,NULL},
     {"_aabb_unpickle",&impl::_aabb_unpickle,METH_VARARGS,NULL},
     {NULL}
 };
@@ -1721,12 +2279,15 @@ const package_common package_common_data = {
                 reduce_triangle_values(dim,dim,data),
                 py::ref(m))).new_ref();
     },
-    [](size_t batch_size,size_t dim,const float *const *data,py::pyptr<material> *m) -> PyObject* {
-        py::tuple vals{static_cast<Py_ssize_t>(3+batch_size)};
+    [](size_t batch_size,size_t lanes,size_t dim,const float *const *data,py::pyptr<material> *m) -> PyObject* {
+        /* the number of lanes in use is only included for partial batches, so
+           that full batches can still be loaded by older versions */
+        py::tuple vals{static_cast<Py_ssize_t>(3+batch_size+(lanes != batch_size))};
         vals.set_unsafe(0,to_pyobject(batch_size));
         vals.set_unsafe(1,to_pyobject(dim));
         vals.set_unsafe(2,reduce_triangle_values(batch_size*dim,dim,data).new_ref());
         for(size_t i=0; i<batch_size; ++i) vals.set_unsafe(i+3,py::incref(m[i].ref()));
+        if(lanes != batch_size) vals.set_unsafe(3+batch_size,to_pyobject(lanes));
         return py::make_tuple(
             get_instance_data()->triangle_batch_unpickle,
             vals).new_ref();
@@ -1742,6 +2303,20 @@ const package_common package_common_data = {
             get_instance_data()->solid_unpickle,
             py::make_tuple(dim,values,py::ref(m))).new_ref();
     },
+    [](size_t batch_size,size_t lanes,size_t dim,char type,const float *const *data,py::pyptr<material> *m) -> PyObject* {
+        /* "data" contains the positions followed by the rows of the
+           orientation matrices */
+        py::tuple vals{static_cast<Py_ssize_t>(4+batch_size+(lanes != batch_size))};
+        vals.set_unsafe(0,to_pyobject(batch_size));
+        vals.set_unsafe(1,to_pyobject(dim));
+        vals.set_unsafe(2,to_pyobject(int(type)));
+        vals.set_unsafe(3,reduce_triangle_values(batch_size*dim,dim,data).new_ref());
+        for(size_t i=0; i<batch_size; ++i) vals.set_unsafe(i+4,py::incref(m[i].ref()));
+        if(lanes != batch_size) vals.set_unsafe(4+batch_size,to_pyobject(lanes));
+        return py::make_tuple(
+            get_instance_data()->solid_batch_unpickle,
+            vals).new_ref();
+    },
     [](size_t dim,const float *start,const float *end) {
         py::bytes values{static_cast<Py_ssize_t>(sizeof(float)*dim*2)};
         encode_float_ieee754(values.data(),dim,start);
@@ -1815,6 +2390,7 @@ extern "C" FIX_STACK_ALIGN SHARED(PyObject) * PyInit_render() {
     LOAD_IDATA(triangle_unpickle);
     LOAD_IDATA(triangle_batch_unpickle);
     LOAD_IDATA(solid_unpickle);
+    LOAD_IDATA(solid_batch_unpickle);
     LOAD_IDATA(aabb_unpickle);
 
     for(auto cls : classes) {
@@ -12,6 +12,14 @@ public:
     // must be thread-safe
     virtual color calculate_color(int x,int y,geom_allocator *a) const = 0;
 
+    /* Calculate the colors of "count" pixels in a row, starting at (x,y) and
+       "stride" pixels apart. Scenes that can trace several rays at once more
+       efficiently than one at a time should override this. Must be
+       thread-safe. */
+    virtual void calculate_colors(int x,int y,int count,int stride,color *out,geom_allocator *a) const {
+        for(int i=0; i<count; ++i) out[i] = calculate_color(x + i*stride,y,a);
+    }
+
     // may return null
     virtual geom_allocator *new_allocator() const = 0;
 
@@ -70,6 +78,9 @@ struct material : py::pyobj_subclass {
 
     color c, specular;
     float opacity, reflectivity, specular_intensity, specular_exp;
+
+    // if false, the material does not block or filter the light of any lights
+    bool casts_shadow;
 };
 
 
@@ -102,10 +113,12 @@ struct tracerx_constructors {
     wrapped_arrays (*triangle)(size_t,material*);
     wrapped_arrays (*triangle_batch)(size_t,material**);
     void (*triangle_extra)(PyObject*);
-    void (*triangle_batch_extra)(PyObject*);
+    void (*triangle_batch_extra)(PyObject*,size_t);
     wrapped_solid (*solid)(size_t,int,material*);
     wrapped_aabb (*aabb)(size_t);
     void (*solid_extra)(PyObject*);
+    wrapped_arrays (*solid_batch)(size_t,int,material**);
+    void (*solid_batch_extra)(PyObject*,size_t);
 };
 
 struct package_common {
@@ -113,8 +126,9 @@ struct package_common {
     PyObject *(*vector_reduce)(size_t,const float*);
     PyObject *(*matrix_reduce)(size_t,const float*);
     PyObject *(*triangle_reduce)(size_t,const float* const*,material*);
-    PyObject *(*triangle_batch_reduce)(size_t,size_t,const float* const*,py::pyptr<material> *m);
+    PyObject *(*triangle_batch_reduce)(size_t,size_t,size_t,const float* const*,py::pyptr<material> *m);
     PyObject *(*solid_reduce)(size_t,char,const float*,const float*,material*);
+    PyObject *(*solid_batch_reduce)(size_t,size_t,size_t,char,const float* const*,py::pyptr<material> *m);
     PyObject *(*aabb_reduce)(size_t dim,const float *start,const float *end);
     void (*invalidate_reference)(PyObject*);
 };
@@ -7,11 +7,16 @@
 #include <condition_variable>
 #include <future>
 #include <deque>
+#include <atomic>
+#include <optional>
+#include <variant>
 #include <vector>
+#include <unordered_map>
 #include <new>
 #include <utility>
 
 #include "geometry.hpp"
+#include "fixed_geometry.hpp"
 #include "light.hpp"
 #include "render.hpp"
 #include "camera.hpp"
@@ -25,12 +30,30 @@
 const real ROUNDING_FUZZ = std::numeric_limits<real>::epsilon() * 10;
 const size_t QUICK_LIST_PREALLOC = 10;
 const size_t ALL_HITS_LIST_PREALLOC = 20;
+const size_t PRIM_SET_PREALLOC = 32; // must be a power of 2
 
-/* Checking if anything occludes a light is expensive, so if the light from a
-   point light is going to be dimmer than this, don't bother. */
+/* Light from a point light that is going to be dimmer than this is ignored.
+   This also bounds how far each point light reaches, which lets shading skip
+   most of the lights in a scene that has many of them (see point_light_tree).
+   */
 const real LIGHT_THRESHOLD = real(1)/512;
 
+// the most point lights in a leaf of a point_light_tree
+const size_t LIGHT_TREE_LEAF_SIZE = 4;
+
+/* how much to enlarge a scene's boundary, relative to its size and distance
+   from the origin, when finding where a ray enters and leaves the scene */
+const real SCENE_BOUNDARY_MARGIN = real(1e-5);
+
 //#define NO_SIMD_BATCHES
+
+/* use a linear search instead of a hash table for the set of primitives
+   already tested by a ray */
+//#define LINEAR_PRIM_SET
+
+/* trace rays through k-d trees by following links between neighbouring
+   leaves instead of using a stack */
+//#define KD_ROPES
 #ifdef NO_SIMD_BATCHES
 typedef simd::scalar<real> v_real;
 #else
@@ -40,9 +63,54 @@ typedef simd::v_type<real> v_real;
 
 const int KD_DEFAULT_MAX_DEPTH = v_real::size > 1 ? 25 : 18;
 
+/* the most branches of a k-d tree to precompute the path through, towards the
+   camera */
+const size_t KD_ORIGIN_PATH_MAX = 64;
+
 // only split nodes if there are more than this many primitives
 const int KD_DEFAULT_SPLIT_THRESHOLD = 2;
 
+// the number of bins per node when using the binned split method
+const int KD_DEFAULT_BINS = 32;
+
+/* With the binned split method, nodes with no more than this many primitives
+   per bin are split using the exact method instead. Near the leaves, the exact
+   method is cheap and the bins would be too coarse. */
+const int KD_BINNED_EXACT_RATIO = 4;
+
+/* When more than one axis is considered for splitting a node, and the node has
+   at least this many primitives, the axes are evaluated in parallel. */
+const size_t KD_PARALLEL_SPLIT_THRESHOLD = 4096;
+
+/* The maximum depth of a bounding volume hierarchy. BVH traversal uses a stack
+   of this size instead of recursion. */
+const int BVH_MAX_DEPTH = 64;
+
+// only split BVH nodes if there are more than this many primitives
+const int BVH_DEFAULT_SPLIT_THRESHOLD = 2;
+
+/* the default costs of testing a BVH node's box and of testing a primitive,
+   used by the surface area heuristic */
+const real BVH_DEFAULT_COST_TRAVERSAL = 1;
+const real BVH_DEFAULT_COST_INTERSECTION = 2;
+
+/* The number of children of each node of the BVH that scenes trace through.
+   A ray is tested against all the children of a node at once, so this is the
+   width of the widest SIMD vector of "real" with no more than 8 values, but at
+   least 4. */
+const size_t BVH_WIDTH = std::max<size_t>(simd::largest_fit<real>(8),4);
+typedef simd::v_type<real,simd::largest_fit<real>(BVH_WIDTH)> bvh_v_real;
+
+/* When building a k-d tree with more than one thread, subtrees with no more
+   than this many primitives are built by the thread that created their parent
+   instead of being given to the worker pool */
+const size_t KD_INLINE_BUILD_THRESHOLD = 64;
+
+/* When grouping triangles into batches, how many of the nearest ungrouped
+   triangles (by position along a space-filling curve) are considered for each
+   batch */
+const size_t GROUPING_WINDOW = 128;
+
 
 template<typename Store> class ray {
 public:
@@ -203,19 +271,40 @@ template<typename Store> struct primitive_batch : py::pyobj_subclass {
         int &index,
         real cutoff=std::numeric_limits<real>::max(),
         geom_allocator *a=nullptr) const;
+
+    /* the distance along "target" to every primitive in the batch, or zero
+       for the primitives it misses and for unused lanes */
+    v_real distances(const ray<Store> &target,geom_allocator *a=nullptr) const;
+
     size_t dimension() const;
 
     PyObject_HEAD
     py::pyptr<material> m[v_real::size];
 
+    /* A batch can hold fewer than v_real::size primitives. Only the first
+       "lanes" lanes are real. The rest are copies of the first primitive that
+       are excluded from intersection tests by "active". */
+    v_real::mask active;
+    unsigned int lanes;
+
     bool opaque(unsigned int index) const {
         return m[index]->opacity >= 1;
     }
 
+    void set_lanes(size_t n) {
+        assert(n > 0 && n <= v_real::size);
+        lanes = static_cast<unsigned int>(n);
+
+        v_real in_use = v_real::zeros();
+        for(size_t i=0; i<n; ++i) in_use[i] = 1;
+        active = in_use != v_real::zeros();
+    }
+
 protected:
-    template<typename F> primitive_batch(F fm,PyTypeObject *t) {
+    template<typename F> primitive_batch(F fm,PyTypeObject *t,size_t lanes=v_real::size) {
         PyObject_Init(py::ref(this),t);
         for(size_t i=0; i<v_real::size; ++i) m[i] = fm(i);
+        set_lanes(lanes);
     }
 
     ~primitive_batch() = default;
@@ -238,31 +327,62 @@ template<typename Store> struct ALLOW_EBO solid :
     matrix<Store> inv_orientation;
     vector<Store> position;
 
+    // "orientation * position", the center of the solid in world space
+    vector<Store> world_position;
+
     solid(solid_type type,const matrix<Store> &o,const matrix<Store> &io,const vector<Store> &p,material *m)
-        : primitive<Store>(m,pytype()), type(type), orientation(o), inv_orientation(io), position(p) {
+        : primitive<Store>(m,pytype()), type(type), orientation(o), inv_orientation(io), position(p), world_position(o * p) {
         assert(o.dimension() == p.dimension() && o.dimension() == io.dimension());
     }
 
     solid(solid_type type,const matrix<Store> &o,const vector<Store> &p,material *m) : solid(type,o,o.inverse(),p,m) {}
 
+    /* "orientation" and "position" are left uninitialized and
+       "recalculate_transform" must be called after they are set */
     solid(size_t dimension,solid_type type,material *m)
-        : primitive<Store>(m,pytype()), type(type), orientation(dimension), inv_orientation(dimension), position(dimension) {}
+        : primitive<Store>(m,pytype()), type(type), orientation(dimension), inv_orientation(dimension), position(dimension), world_position(dimension) {}
+
+    void recalculate_transform() {
+        inv_orientation = orientation.inverse();
+        world_position = orientation * position;
+    }
 
+    /* If "local_origin" is not null, it must point to
+       "inv_orientation * target.origin - position", precomputed (only the
+       first lane of each value is read). */
     HOT_FUNC real intersects(
         const ray<Store> &target,
         ray<Store> &normal,
         real cutoff=std::numeric_limits<real>::max(),
-        geom_allocator *a=nullptr) const
+        geom_allocator *a=nullptr,
+        const v_real *local_origin=nullptr) const
     {
-        ray<Store> transformed{
-            inv_orientation * target.origin - position,
-            inv_orientation * target.direction,
-            a};
+        size_t d = dimension();
+
+        // the origin and direction are transformed in a single pass
+        ray<Store> transformed{d,a};
+        if(local_origin) {
+            for(size_t i=0; i<d; ++i) {
+                transformed.origin[i] = local_origin[i][0];
+                transformed.direction[i] = dot(inv_orientation[i],target.direction);
+            }
+        } else {
+            for(size_t i=0; i<d; ++i) {
+                transformed.origin[i] = dot(inv_orientation[i],target.origin) - position[i];
+                transformed.direction[i] = dot(inv_orientation[i],target.direction);
+            }
+        }
 
         real dist;
         if(type == CUBE) {
             dist = hypercube_intersects(transformed,normal,cutoff);
             if(!dist) return 0;
+
+            /* the local normal is an axis, so the world normal is the
+               matching column of "orientation" */
+            size_t axis = 0;
+            while(!normal.direction[axis]) ++axis;
+            normal.direction = orientation.column(axis) * normal.direction[axis];
         } else {
             assert(type == SPHERE);
 
@@ -270,8 +390,11 @@ template<typename Store> struct ALLOW_EBO solid :
             if(!dist) return 0;
         }
 
-        normal.origin = orientation * (normal.origin + position);
-        normal.direction = orientation * normal.direction;
+        /* the hit point is found along the original ray, instead of
+           transforming it back */
+        normal.origin = target.origin + target.direction * dist;
+        if(type == SPHERE) normal.direction = normal.origin - world_position;
+
         return dist;
     }
 
@@ -469,6 +592,16 @@ template<typename Store> struct ALLOW_EBO triangle :
         return new(p1.dimension()-1) triangle<Store>(p1,face_normal,edge_normals,m);
     }
 
+    static size_t allocation_size(size_t dimension) {
+        return flex_base::item_offset + sizeof(vector<Store>)*(dimension-1);
+    }
+
+    /* create a copy of "b" with material "m", at "ptr", which must have room
+       for "allocation_size(b.dimension())" bytes */
+    static triangle *copy_at(void *ptr,const triangle &b,material *m) {
+        return new(ptr) triangle<Store>(b.p1,b.face_normal,[&](size_t i) { return b.items()[i]; },m);
+    }
+
     void recalculate_d() {
         d = -dot(face_normal,p1);
     }
@@ -548,23 +681,20 @@ template<typename Store> struct ALLOW_EBO triangle_batch :
         return dimension() - 1;
     }
 
-    FORCE_INLINE real intersects(
-        const ray<Store> &target,
-        ray<Store> &normal,
-        int &index,
-        real cutoff=std::numeric_limits<real>::max(),
-        geom_allocator *a=nullptr) const
-    {
-        INSTRUMENTATION_TIMER;
+    /* Find the distance along "target" to every triangle, or zero for the
+       triangles it misses. "denom" and "P" are set to the dot product of each
+       face normal with the ray's direction and to where the ray meets the
+       plane of each triangle. */
+    FORCE_INLINE v_real distances(const ray<Store> &target,v_real &denom,vector<Store,v_real> &P,geom_allocator *a=nullptr) const {
         auto zeros = v_real::zeros();
 
-        auto denom = dot(face_normal,broadcast<Store,v_real::size>(target.direction));
-        auto mask = denom != zeros;
+        denom = dot(face_normal,broadcast<Store,v_real::size>(target.direction));
+        auto mask = this->active && denom != zeros;
 
         auto t = -(dot(face_normal,broadcast<Store,v_real::size>(target.origin)) + d) / denom;
         mask = mask && t >= zeros;
 
-        vector<Store,v_real> P{broadcast<Store,v_real::size>(target.origin) + t * broadcast<Store,v_real::size>(target.direction),a};
+        P = broadcast<Store,v_real::size>(target.origin) + t * broadcast<Store,v_real::size>(target.direction);
         vector<Store,v_real> pside{p1 - P,a};
 
         auto a_min = v_real::repeat(-ROUNDING_FUZZ);
@@ -578,7 +708,27 @@ template<typename Store> struct ALLOW_EBO triangle_batch :
         auto a_max = v_real::repeat(1+ROUNDING_FUZZ);
         mask = mask && tot_area <= a_max;
 
-        t = simd::zfilter(mask,t);
+        return simd::zfilter(mask,t);
+    }
+
+    FORCE_INLINE v_real distances(const ray<Store> &target,geom_allocator *a=nullptr) const {
+        v_real denom;
+        vector<Store,v_real> P{dimension(),a};
+        return distances(target,denom,P,a);
+    }
+
+    FORCE_INLINE real intersects(
+        const ray<Store> &target,
+        ray<Store> &normal,
+        int &index,
+        real cutoff=std::numeric_limits<real>::max(),
+        geom_allocator *a=nullptr) const
+    {
+        INSTRUMENTATION_TIMER;
+
+        v_real denom;
+        vector<Store,v_real> P{dimension(),a};
+        v_real t = distances(target,denom,P,a);
 
         real min_t = cutoff;
         int r_index=-1;
@@ -607,19 +757,32 @@ template<typename Store> struct ALLOW_EBO triangle_batch :
     }
 
     /* NOTE: multiple invocations of "triangles" with the same argument must
-       return the same instance */
-    template<typename F> static triangle_batch *from_triangles(F triangles) {
+       return the same instance. Only "triangles(0)" to "triangles(lanes-1)"
+       are used. */
+    template<typename F> static triangle_batch *from_triangles(F triangles,size_t lanes=v_real::size) {
         size_t n = triangles(0)->dimension();
+        auto padded = [=](size_t i) { return triangles(i < lanes ? i : 0); };
 
         return create(
-            deinterleave<Store,v_real::size>(n,[=](size_t i){ return triangles(i)->p1; }),
-            deinterleave<Store,v_real::size>(n,[=](size_t i){ return triangles(i)->face_normal; }),
-            [=](size_t i) { return deinterleave<Store,v_real::size>(n,[=](size_t j){ return triangles(j)->items()[i]; }); },
-            [=](size_t i) { return triangles(i)->m; });
+            deinterleave<Store,v_real::size>(n,[=](size_t i){ return padded(i)->p1; }),
+            deinterleave<Store,v_real::size>(n,[=](size_t i){ return padded(i)->face_normal; }),
+            [=](size_t i) { return deinterleave<Store,v_real::size>(n,[=](size_t j){ return padded(j)->items()[i]; }); },
+            [=](size_t i) { return padded(i)->m; },
+            lanes);
     }
 
-    template<typename Fe,typename Fm> static triangle_batch *create(const vector<Store,v_real> &p1,const vector<Store,v_real> &face_normal,Fe edge_normals,Fm m) {
-        return new(p1.dimension()-1) triangle_batch(p1,face_normal,edge_normals,m);
+    template<typename Fe,typename Fm> static triangle_batch *create(const vector<Store,v_real> &p1,const vector<Store,v_real> &face_normal,Fe edge_normals,Fm m,size_t lanes=v_real::size) {
+        return new(p1.dimension()-1) triangle_batch(p1,face_normal,edge_normals,m,lanes);
+    }
+
+    static size_t allocation_size(size_t dimension) {
+        return flex_base::item_offset + sizeof(vector<Store,v_real>)*(dimension-1);
+    }
+
+    /* create a copy of "b" with materials "m(0)" to "m(v_real::size-1)", at
+       "ptr", which must have room for "allocation_size(b.dimension())" bytes */
+    template<typename Fm> static triangle_batch *copy_at(void *ptr,const triangle_batch &b,Fm m) {
+        return new(ptr) triangle_batch(b.p1,b.face_normal,[&](size_t i) { return b.items()[i]; },m,b.lanes);
     }
 
     void recalculate_d() {
@@ -630,8 +793,8 @@ private:
     template<typename Fm> triangle_batch(size_t dimension,Fm m)
         : primitive_batch<Store>(m,pytype()), flex_base(dimension-1,[=](size_t i) { return dimension; }), p1(dimension), face_normal(dimension) {}
 
-    template<typename Fe,typename Fm> triangle_batch(const vector<Store,v_real> &p1,const vector<Store,v_real> &face_normal,Fe edge_normals,Fm m)
-        : primitive_batch<Store>(m,pytype()), flex_base(p1.dimension()-1,edge_normals), p1(p1), face_normal(face_normal) {
+    template<typename Fe,typename Fm> triangle_batch(const vector<Store,v_real> &p1,const vector<Store,v_real> &face_normal,Fe edge_normals,Fm m,size_t lanes)
+        : primitive_batch<Store>(m,pytype(),lanes), flex_base(p1.dimension()-1,edge_normals), p1(p1), face_normal(face_normal) {
         assert(p1.dimension() == face_normal.dimension() &&
             std::all_of(
                 ITR_RANGE(this->items()),
@@ -640,6 +803,261 @@ private:
     }
 };
 
+struct solid_batch_obj_common {
+    CONTAINED_PYTYPE_DEF
+};
+
+/* The items are the rows of the inverse orientation matrices, followed by the
+   rows of the orientation matrices */
+template<typename Store> struct ALLOW_EBO solid_batch :
+        primitive_batch<Store>, // must be first
+        solid_batch_obj_common,
+        flexible_struct<solid_batch<Store>,vector<Store,v_real>>
+{
+    typedef typename solid_batch::flexible_struct flex_base;
+
+    // every solid in a batch has the same type
+    solid_type type;
+
+    vector<Store,v_real> position;
+
+    // the "world_position" of each solid
+    vector<Store,v_real> world_position;
+
+    size_t dimension() const {
+        return position.dimension();
+    }
+
+    size_t _item_size() const {
+        return dimension() * 2;
+    }
+
+    const vector<Store,v_real> *inv_orientation() const {
+        return this->items().begin();
+    }
+    vector<Store,v_real> *inv_orientation() {
+        return this->items().begin();
+    }
+
+    const vector<Store,v_real> *orientation() const {
+        return this->items().begin() + dimension();
+    }
+    vector<Store,v_real> *orientation() {
+        return this->items().begin() + dimension();
+    }
+
+    /* recompute "inv_orientation" and "world_position" from "orientation"
+       and "position" */
+    void recalculate_transform() {
+        size_t d = dimension();
+        matrix<Store> o(d);
+        for(size_t i=0; i<v_real::size; ++i) {
+            for(size_t j=0; j<d; ++j) o[j] = interleave1<Store,v_real::size>(orientation()[j],i);
+            matrix<Store> io = o.inverse();
+            vector<Store> wp = o * interleave1<Store,v_real::size>(position,i);
+            for(size_t j=0; j<d; ++j) {
+                for(size_t k=0; k<d; ++k) inv_orientation()[j][k][i] = io[j][k];
+                world_position[j][i] = wp[j];
+            }
+        }
+    }
+
+    /* Find the distance along "target" to every solid, or zero for the
+       solids it misses. "origin" and "direction" are set to the ray in the
+       local space of each solid. If "local_origin" is not null, it must point
+       to "inv_orientation() * target.origin - position", precomputed. */
+    FORCE_INLINE v_real distances(
+        const ray<Store> &target,
+        vector<Store,v_real> &origin,
+        vector<Store,v_real> &direction,
+        geom_allocator *a=nullptr,
+        const v_real *local_origin=nullptr) const
+    {
+        size_t d = dimension();
+        auto zeros = v_real::zeros();
+        auto inv = inv_orientation();
+
+        // the origin and direction are transformed in a single pass
+        {
+            auto b_dir = broadcast<Store,v_real::size>(target.direction);
+            if(local_origin) {
+                for(size_t i=0; i<d; ++i) {
+                    origin[i] = local_origin[i];
+                    direction[i] = dot(inv[i],b_dir);
+                }
+            } else {
+                auto b_origin = broadcast<Store,v_real::size>(target.origin);
+                for(size_t i=0; i<d; ++i) {
+                    origin[i] = dot(inv[i],b_origin) - position[i];
+                    direction[i] = dot(inv[i],b_dir);
+                }
+            }
+        }
+
+        v_real dist;
+        v_real::mask mask;
+        if(type == CUBE) {
+            /* the ray enters the cube through the furthest of the near faces of
+               each slab, if that point is on the surface of the cube */
+            vector<Store,v_real> near{d,a};
+            dist = v_real::repeat(std::numeric_limits<real>::lowest());
+            for(size_t i=0; i<d; ++i) {
+                v_real face = simd::mask_blend(direction[i] < zeros,v_real::repeat(1),v_real::repeat(-1));
+                near[i] = (face - origin[i]) / direction[i];
+                simd::mask_set(dist,direction[i] != zeros && near[i] > dist,near[i]);
+            }
+
+            /* as in hypercube_intersects, the component belonging to the face
+               that was hit is not checked, since rounding errors can push it
+               past the fuzz factor */
+            mask = this->active && dist > zeros;
+            auto limit = v_real::repeat(1+ROUNDING_FUZZ);
+            for(size_t i=0; i<d; ++i)
+                mask = mask && (near[i] == dist || simd::abs(direction[i] * dist + origin[i]) <= limit);
+        } else {
+            assert(type == SPHERE);
+
+            v_real qa = dot(direction,direction);
+            v_real qb = dot(direction,origin) * v_real::repeat(2);
+            v_real qc = dot(origin,origin) - v_real::repeat(1);
+
+            v_real discriminant = qb*qb - v_real::repeat(4)*qa*qc;
+            mask = this->active && discriminant >= zeros;
+
+            dist = (zeros - qb - simd::sqrt(discriminant)) / (v_real::repeat(2)*qa);
+            mask = mask && dist > zeros;
+        }
+
+        return simd::zfilter(mask,dist);
+    }
+
+    FORCE_INLINE v_real distances(const ray<Store> &target,geom_allocator *a=nullptr) const {
+        vector<Store,v_real> origin{dimension(),a};
+        vector<Store,v_real> direction{dimension(),a};
+        return distances(target,origin,direction,a);
+    }
+
+    /* If "local_origin" is not null, it must point to
+       "inv_orientation() * target.origin - position", precomputed. */
+    FORCE_INLINE real intersects(
+        const ray<Store> &target,
+        ray<Store> &normal,
+        int &index,
+        real cutoff=std::numeric_limits<real>::max(),
+        geom_allocator *a=nullptr,
+        const v_real *local_origin=nullptr) const
+    {
+        INSTRUMENTATION_TIMER;
+        size_t d = dimension();
+
+        vector<Store,v_real> origin{d,a};
+        vector<Store,v_real> direction{d,a};
+        v_real dist = distances(target,origin,direction,a,local_origin);
+
+        real min_t = cutoff;
+        int r_index=-1;
+        for(int i=0; i<static_cast<int>(v_real::size); ++i) {
+            if(i != index && dist[i] && dist[i] < min_t) {
+                min_t = dist[i];
+                r_index = i;
+            }
+        }
+
+        if(r_index == -1) return 0;
+
+        index = r_index;
+
+        /* The normal is found directly in world space. The hit point is along
+           the original ray, the normal of a cube is a column of its
+           orientation and the normal of a sphere points away from its
+           center. */
+        normal.origin = target.origin + target.direction * min_t;
+        if(type == CUBE) {
+            size_t axis = 0;
+            real axis_dist = std::numeric_limits<real>::lowest();
+            for(size_t i=0; i<d; ++i) {
+                real di = direction[i][r_index];
+                if(di) {
+                    real near = ((di < 0 ? real(1) : real(-1)) - origin[i][r_index]) / di;
+                    if(near > axis_dist) {
+                        axis_dist = near;
+                        axis = i;
+                    }
+                }
+            }
+            real sign = direction[axis][r_index] < 0 ? real(1) : real(-1);
+            auto orient = orientation();
+            for(size_t i=0; i<d; ++i) normal.direction[i] = orient[i][axis][r_index] * sign;
+        } else {
+            for(size_t i=0; i<d; ++i) normal.direction[i] = normal.origin[i] - world_position[i][r_index];
+        }
+
+        return min_t;
+    }
+
+    static solid_batch *create(size_t dimension,solid_type type,material **m) {
+        return new(dimension*2) solid_batch(dimension,type,[=](size_t i) { return py::borrowed_ref{m[i]}; });
+    }
+
+    /* Only "solids(0)" to "solids(lanes-1)" are used. The solids must all have
+       the same type. */
+    template<typename F> static solid_batch *from_solids(F solids,size_t lanes=v_real::size) {
+        size_t d = solids(0)->dimension();
+        auto padded = [=](size_t i) { return solids(i < lanes ? i : 0); };
+
+        return new(d*2) solid_batch(
+            solids(0)->type,
+            deinterleave<Store,v_real::size>(d,[=](size_t i){ return padded(i)->position; }),
+            deinterleave<Store,v_real::size>(d,[=](size_t i){ return padded(i)->world_position; }),
+            [=](size_t i) {
+                return i < d ?
+                    deinterleave<Store,v_real::size>(d,[=](size_t j){ return vector<Store>(padded(j)->inv_orientation[i]); }) :
+                    deinterleave<Store,v_real::size>(d,[=](size_t j){ return vector<Store>(padded(j)->orientation[i-d]); });
+            },
+            [=](size_t i) { return padded(i)->m; },
+            lanes);
+    }
+
+    static size_t allocation_size(size_t dimension) {
+        return flex_base::item_offset + sizeof(vector<Store,v_real>)*dimension*2;
+    }
+
+    /* create a copy of "b" with materials "m(0)" to "m(v_real::size-1)", at
+       "ptr", which must have room for "allocation_size(b.dimension())" bytes */
+    template<typename Fm> static solid_batch *copy_at(void *ptr,const solid_batch &b,Fm m) {
+        return new(ptr) solid_batch(b.type,b.position,b.world_position,[&](size_t i) { return b.items()[i]; },m,b.lanes);
+    }
+
+    /* extract the solid in lane "i" */
+    solid<Store> *get_solid(size_t i) const {
+        size_t d = dimension();
+        matrix<Store> o(d);
+        matrix<Store> io(d);
+        for(size_t j=0; j<d; ++j) {
+            o[j] = interleave1<Store,v_real::size>(orientation()[j],i);
+            io[j] = interleave1<Store,v_real::size>(inv_orientation()[j],i);
+        }
+        return new solid<Store>(type,o,io,interleave1<Store,v_real::size>(position,i),this->m[i].get());
+    }
+
+private:
+    template<typename Fm> solid_batch(size_t dimension,solid_type type,Fm m)
+        : primitive_batch<Store>(m,pytype()), flex_base(dimension*2,[=](size_t i) { return dimension; }), type(type), position(dimension), world_position(dimension) {}
+
+    template<typename Fr,typename Fm> solid_batch(
+        solid_type type,
+        const vector<Store,v_real> &position,
+        const vector<Store,v_real> &world_position,
+        Fr rows,
+        Fm m,
+        size_t lanes)
+        : primitive_batch<Store>(m,pytype(),lanes), flex_base(position.dimension()*2,rows), type(type), position(position), world_position(world_position) {
+        assert(std::all_of(
+            ITR_RANGE(this->items()),
+            [&](const vector<Store,v_real> &e){ return e.dimension() == position.dimension(); }));
+    }
+};
+
 template<typename Store> HOT_FUNC real primitive_batch<Store>::intersects(
     const ray<Store> &target,
     ray<Store> &normal,
@@ -647,15 +1065,32 @@ template<typename Store> HOT_FUNC real primitive_batch<Store>::intersects(
     real cutoff,
     geom_allocator *a) const
 {
-    assert(Py_TYPE(this) == triangle_batch_obj_common::pytype());
-    return static_cast<const triangle_batch<Store>*>(this)->intersects(target,normal,index,cutoff,a);
+    if(Py_TYPE(this) == triangle_batch_obj_common::pytype())
+        return static_cast<const triangle_batch<Store>*>(this)->intersects(target,normal,index,cutoff,a);
+
+    assert(Py_TYPE(this) == solid_batch_obj_common::pytype());
+    return static_cast<const solid_batch<Store>*>(this)->intersects(target,normal,index,cutoff,a);
+}
+
+template<typename Store> HOT_FUNC v_real primitive_batch<Store>::distances(const ray<Store> &target,geom_allocator *a) const {
+    if(Py_TYPE(this) == triangle_batch_obj_common::pytype())
+        return static_cast<const triangle_batch<Store>*>(this)->distances(target,a);
+
+    assert(Py_TYPE(this) == solid_batch_obj_common::pytype());
+    return static_cast<const solid_batch<Store>*>(this)->distances(target,a);
 }
 
 template<typename Store> size_t primitive_batch<Store>::dimension() const {
     if(Store::required_d) return Store::required_d;
 
-    assert(Py_TYPE(this) == triangle_batch_obj_common::pytype());
-    return static_cast<const triangle_batch<Store>*>(this)->dimension();
+    if(Py_TYPE(this) == triangle_batch_obj_common::pytype()) return static_cast<const triangle_batch<Store>*>(this)->dimension();
+
+    assert(Py_TYPE(this) == solid_batch_obj_common::pytype());
+    return static_cast<const solid_batch<Store>*>(this)->dimension();
+}
+
+inline bool is_primitive_batch(PyObject *o) {
+    return Py_TYPE(o) == triangle_batch_obj_common::pytype() || Py_TYPE(o) == solid_batch_obj_common::pytype();
 }
 
 
@@ -670,7 +1105,7 @@ template<typename T,size_t Prealloc=QUICK_LIST_PREALLOC> class quick_list {
     void check_capacity() {
         if(_size >= alloc_size) {
             T *new_buff = std::allocator<T>().allocate(alloc_size*2);
-            memcpy(new_buff,_data,alloc_size);
+            memcpy(new_buff,_data,alloc_size * sizeof(T));
             if(alloc_size > Prealloc) {
                 std::allocator<T>().deallocate(_data,alloc_size);
             }
@@ -740,6 +1175,13 @@ template<typename Store,bool=(v_real::size>1)> struct intersection_target {
         assert(p);
         return p->m.get();
     }
+
+    // return true if "target" hits the primitive nearer than "cutoff"
+    bool hit_before(const ray<Store> &target,real cutoff,geom_allocator *a=nullptr) const {
+        assert(p);
+        ray<Store> normal{target.dimension(),a};
+        return p->intersects(target,normal,cutoff,a) != 0;
+    }
 };
 template<typename Store> struct intersection_target<Store,true> {
     PyObject *p;
@@ -753,13 +1195,28 @@ template<typename Store> struct intersection_target<Store,true> {
         assert(p);
 
         if(index >= 0) {
-            assert(Py_TYPE(p) == triangle_batch<Store>::pytype());
+            assert(is_primitive_batch(p));
             return reinterpret_cast<primitive_batch<Store>*>(p)->m[index].get();
         }
 
-        assert(Py_TYPE(p) != triangle_batch<Store>::pytype());
+        assert(!is_primitive_batch(p));
         return reinterpret_cast<primitive<Store>*>(p)->m.get();
     }
+
+    // return true if "target" hits the primitive nearer than "cutoff"
+    bool hit_before(const ray<Store> &target,real cutoff,geom_allocator *a=nullptr) const {
+        assert(p);
+
+        if(index >= 0) {
+            assert(is_primitive_batch(p));
+            real dist = reinterpret_cast<primitive_batch<Store>*>(p)->distances(target,a)[index];
+            return dist && dist < cutoff;
+        }
+
+        assert(!is_primitive_batch(p));
+        ray<Store> normal{target.dimension(),a};
+        return reinterpret_cast<primitive<Store>*>(p)->intersects(target,normal,cutoff,a) != 0;
+    }
 };
 
 template<typename Store> struct ray_intersection {
@@ -779,7 +1236,121 @@ template<typename Store> struct ray_intersection {
 };
 
 template<typename Store> using ray_intersections = quick_list<ray_intersection<Store>>;
-using prim_list = quick_list<void*,ALL_HITS_LIST_PREALLOC>;
+
+#ifdef LINEAR_PRIM_SET
+class prim_set {
+    quick_list<void*,ALL_HITS_LIST_PREALLOC> items;
+
+public:
+    /* add "item" to the set and return true if it was not already there */
+    bool insert(void *item) {
+        if(std::find(items.begin(),items.end(),item) != items.end()) return false;
+        items.add(item);
+        return true;
+    }
+};
+#else
+/* An open-addressing hash table of pointers, that stores items in a static
+   buffer while it can. A primitive can span many nodes of a k-d tree, so a ray
+   can encounter the same primitive many times, and with a linear search,
+   rejecting these repeats would take time proportional to the number of
+   primitives already tested. */
+class prim_set {
+    size_t _size;
+    size_t mask;
+    unsigned int shift;
+    void **_data;
+    void *_members[PRIM_SET_PREALLOC];
+
+    size_t slot(void *item) const {
+        // Fibonacci hashing, using the upper bits of the product
+        return static_cast<size_t>((reinterpret_cast<uintptr_t>(item) * UINT64_C(0x9e3779b97f4a7c15)) >> shift);
+    }
+
+    void grow() {
+        size_t old_capacity = mask + 1;
+        void **old_data = _data;
+
+        _data = std::allocator<void*>().allocate(old_capacity*2);
+        std::fill_n(_data,old_capacity*2,nullptr);
+        mask = old_capacity*2 - 1;
+        --shift;
+
+        for(size_t i=0; i<old_capacity; ++i) {
+            if(old_data[i]) {
+                size_t s = slot(old_data[i]);
+                while(_data[s]) s = (s + 1) & mask;
+                _data[s] = old_data[i];
+            }
+        }
+
+        if(old_data != _members) std::allocator<void*>().deallocate(old_data,old_capacity);
+    }
+
+public:
+    prim_set() : _size(0), mask(PRIM_SET_PREALLOC-1), shift(64), _data(_members) {
+        static_assert((PRIM_SET_PREALLOC & (PRIM_SET_PREALLOC-1)) == 0);
+        for(size_t i=PRIM_SET_PREALLOC; i>1; i>>=1) --shift;
+        std::fill_n(_members,PRIM_SET_PREALLOC,nullptr);
+    }
+    prim_set(const prim_set&) = delete;
+    ~prim_set() {
+        if(_data != _members) std::allocator<void*>().deallocate(_data,mask+1);
+    }
+
+    prim_set &operator=(const prim_set&) = delete;
+
+    /* add "item" to the set and return true if it was not already there */
+    bool insert(void *item) {
+        assert(item);
+
+        size_t s = slot(item);
+        while(_data[s]) {
+            if(_data[s] == item) return false;
+            s = (s + 1) & mask;
+        }
+
+        // keep the table at most half full
+        if(++_size * 2 > mask + 1) {
+            grow();
+            s = slot(item);
+            while(_data[s]) s = (s + 1) & mask;
+        }
+        _data[s] = item;
+        return true;
+    }
+};
+#endif
+
+/* Used in place of prim_set by structures that never give a ray the same
+   primitive twice, such as bounding volume hierarchies */
+struct no_prim_set {
+    bool insert(void*) { return true; }
+};
+
+/* The light that gets through to a point, along a shadow ray. Each transparent
+   primitive found along the ray filters "c" in place, so the order they are
+   found in doesn't matter, but each must only be counted once. The light is
+   considered blocked once none of its components is above "cutoff". */
+template<typename Store> struct shadow_filter {
+    color &c;
+    float cutoff;
+
+    // the opaque primitive that blocked the light, if any
+    intersection_target<Store> blocker{};
+
+    /* filter the light through "item", which has material "m", and return
+       true if it is now blocked */
+    bool pass(const material &m,intersection_target<Store> item) {
+        if(!m.casts_shadow) return false;
+        if(m.opacity >= 1) {
+            blocker = item;
+            return true;
+        }
+        c *= 1 - m.opacity;
+        return std::max(c.r(),std::max(c.g(),c.b())) <= cutoff;
+    }
+};
 
 template<typename Store> void trim_intersections(ray_intersections<Store> &hits,real dist,size_t from=0) {
     while(from < hits.size()) {
@@ -829,50 +1400,147 @@ template<typename Store> struct kd_branch : kd_node<Store> {
     }
 };
 
-bool has(const prim_list &hits,void *item) {
-    return std::find(hits.begin(),hits.end(),item) != hits.end();
-}
+template<typename T> inline T *item_ptr(T *x) { return x; }
+template<typename T> inline T *item_ptr(const py::pyptr<T> &x) { return x.get(); }
+inline PyObject *item_ptr(const py::object &x) { return x.ref(); }
+
+/* The origin of one ray, such as the camera's, transformed into the local space
+   of every solid (or batch of solids) of a k-d tree. Every primary ray starts
+   at the camera, so this spares "solid::intersects" one of its two O(d²)
+   transformations for each of those rays. "slots" is parallel to the items of
+   the tree and holds the index of the item's local origin in "data", or
+   "no_slot" if the item is not a solid. The local origin of a solid is stored
+   in the first lane. */
+template<typename Store> class kd_origin_cache {
+    std::vector<PyObject*> solids;
+    std::vector<v_real> data;
+    vector<Store> origin;
+    bool valid;
+    std::mutex mut;
 
-template<typename Store,bool Batched=(v_real::size>1)> struct kd_leaf : kd_node<Store>, flexible_struct<kd_leaf<Store,Batched>,py::pyptr<primitive<Store>>> {
-    typedef typename kd_leaf::flexible_struct flex_base;
+public:
+    static constexpr uint32_t no_slot = std::numeric_limits<uint32_t>::max();
+
+    std::vector<uint32_t> slots;
+
+    explicit kd_origin_cache(size_t dimension) : origin(dimension), valid(false) {}
+
+    template<typename Item> void assign(const std::vector<Item> &items) {
+        std::unordered_map<PyObject*,uint32_t> slot_index;
+        slots.clear();
+        solids.clear();
+        valid = false;
+
+        slots.reserve(items.size());
+        for(auto &item : items) {
+            PyObject *o = py::ref(item);
+            uint32_t slot = no_slot;
+            if(Py_TYPE(o) == solid_obj_common::pytype() || Py_TYPE(o) == solid_batch_obj_common::pytype()) {
+                auto r = slot_index.emplace(o,static_cast<uint32_t>(solids.size()));
+                if(r.second) solids.push_back(o);
+                slot = r.first->second;
+            }
+            slots.push_back(slot);
+        }
 
-    using flex_base::operator delete;
-    using flex_base::operator new;
+        if(solids.empty()) slots.clear();
+        data.resize(solids.size() * origin.dimension());
+    }
+
+    /* Transform "o" for every solid, unless it is already the cached origin.
+       When the origin changes, "update" is also called, under the same lock,
+       so the owner can update its own state that depends on the origin.
+       Concurrent calls are safe, but this must not be called while the tree
+       is being traced with a different origin, since readers don't take the
+       lock, neither for the local origins nor for what "update" changes. */
+    template<typename F> void set_origin(const vector<Store> &o,F &&update) {
+        std::lock_guard<std::mutex> lock(mut);
+        if(valid && o == origin) return;
+
+        size_t d = origin.dimension();
+        for(size_t i=0; i<solids.size(); ++i) {
+            v_real *lo = data.data() + i*d;
+            if(Py_TYPE(solids[i]) == solid_obj_common::pytype()) {
+                auto s = reinterpret_cast<const solid<Store>*>(solids[i]);
+                for(size_t j=0; j<d; ++j) lo[j] = v_real::repeat(dot(s->inv_orientation[j],o) - s->position[j]);
+            } else {
+                auto b = reinterpret_cast<const solid_batch<Store>*>(solids[i]);
+                auto b_origin = broadcast<Store,v_real::size>(o);
+                for(size_t j=0; j<d; ++j) lo[j] = dot(b->inv_orientation()[j],b_origin) - b->position[j];
+            }
+        }
+        update();
+        origin = o;
+        valid = true;
+    }
 
-    size_t size;
+    void set_origin(const vector<Store> &o) {
+        set_origin(o,[]{});
+    }
 
-    size_t _item_size() const {
-        return size;
+    /* the transformed origins, if "o" is the cached origin, otherwise null */
+    const v_real *local_origins(const vector<Store> &o) const {
+        return (valid && o == origin) ? data.data() : nullptr;
     }
 
-    template<typename F> static kd_leaf *create(size_t size,F f) {
-        return new(size) kd_leaf(size,f);
+    const v_real *local_origin(const v_real *origins,uint32_t slot) const {
+        return slot == no_slot ? nullptr : origins + slot*origin.dimension();
     }
+};
 
-    kd_leaf *clone() const {
-        return kd_leaf::create(
-            size,
-            [&](size_t i) { return this->items()[i]; });
+/* The primitives of a k-d tree leaf. This is separate from kd_leaf so the same
+   code can test the leaves of kd_flat_tree, whose primitives are stored
+   elsewhere. "Item" is any pointer-like type accepted by item_ptr. */
+template<typename Store,typename Item,bool Batched=(v_real::size>1)> struct kd_leaf_items {
+    const Item *items;
+    size_t size;
+
+    /* if not null, "origin_slots" is parallel to "items" and indexes
+       "origins" */
+    const kd_origin_cache<Store> *origins = nullptr;
+    const uint32_t *origin_slots = nullptr;
+
+    FORCE_INLINE real item_intersects(
+        size_t i,
+        const v_real *local_origins,
+        const ray<Store> &target,
+        ray<Store> &normal,
+        real cutoff,
+        geom_allocator *a) const
+    {
+        auto item = item_ptr(items[i]);
+        if(local_origins) {
+            const v_real *lo = origins->local_origin(local_origins,origin_slots[i]);
+            if(lo) return static_cast<const solid<Store>*>(item)->intersects(target,normal,cutoff,a,lo);
+        }
+        return item->intersects(target,normal,cutoff,a);
     }
 
-    HOT_FUNC bool intersects(
+    template<typename Set> HOT_FUNC bool intersects(
         const ray<Store> &target,
         intersection_target<Store> skip,
         ray_intersection<Store> &o_hit,
         ray_intersections<Store> &t_hits,
-        prim_list &checked,
+        Set &checked,
         geom_allocator *a=nullptr) const
     {
         assert(dimension() == target.dimension() && dimension() == o_hit.normal.dimension());
 
         size_t h_start = t_hits.size();
+        const v_real *local_origins = origin_slots ? origins->local_origins(target.origin) : nullptr;
 
         real dist;
         size_t i=0;
+
+        /* the loop below uses o_hit.normal to hold the normal of every
+           intersection, which would overwrite the normal of a hit from a
+           previously visited leaf */
+        if(o_hit.dist != std::numeric_limits<real>::max()) goto hit;
+
         while(i<size) {
-            auto item = this->items()[i++].get();
-            if(item != skip.p && !has(checked,item)) {
-                dist = item->intersects(target,o_hit.normal,o_hit.dist,a);
+            auto item = item_ptr(items[i++]);
+            if(item != skip.p && checked.insert(item)) {
+                dist = item_intersects(i-1,local_origins,target,o_hit.normal,o_hit.dist,a);
 
                 if(dist) {
                     if(item->opaque()) {
@@ -883,7 +1551,6 @@ template<typename Store,bool Batched=(v_real::size>1)> struct kd_leaf : kd_node<
                         t_hits.add({dist,{item},o_hit.normal});
                     }
                 }
-                checked.add(item);
             }
         }
         return false;
@@ -892,9 +1559,9 @@ template<typename Store,bool Batched=(v_real::size>1)> struct kd_leaf : kd_node<
         // is there anything closer?
         ray<Store> new_normal{target.dimension(),a};
         while(i<size) {
-            auto item = this->items()[i++].get();
-            if(item != skip.p && !has(checked,item)) {
-                dist = item->intersects(target,new_normal,o_hit.dist,a);
+            auto item = item_ptr(items[i++]);
+            if(item != skip.p && checked.insert(item)) {
+                dist = item_intersects(i-1,local_origins,target,new_normal,o_hit.dist,a);
                 if(dist) {
                     if(item->opaque()) {
                         o_hit.dist = dist;
@@ -904,11 +1571,10 @@ template<typename Store,bool Batched=(v_real::size>1)> struct kd_leaf : kd_node<
                         t_hits.add({dist,{item},new_normal});
                     }
                 }
-                checked.add(item);
             }
         }
 
-        trim_intersections(t_hits,dist,h_start);
+        trim_intersections(t_hits,o_hit.dist,h_start);
         return true;
     }
 
@@ -924,7 +1590,7 @@ template<typename Store,bool Batched=(v_real::size>1)> struct kd_leaf : kd_node<
         real dist;
         ray<Store> normal{dimension(),a};
         for(size_t i=0; i<size; ++i) {
-            auto item = this->items()[i].get();
+            auto item = item_ptr(items[i]);
             if(item != skip.p) {
                 dist = item->intersects(target,normal,ldistance,a);
 
@@ -938,67 +1604,111 @@ template<typename Store,bool Batched=(v_real::size>1)> struct kd_leaf : kd_node<
         return false;
     }
 
+    /* Filter the light travelling along "target" through every primitive
+       nearer than "ldistance", and return true as soon as it is blocked.
+       Primitives already in "checked" are skipped, so that one spanning
+       several leaves doesn't filter the light twice. */
+    template<typename Set> HOT_FUNC bool occludes(
+        const ray<Store> &target,
+        real ldistance,
+        intersection_target<Store> skip,
+        shadow_filter<Store> &filter,
+        Set &checked,
+        geom_allocator *a=nullptr) const
+    {
+        assert(dimension() == target.dimension());
+
+        ray<Store> normal{dimension(),a};
+        for(size_t i=0; i<size; ++i) {
+            auto item = item_ptr(items[i]);
+            if(item != skip.p && item->m->casts_shadow && checked.insert(item)) {
+                if(item->intersects(target,normal,ldistance,a) && filter.pass(*item->m,{item})) return true;
+            }
+        }
+        return false;
+    }
+
     size_t dimension() const {
         assert(size);
-        return this->items()[0]->dimension();
+        return item_ptr(items[0])->dimension();
     }
+};
 
-private:
-    template<typename F> kd_leaf(size_t size,F f) : kd_node<Store>(LEAF), flex_base(size,f), size(size) {}
-};
-
-template<typename Store> struct kd_leaf<Store,true> : kd_node<Store>, flexible_struct<kd_leaf<Store,true>,py::object> {
-    typedef typename kd_leaf::flexible_struct flex_base;
-
-    using flex_base::operator delete;
-    using flex_base::operator new;
-
+/* the first "batches" items are instances of primitive_batch */
+template<typename Store,typename Item> struct kd_leaf_items<Store,Item,true> {
+    const Item *items;
     size_t size;
     size_t batches;
 
-    size_t _item_size() const {
-        return size;
-    }
+    /* if not null, "origin_slots" is parallel to "items" and indexes
+       "origins" */
+    const kd_origin_cache<Store> *origins = nullptr;
+    const uint32_t *origin_slots = nullptr;
 
-    template<typename F> static kd_leaf *create(size_t size,size_t batches,F f) {
-        return new(size) kd_leaf(size,batches,f);
-    }
-    template<typename F> static kd_leaf *create(size_t size,F f) {
-        return new(size) kd_leaf(size,f);
+    FORCE_INLINE real batch_intersects(
+        size_t i,
+        const v_real *local_origins,
+        const ray<Store> &target,
+        ray<Store> &normal,
+        int &index,
+        real cutoff,
+        geom_allocator *a) const
+    {
+        PyObject *item = item_ptr(items[i]);
+        if(local_origins) {
+            const v_real *lo = origins->local_origin(local_origins,origin_slots[i]);
+            if(lo) return reinterpret_cast<const solid_batch<Store>*>(item)->intersects(target,normal,index,cutoff,a,lo);
+        }
+        return reinterpret_cast<const primitive_batch<Store>*>(item)->intersects(target,normal,index,cutoff,a);
     }
 
-    kd_leaf *clone() const {
-        return kd_leaf::create(
-            size,
-            batches,
-            [&](size_t i) { return this->items()[i]; });
+    FORCE_INLINE real item_intersects(
+        size_t i,
+        const v_real *local_origins,
+        const ray<Store> &target,
+        ray<Store> &normal,
+        real cutoff,
+        geom_allocator *a) const
+    {
+        PyObject *item = item_ptr(items[i]);
+        if(local_origins) {
+            const v_real *lo = origins->local_origin(local_origins,origin_slots[i]);
+            if(lo) return reinterpret_cast<const solid<Store>*>(item)->intersects(target,normal,cutoff,a,lo);
+        }
+        return reinterpret_cast<const primitive<Store>*>(item)->intersects(target,normal,cutoff,a);
     }
 
-    HOT_FUNC bool intersects(
+    template<typename Set> HOT_FUNC bool intersects(
         const ray<Store> &target,
         intersection_target<Store> skip,
         ray_intersection<Store> &o_hit,
         ray_intersections<Store> &t_hits,
-        prim_list &checked,
+        Set &checked,
         geom_allocator *a=nullptr) const
     {
         assert(dimension() == target.dimension() && dimension() == o_hit.normal.dimension());
 
         size_t h_start = t_hits.size();
+        const v_real *local_origins = origin_slots ? origins->local_origins(target.origin) : nullptr;
 
         real dist;
         size_t i=0;
 
+        /* the loop below uses o_hit.normal to hold the normal of every
+           intersection, which would overwrite the normal of a hit from a
+           previously visited leaf */
+        if(o_hit.dist != std::numeric_limits<real>::max()) goto hit;
+
         for(; i<size; ++i) {
-            auto item = this->items()[i].ref();
+            PyObject *item = item_ptr(items[i]);
             if(i < batches) {
-                assert(Py_TYPE(item) == triangle_batch<Store>::pytype());
+                assert(is_primitive_batch(item));
 
-                if(!has(checked,item)) {
+                if(checked.insert(item)) {
                     int index = skip.p == item ? skip.index : -1;
-                    auto p = reinterpret_cast<triangle_batch<Store>*>(item);
+                    auto p = reinterpret_cast<primitive_batch<Store>*>(item);
 
-                    dist = p->intersects(target,o_hit.normal,index,o_hit.dist,a);
+                    dist = batch_intersects(i,local_origins,target,o_hit.normal,index,o_hit.dist,a);
 
                     if(dist) {
                         if(p->opaque(index)) {
@@ -1010,14 +1720,13 @@ template<typename Store> struct kd_leaf<Store,true> : kd_node<Store>, flexible_s
 
                         t_hits.add({dist,{item,index},o_hit.normal});
                     }
-                    checked.add(item);
                 }
-            } else if(item != skip.p && !has(checked,item)) {
-                assert(Py_TYPE(item) != triangle_batch<Store>::pytype());
+            } else if(item != skip.p && checked.insert(item)) {
+                assert(!is_primitive_batch(item));
 
                 auto p = reinterpret_cast<primitive<Store>*>(item);
 
-                dist = p->intersects(target,o_hit.normal,o_hit.dist,a);
+                dist = item_intersects(i,local_origins,target,o_hit.normal,o_hit.dist,a);
 
                 if(dist) {
                     if(p->opaque()) {
@@ -1029,7 +1738,6 @@ template<typename Store> struct kd_leaf<Store,true> : kd_node<Store>, flexible_s
 
                     t_hits.add({dist,{item,-1},o_hit.normal});
                 }
-                checked.add(item);
             }
         }
         return false;
@@ -1039,15 +1747,15 @@ template<typename Store> struct kd_leaf<Store,true> : kd_node<Store>, flexible_s
         ray<Store> new_normal{target.dimension(),a};
 
         for(; i<size; ++i) {
-            auto item = this->items()[i].ref();
+            PyObject *item = item_ptr(items[i]);
             if(i < batches) {
-                assert(Py_TYPE(item) == triangle_batch<Store>::pytype());
+                assert(is_primitive_batch(item));
 
-                if(!has(checked,item)) {
+                if(checked.insert(item)) {
                     int index = skip.p == item ? skip.index : -1;
-                    auto p = reinterpret_cast<triangle_batch<Store>*>(item);
+                    auto p = reinterpret_cast<primitive_batch<Store>*>(item);
 
-                    dist = p->intersects(target,new_normal,index,o_hit.dist,a);
+                    dist = batch_intersects(i,local_origins,target,new_normal,index,o_hit.dist,a);
 
                     if(dist) {
                         if(p->opaque(index)) {
@@ -1059,14 +1767,13 @@ template<typename Store> struct kd_leaf<Store,true> : kd_node<Store>, flexible_s
                             t_hits.add({dist,{item,index},new_normal});
                         }
                     }
-                    checked.add(item);
                 }
-            } else if(item != skip.p && !has(checked,item)) {
-                assert(Py_TYPE(item) != triangle_batch<Store>::pytype());
+            } else if(item != skip.p && checked.insert(item)) {
+                assert(!is_primitive_batch(item));
 
                 auto p = reinterpret_cast<primitive<Store>*>(item);
 
-                dist = p->intersects(target,new_normal,o_hit.dist,a);
+                dist = item_intersects(i,local_origins,target,new_normal,o_hit.dist,a);
                 if(dist) {
                     if(p->opaque()) {
                         o_hit.dist = dist;
@@ -1077,11 +1784,10 @@ template<typename Store> struct kd_leaf<Store,true> : kd_node<Store>, flexible_s
                         t_hits.add({dist,{item,-1},new_normal});
                     }
                 }
-                checked.add(item);
             }
         }
 
-        trim_intersections(t_hits,dist,h_start);
+        trim_intersections(t_hits,o_hit.dist,h_start);
         return true;
     }
 
@@ -1091,32 +1797,70 @@ template<typename Store> struct kd_leaf<Store,true> : kd_node<Store>, flexible_s
         real dist;
         ray<Store> normal{dimension(),a};
         for(size_t i=0; i<size; ++i) {
-            auto item = this->items()[i];
+            PyObject *item = item_ptr(items[i]);
 
             if(i < batches) {
-                assert(item.type() == triangle_batch<Store>::pytype());
+                assert(is_primitive_batch(item));
 
-                int index = skip.p == item.ref() ? skip.index : -1;
-                auto p = reinterpret_cast<triangle_batch<Store>*>(item.ref());
+                int index = skip.p == item ? skip.index : -1;
+                auto p = reinterpret_cast<primitive_batch<Store>*>(item);
 
                 dist = p->intersects(target,normal,index,ldistance,a);
 
                 if(dist) {
                     if(p->opaque(index)) return true;
 
-                    hits.add({dist,{item.ref(),index},normal});
+                    hits.add({dist,{item,index},normal});
                 }
-            } else if(item.ref() != skip.p) {
-                assert(item.type() != triangle_batch<Store>::pytype());
+            } else if(item != skip.p) {
+                assert(!is_primitive_batch(item));
 
-                auto p = reinterpret_cast<primitive<Store>*>(item.ref());
+                auto p = reinterpret_cast<primitive<Store>*>(item);
 
                 dist = p->intersects(target,normal,ldistance,a);
 
                 if(dist) {
                     if(p->opaque()) return true;
 
-                    hits.add({dist,{item.ref(),-1},normal});
+                    hits.add({dist,{item,-1},normal});
+                }
+            }
+        }
+        return false;
+    }
+
+    /* Like the unbatched version, but every primitive of a batch that the ray
+       passes through is counted, not just the nearest one */
+    template<typename Set> HOT_FUNC bool occludes(
+        const ray<Store> &target,
+        real ldistance,
+        intersection_target<Store> skip,
+        shadow_filter<Store> &filter,
+        Set &checked,
+        geom_allocator *a=nullptr) const
+    {
+        assert(dimension() == target.dimension());
+
+        ray<Store> normal{dimension(),a};
+        for(size_t i=0; i<size; ++i) {
+            PyObject *item = item_ptr(items[i]);
+
+            if(i < batches) {
+                assert(is_primitive_batch(item));
+
+                if(!checked.insert(item)) continue;
+
+                auto p = reinterpret_cast<primitive_batch<Store>*>(item);
+                v_real dist = p->distances(target,a);
+                for(int j=0; j<static_cast<int>(v_real::size); ++j) {
+                    if(dist[j] && dist[j] < ldistance && !(item == skip.p && j == skip.index) && filter.pass(*p->m[j],{item,j})) return true;
+                }
+            } else if(item != skip.p) {
+                assert(!is_primitive_batch(item));
+
+                auto p = reinterpret_cast<primitive<Store>*>(item);
+                if(p->m->casts_shadow && checked.insert(item)) {
+                    if(p->intersects(target,normal,ldistance,a) && filter.pass(*p->m,{item,-1})) return true;
                 }
             }
         }
@@ -1125,18 +1869,123 @@ template<typename Store> struct kd_leaf<Store,true> : kd_node<Store>, flexible_s
 
     size_t dimension() const {
         assert(size);
-        auto item = this->items()[0].ref();
+        PyObject *item = item_ptr(items[0]);
         return batches ?
             reinterpret_cast<primitive_batch<Store>*>(item)->dimension() :
             reinterpret_cast<primitive<Store>*>(item)->dimension();
     }
+};
+
+template<typename Store,bool Batched=(v_real::size>1)> struct kd_leaf : kd_node<Store>, flexible_struct<kd_leaf<Store,Batched>,py::pyptr<primitive<Store>>> {
+    typedef typename kd_leaf::flexible_struct flex_base;
+
+    using flex_base::operator delete;
+    using flex_base::operator new;
+
+    size_t size;
+
+    size_t _item_size() const {
+        return size;
+    }
+
+    template<typename F> static kd_leaf *create(size_t size,F f) {
+        return new(size) kd_leaf(size,f);
+    }
+
+    kd_leaf *clone() const {
+        return kd_leaf::create(
+            size,
+            [&](size_t i) { return this->items()[i]; });
+    }
+
+    kd_leaf_items<Store,py::pyptr<primitive<Store>>,false> contents() const {
+        return {this->items().begin(),size};
+    }
+
+    bool intersects(
+        const ray<Store> &target,
+        intersection_target<Store> skip,
+        ray_intersection<Store> &o_hit,
+        ray_intersections<Store> &t_hits,
+        prim_set &checked,
+        geom_allocator *a=nullptr) const
+    {
+        return contents().intersects(target,skip,o_hit,t_hits,checked,a);
+    }
+
+    bool occludes(
+        const ray<Store> &target,
+        real ldistance,
+        intersection_target<Store> skip,
+        ray_intersections<Store> &hits,
+        geom_allocator *a=nullptr) const
+    {
+        return contents().occludes(target,ldistance,skip,hits,a);
+    }
+
+    size_t dimension() const {
+        return contents().dimension();
+    }
 
 private:
-    static bool is_batch(py::object x) {
-        // this assumes triangle_batch is the only batch primitive
-        assert(x.type() == solid<Store>::pytype() || x.type() == triangle<Store>::pytype() || x.type() == triangle_batch<Store>::pytype());
+    template<typename F> kd_leaf(size_t size,F f) : kd_node<Store>(LEAF), flex_base(size,f), size(size) {}
+};
+
+template<typename Store> struct kd_leaf<Store,true> : kd_node<Store>, flexible_struct<kd_leaf<Store,true>,py::object> {
+    typedef typename kd_leaf::flexible_struct flex_base;
 
-        return x.type() == triangle_batch<Store>::pytype();
+    using flex_base::operator delete;
+    using flex_base::operator new;
+
+    size_t size;
+    size_t batches;
+
+    size_t _item_size() const {
+        return size;
+    }
+
+    template<typename F> static kd_leaf *create(size_t size,size_t batches,F f) {
+        return new(size) kd_leaf(size,batches,f);
+    }
+    template<typename F> static kd_leaf *create(size_t size,F f) {
+        return new(size) kd_leaf(size,f);
+    }
+
+    kd_leaf *clone() const {
+        return kd_leaf::create(
+            size,
+            batches,
+            [&](size_t i) { return this->items()[i]; });
+    }
+
+    kd_leaf_items<Store,py::object,true> contents() const {
+        return {this->items().begin(),size,batches};
+    }
+
+    bool intersects(
+        const ray<Store> &target,
+        intersection_target<Store> skip,
+        ray_intersection<Store> &o_hit,
+        ray_intersections<Store> &t_hits,
+        prim_set &checked,
+        geom_allocator *a=nullptr) const
+    {
+        return contents().intersects(target,skip,o_hit,t_hits,checked,a);
+    }
+
+    bool occludes(const ray<Store> &target,real ldistance,intersection_target<Store> skip,ray_intersections<Store> &hits,geom_allocator *a=nullptr) const {
+        return contents().occludes(target,ldistance,skip,hits,a);
+    }
+
+    size_t dimension() const {
+        return contents().dimension();
+    }
+
+private:
+    static bool is_batch(const py::object &x) {
+        assert(x.type() == solid<Store>::pytype() || x.type() == triangle<Store>::pytype() || is_primitive_batch(x.ref()));
+
+        return is_primitive_batch(x.ref());
     }
 
     template<typename F> kd_leaf(size_t size,size_t batches,F f) : kd_node<Store>(LEAF), flex_base(size,f), size(size), batches(batches) {
@@ -1146,105 +1995,1102 @@ private:
     template<typename F> kd_leaf(size_t size,F f) : kd_node<Store>(LEAF), flex_base(size,f), size(size) {
         assert(size > 0);
 
-        batches = std::partition(ITR_RANGE(this->items()),is_batch) - this->items().begin();
-    }
+        batches = std::partition(ITR_RANGE(this->items()),is_batch) - this->items().begin();
+    }
+};
+
+template<typename Store> kd_node<Store> *kd_node<Store>::clone() const {
+    if(type == LEAF) return static_cast<const kd_leaf<Store>*>(this)->clone();
+    assert(type == BRANCH);
+    return static_cast<const kd_branch<Store>*>(this)->clone();
+}
+
+/* The k-d tree traversal functions accept either kd_pointer_tree or
+   kd_flat_tree as the "Tree" argument, which provide access to the nodes of
+   the respective form. */
+template<typename Store> struct kd_pointer_tree {
+    typedef const kd_node<Store> *node_ref;
+
+    static bool valid(node_ref n) { return n != nullptr; }
+    static bool is_leaf(node_ref n) { return n->type == LEAF; }
+    static size_t axis(node_ref n) { return branch(n)->axis; }
+    static real split(node_ref n) { return branch(n)->split; }
+    static node_ref left(node_ref n) { return branch(n)->left.get(); }
+    static node_ref right(node_ref n) { return branch(n)->right.get(); }
+
+    static const kd_leaf<Store> &leaf(node_ref n) {
+        assert(n->type == LEAF);
+        return *static_cast<const kd_leaf<Store>*>(n);
+    }
+
+private:
+    static const kd_branch<Store> *branch(node_ref n) {
+        assert(n->type == BRANCH);
+        return static_cast<const kd_branch<Store>*>(n);
+    }
+};
+
+template<typename Store> using kd_item_ptr = std::conditional_t<(v_real::size>1),PyObject*,primitive<Store>*>;
+
+/* Private copies of the primitives of a k-d tree and of their materials, made
+   for a frozen scene. The copies are stored contiguously, in the order they are
+   first encountered in the tree, and the materials are stored in a packed
+   table, so tracing a frozen scene never reads an object that Python code can
+   see or modify, and the original primitives can be released. */
+template<typename Store> class kd_frozen_primitives {
+    typedef kd_item_ptr<Store> item_t;
+
+    std::vector<material> materials;
+    std::vector<item_t> copies;
+    void *storage;
+    size_t storage_size;
+    size_t alignment;
+
+    static size_t copy_size(PyObject *o,size_t dimension) {
+        if(Py_TYPE(o) == triangle<Store>::pytype()) return triangle<Store>::allocation_size(dimension);
+        if(Py_TYPE(o) == solid<Store>::pytype()) return sizeof(solid<Store>);
+        if(Py_TYPE(o) == solid_batch<Store>::pytype()) return solid_batch<Store>::allocation_size(dimension);
+
+        assert(Py_TYPE(o) == triangle_batch<Store>::pytype());
+        return triangle_batch<Store>::allocation_size(dimension);
+    }
+
+    template<typename F> static void for_each_material(PyObject *o,F f) {
+        if(is_primitive_batch(o)) {
+            for(auto &m : reinterpret_cast<primitive_batch<Store>*>(o)->m) f(m.get());
+        } else {
+            f(reinterpret_cast<primitive<Store>*>(o)->m.get());
+        }
+    }
+
+    template<typename F> PyObject *make_copy(void *ptr,PyObject *o,F m) {
+        if(Py_TYPE(o) == triangle<Store>::pytype()) {
+            auto t = reinterpret_cast<triangle<Store>*>(o);
+            return py::ref(triangle<Store>::copy_at(ptr,*t,m(t->m.get())));
+        }
+        if(Py_TYPE(o) == solid<Store>::pytype()) {
+            auto s = reinterpret_cast<solid<Store>*>(o);
+            return py::ref(new(ptr) solid<Store>(s->type,s->orientation,s->inv_orientation,s->position,m(s->m.get())));
+        }
+        if(Py_TYPE(o) == solid_batch<Store>::pytype()) {
+            auto b = reinterpret_cast<solid_batch<Store>*>(o);
+            return py::ref(solid_batch<Store>::copy_at(ptr,*b,[&](size_t i) { return py::borrowed_ref(m(b->m[i].get())); }));
+        }
+
+        assert(Py_TYPE(o) == triangle_batch<Store>::pytype());
+        auto b = reinterpret_cast<triangle_batch<Store>*>(o);
+        return py::ref(triangle_batch<Store>::copy_at(ptr,*b,[&](size_t i) { return py::borrowed_ref(m(b->m[i].get())); }));
+    }
+
+    void destroy() noexcept {
+        for(item_t c : copies) {
+            PyObject *o = py::ref(c);
+            if(Py_TYPE(o) == triangle<Store>::pytype()) std::destroy_at(reinterpret_cast<triangle<Store>*>(o));
+            else if(Py_TYPE(o) == solid<Store>::pytype()) std::destroy_at(reinterpret_cast<solid<Store>*>(o));
+            else if(Py_TYPE(o) == solid_batch<Store>::pytype()) std::destroy_at(reinterpret_cast<solid_batch<Store>*>(o));
+            else std::destroy_at(reinterpret_cast<triangle_batch<Store>*>(o));
+        }
+        copies.clear();
+        if(storage) global_delete(storage,storage_size,alignment);
+    }
+
+public:
+    /* Every element of "items" is replaced with its copy. This must be called
+       with the GIL held. */
+    kd_frozen_primitives(std::vector<item_t> &items,size_t dimension) : storage(nullptr), storage_size(0) {
+        alignment = std::max({alignof(solid<Store>),triangle<Store>::alignment,triangle_batch<Store>::alignment,solid_batch<Store>::alignment});
+
+        std::unordered_map<PyObject*,size_t> copy_index;
+        std::unordered_map<material*,size_t> material_index;
+        std::vector<PyObject*> originals;
+        std::vector<size_t> offsets;
+
+        for(item_t item : items) {
+            PyObject *o = py::ref(item);
+            if(copy_index.emplace(o,originals.size()).second) {
+                originals.push_back(o);
+                offsets.push_back(storage_size);
+                storage_size += aligned(copy_size(o,dimension),alignment);
+                for_each_material(o,[&](material *m) { material_index.emplace(m,material_index.size()); });
+            }
+        }
+
+        materials.resize(material_index.size());
+        for(auto &mi : material_index) {
+            material &m = materials[mi.second];
+            m.c = mi.first->c;
+            m.specular = mi.first->specular;
+            m.opacity = mi.first->opacity;
+            m.reflectivity = mi.first->reflectivity;
+            m.specular_intensity = mi.first->specular_intensity;
+            m.specular_exp = mi.first->specular_exp;
+            m.casts_shadow = mi.first->casts_shadow;
+        }
+
+        if(!storage_size) return;
+        storage = global_new(storage_size,alignment);
+
+        copies.reserve(originals.size());
+        try {
+            for(size_t i=0; i<originals.size(); ++i) {
+                copies.push_back(reinterpret_cast<item_t>(make_copy(
+                    static_cast<char*>(storage) + offsets[i],
+                    originals[i],
+                    [&](material *m) { return &materials[material_index[m]]; })));
+            }
+        } catch(...) {
+            destroy();
+            throw;
+        }
+
+        for(item_t &item : items) item = copies[copy_index[py::ref(item)]];
+    }
+
+    kd_frozen_primitives(const kd_frozen_primitives&) = delete;
+    kd_frozen_primitives &operator=(const kd_frozen_primitives&) = delete;
+
+    ~kd_frozen_primitives() {
+        destroy();
+    }
+};
+
+template<typename Store> struct aabb;
+
+/* A compact, read-only copy of a k-d tree, used by composite_scene for
+   tracing. The nodes are stored contiguously in depth-first order, so the left
+   child of a branch always immediately follows it, and each node is only eight
+   bytes: the split position and a word with the axis in the lower "axis_bits"
+   bits and the index of the right child in the rest. The lower bits of a leaf
+   hold a tag instead, and the split is replaced by an index into "leaves",
+   which are ranges of "items". A missing child is represented by an empty
+   node.
+
+   Unless the tree is frozen, the primitive references in "items" are borrowed
+   from the original tree, so that tree must outlive this. */
+template<typename Store> struct kd_flat_tree {
+    typedef kd_item_ptr<Store> item_t;
+
+    struct node {
+        union {
+            real split;
+            uint32_t leaf;
+        };
+        uint32_t data;
+    };
+    static_assert(sizeof(node) == 8);
+
+    struct leaf_range {
+        uint32_t start;
+        uint32_t size;
+        uint32_t batches;
+    };
+
+    typedef const node *node_ref;
+
+    std::vector<node> nodes;
+    std::vector<leaf_range> leaves;
+    std::vector<item_t> items;
+    unsigned int axis_bits;
+    uint32_t axis_mask;
+    std::unique_ptr<kd_frozen_primitives<Store>> frozen;
+    kd_origin_cache<Store> origins;
+
+    /* The branches from the root towards the region that contains the origin
+       given to "set_origin", and the node they lead to. Every ray that starts
+       at that origin, such as the primary rays, goes to the same side of these
+       branches first, so tracing them can skip straight to "path_end". The
+       path stops at a leaf, at a split plane that the origin lies on, since
+       which side a ray goes to first then depends on its direction, or after
+       KD_ORIGIN_PATH_MAX branches. */
+    node_ref path[KD_ORIGIN_PATH_MAX];
+    size_t path_size;
+    node_ref path_end;
+    vector<Store> path_origin;
+    bool path_valid;
+
+    // the number of empty nodes, which are numbered like the leaves
+    uint32_t empties;
+
+#ifdef KD_ROPES
+    static constexpr uint32_t no_rope = std::numeric_limits<uint32_t>::max();
+
+    /* For every leaf and every empty node (a "cell"), the region it covers,
+       as "dimension" starts followed by "dimension" ends, and the index of the
+       node on the other side of each of its faces, or no_rope if the face is
+       on the scene's boundary. The faces of axis "i" are 2*i (the start) and
+       2*i+1 (the end). The leaves come first, followed by the empty nodes. */
+    std::vector<real> cell_bounds;
+    std::vector<uint32_t> ropes;
+#endif
+
+    kd_flat_tree(const kd_node<Store> *root,const aabb<Store> &boundary,bool freeze=false)
+            : axis_bits(1), origins(boundary.dimension()), path_size(0), path_end(nullptr), path_origin(boundary.dimension()), path_valid(false), empties(0) {
+        size_t dimension = boundary.dimension();
+
+        // the two largest values of the lower bits are the leaf and empty tags
+        while((size_t(1) << axis_bits) < dimension + 2) ++axis_bits;
+        if(axis_bits >= 32) throw std::length_error("too many dimensions");
+        axis_mask = (uint32_t(1) << axis_bits) - 1;
+
+        add(root);
+        if(freeze) frozen.reset(new kd_frozen_primitives<Store>(items,dimension));
+        origins.assign(items);
+
+#ifdef KD_ROPES
+        size_t cells = leaves.size() + empties;
+        cell_bounds.resize(cells * dimension * 2);
+        ropes.resize(cells * dimension * 2);
+
+        std::vector<real> box(dimension * 2);
+        for(size_t i=0; i<dimension; ++i) {
+            box[i] = boundary.start[i];
+            box[dimension + i] = boundary.end[i];
+        }
+        std::vector<uint32_t> faces(dimension * 2,no_rope);
+        add_ropes(nodes.data(),box,faces);
+#endif
+    }
+
+    /* precompute the local origin of rays starting at "o", for every solid,
+       and the path towards "o" */
+    void set_origin(const vector<Store> &o) {
+        // the path is updated under the origin cache's lock
+        origins.set_origin(o,[&]{
+            path_size = 0;
+            node_ref n = root();
+            while(path_size < KD_ORIGIN_PATH_MAX && valid(n) && !is_leaf(n) && o[axis(n)] != split(n)) {
+                path[path_size++] = n;
+                n = o[axis(n)] > split(n) ? right(n) : left(n);
+            }
+            path_end = n;
+            path_origin = o;
+            path_valid = true;
+        });
+    }
+
+    // whether the rays starting at "o" can use the precomputed path
+    bool has_path(const vector<Store> &o) const {
+        return path_valid && o == path_origin;
+    }
+
+    node_ref root() const { return nodes.data(); }
+
+    bool valid(node_ref n) const { return (n->data & axis_mask) != empty_tag(); }
+    bool is_leaf(node_ref n) const { return (n->data & axis_mask) == leaf_tag(); }
+    size_t axis(node_ref n) const { return n->data & axis_mask; }
+    real split(node_ref n) const { return n->split; }
+    node_ref left(node_ref n) const { return n + 1; }
+    node_ref right(node_ref n) const { return nodes.data() + (n->data >> axis_bits); }
+
+    auto leaf(node_ref n) const {
+        assert(is_leaf(n));
+        const leaf_range &r = leaves[n->leaf];
+        const uint32_t *slots = origins.slots.empty() ? nullptr : origins.slots.data() + r.start;
+        if constexpr(v_real::size > 1) {
+            return kd_leaf_items<Store,item_t>{items.data() + r.start,r.size,r.batches,&origins,slots};
+        } else {
+            return kd_leaf_items<Store,item_t>{items.data() + r.start,r.size,&origins,slots};
+        }
+    }
+
+#ifdef KD_ROPES
+    /* Find the leaf or empty node under "n" that contains the point at
+       distance "t" along "target". A point on a split plane goes to the side
+       that the ray is heading towards. */
+    node_ref locate(node_ref n,const ray<Store> &target,real t) const {
+        while(valid(n) && !is_leaf(n)) {
+            size_t a = axis(n);
+            real p = target.origin[a] + target.direction[a] * t;
+            n = (p == split(n) ? target.direction[a] >= 0 : p > split(n)) ? right(n) : left(n);
+        }
+        return n;
+    }
+
+    /* Find where "target" leaves the leaf or empty node "n" and set "next" to
+       the node on the other side, or null if the ray leaves the scene */
+    real cell_exit(node_ref n,const ray<Store> &target,const vector<Store> &invdir,node_ref &next) const {
+        size_t d = target.dimension();
+        size_t c = is_leaf(n) ? n->leaf : leaves.size() + n->leaf;
+        const real *b = cell_bounds.data() + c*d*2;
+        const uint32_t *r = ropes.data() + c*d*2;
+
+        real t_exit = std::numeric_limits<real>::max();
+        uint32_t face = no_rope;
+        for(size_t i=0; i<d; ++i) {
+            if(target.direction[i]) {
+                bool up = target.direction[i] > 0;
+                real t = ((up ? b[d + i] : b[i]) - target.origin[i]) * invdir[i];
+                if(t < t_exit) {
+                    t_exit = t;
+                    face = r[i*2 + up];
+                }
+            }
+        }
+        next = face == no_rope ? nullptr : nodes.data() + face;
+        return t_exit;
+    }
+#endif
+
+private:
+    uint32_t leaf_tag() const { return axis_mask; }
+    uint32_t empty_tag() const { return axis_mask - 1; }
+
+    uint32_t checked_index(size_t i) const {
+        if(i > (std::numeric_limits<uint32_t>::max() >> axis_bits)) throw std::length_error("k-d tree is too large");
+        return static_cast<uint32_t>(i);
+    }
+
+#ifdef KD_ROPES
+    /* Record the region and neighbours of every cell under "n". "box" and
+       "faces" are the region of "n" and the nodes on the other side of its
+       faces. Since a rope only leads to the sibling of a node or of one of its
+       ancestors, tracing continues by locating the cell within that node. */
+    void add_ropes(node_ref n,std::vector<real> &box,std::vector<uint32_t> &faces) {
+        size_t d = box.size() / 2;
+        if(!valid(n) || is_leaf(n)) {
+            size_t c = is_leaf(n) ? n->leaf : leaves.size() + n->leaf;
+            std::copy(box.begin(),box.end(),cell_bounds.begin() + c*d*2);
+            std::copy(faces.begin(),faces.end(),ropes.begin() + c*d*2);
+            return;
+        }
+
+        size_t a = axis(n);
+        real old_bound = box[d + a];
+        uint32_t old_face = faces[a*2 + 1];
+        box[d + a] = split(n);
+        faces[a*2 + 1] = static_cast<uint32_t>(right(n) - nodes.data());
+        add_ropes(left(n),box,faces);
+        box[d + a] = old_bound;
+        faces[a*2 + 1] = old_face;
+
+        old_bound = box[a];
+        old_face = faces[a*2];
+        box[a] = split(n);
+        faces[a*2] = static_cast<uint32_t>(left(n) - nodes.data());
+        add_ropes(right(n),box,faces);
+        box[a] = old_bound;
+        faces[a*2] = old_face;
+    }
+#endif
+
+    uint32_t add(const kd_node<Store> *n) {
+        uint32_t i = checked_index(nodes.size());
+        nodes.emplace_back();
+
+        if(!n) {
+            nodes[i].leaf = empties++;
+            nodes[i].data = empty_tag();
+        } else if(n->type == LEAF) {
+            auto l = static_cast<const kd_leaf<Store>*>(n);
+            leaf_range r;
+            r.start = checked_index(items.size());
+            r.size = static_cast<uint32_t>(l->size);
+            r.batches = 0;
+            if constexpr(v_real::size > 1) r.batches = static_cast<uint32_t>(l->batches);
+            for(auto &item : l->items()) items.push_back(item_ptr(item));
+            checked_index(items.size());
+
+            nodes[i].leaf = static_cast<uint32_t>(leaves.size());
+            nodes[i].data = leaf_tag();
+            leaves.push_back(r);
+        } else {
+            assert(n->type == BRANCH);
+            auto b = static_cast<const kd_branch<Store>*>(n);
+            assert(b->axis < empty_tag());
+
+            nodes[i].split = b->split;
+            add(b->left.get());
+            uint32_t r = add(b->right.get());
+            nodes[i].data = (r << axis_bits) | static_cast<uint32_t>(b->axis);
+        }
+        return i;
+    }
+};
+
+template<typename Store,typename Tree=kd_pointer_tree<Store>> struct kd_node_intersection {
+    typedef typename Tree::node_ref node_ref;
+
+    const Tree &tree;
+    const ray<Store> &target;
+    const vector<Store> &invdir;
+    intersection_target<Store> skip;
+    ray_intersection<Store> &o_hit;
+    ray_intersections<Store> &t_hits;
+    prim_set checked;
+    geom_allocator *a;
+
+    kd_node_intersection(
+            const Tree &tree,
+            const ray<Store> &target,
+            const vector<Store> &invdir,
+            intersection_target<Store> skip,
+            ray_intersection<Store> &o_hit,
+            ray_intersections<Store> &t_hits,
+            geom_allocator *a)
+        : tree{tree}, target{target}, invdir{invdir}, skip{skip}, o_hit{o_hit}, t_hits{t_hits}, a{a} {}
+
+    bool operator()(node_ref node,real t_near,real t_far);
+    bool along_path(const node_ref *path,size_t size,node_ref end,real t_near,real t_far);
+};
+
+template<typename Store,typename Tree> HOT_FUNC bool kd_node_intersection<Store,Tree>::operator()(node_ref node,real t_near,real t_far) {
+    while(tree.valid(node)) {
+        if(tree.is_leaf(node)) {
+            bool r = tree.leaf(node).intersects(target,skip,o_hit,t_hits,checked,a);
+            assert(!r || o_hit.target.p);
+            return r;
+        }
+
+        assert(target.dimension() == o_hit.normal.dimension());
+        size_t axis = tree.axis(node);
+        real split = tree.split(node);
+
+        if(target.direction[axis]) {
+            if(target.origin[axis] == split) {
+                node = target.direction[axis] > 0 ? tree.right(node) : tree.left(node);
+                continue;
+            }
+
+            real t = (split - target.origin[axis]) * invdir[axis];
+
+            auto n_near = target.origin[axis] > split ? tree.right(node) : tree.left(node);
+            auto n_far = target.origin[axis] > split ? tree.left(node) : tree.right(node);
+
+            if(t < 0 || t > t_far) {
+                node = n_near;
+                continue;
+            }
+            if(t < t_near) {
+                node = n_far;
+                continue;
+            }
+
+            if(tree.valid(n_near)) {
+                size_t h_start = t_hits.size();
+                bool hit = operator()(n_near,t_near,t);
+                if((hit && o_hit.dist <= t) || !tree.valid(n_far)) return hit;
+
+                if(hit) {
+                    /* If dist is greater than t, the intersection was in a
+                       farther division (a primitive can span multiple
+                       divisions) and a closer primitive may exist, but if the
+                       intersection is with a primitive that is embedded in the
+                       split plane, dist can also be greater than t due to an
+                       error from limited precision, so we can't assume the
+                       primitive is also in t_far. */
+
+                    if(operator()(n_far,t,t_far)) {
+                        /* if there is a closer intersection, some of the
+                        transparent hits from before, might be invalid */
+                        trim_intersections(t_hits,o_hit.dist,h_start);
+                    }
+                    return true;
+                }
+            }
+
+            assert(tree.valid(n_far));
+            node = n_far;
+            t_near = t;
+            continue;
+        }
+
+        node = target.origin[axis] >= split ? tree.right(node) : tree.left(node);
+    }
+    return false;
+}
+
+/* Like operator(), but for a ray that starts at the origin that "path" leads
+   towards (see kd_flat_tree::path). Since the near side of each branch on the
+   path is already known, the branches are only used to find where the ray
+   crosses their split planes. The far children that the ray also reaches are
+   visited afterwards, from the deepest up, which is the order that operator()
+   would visit them in. */
+template<typename Store,typename Tree> HOT_FUNC bool kd_node_intersection<Store,Tree>::along_path(const node_ref *path,size_t size,node_ref end,real t_near,real t_far) {
+    struct pending {
+        node_ref node;
+        real t_near;
+        real t_far;
+    };
+
+    pending stack[KD_ORIGIN_PATH_MAX];
+    size_t depth = 0;
+    size_t h_start = t_hits.size();
+
+    node_ref node = end;
+    for(size_t i=0; i<size; ++i) {
+        size_t axis = tree.axis(path[i]);
+        real split = tree.split(path[i]);
+
+        // a ray parallel to the split plane stays on the near side
+        if(!target.direction[axis]) continue;
+
+        real t = (split - target.origin[axis]) * invdir[axis];
+        if(t < 0 || t > t_far) continue;
+
+        auto n_far = target.origin[axis] > split ? tree.left(path[i]) : tree.right(path[i]);
+        if(t < t_near) {
+            // the ray only passes through the far side of this branch
+            node = n_far;
+            break;
+        }
+
+        stack[depth++] = {n_far,t,t_far};
+        t_far = t;
+    }
+
+    bool hit = operator()(node,t_near,t_far);
+    while(depth) {
+        const pending &p = stack[--depth];
+
+        // the remaining far children are all beyond this split
+        if(hit && o_hit.dist <= p.t_near) break;
+
+        if(operator()(p.node,p.t_near,p.t_far)) hit = true;
+    }
+
+    if(hit) trim_intersections(t_hits,o_hit.dist,h_start);
+    return hit;
+}
+
+template<typename Store> inline bool intersects(
+    const kd_node<Store> *node,
+    const ray<Store> &target,
+    intersection_target<Store> skip,
+    ray_intersection<Store> &o_hit,
+    ray_intersections<Store> &t_hits,
+    real t_near,
+    real t_far,
+    geom_allocator *a=nullptr)
+{
+    kd_pointer_tree<Store> tree;
+    const vector<Store> invdir{1/target.direction,a};
+    return kd_node_intersection<Store>{tree,target,invdir,skip,o_hit,t_hits,a}(node,t_near,t_far);
+}
+
+#ifdef KD_ROPES
+/* Trace a ray through a k-d tree without a stack, by going from each cell to
+   the neighbour on the other side of the face that the ray leaves through. */
+template<typename Store> HOT_FUNC bool kd_rope_intersects(
+    const kd_flat_tree<Store> &tree,
+    const ray<Store> &target,
+    const vector<Store> &invdir,
+    intersection_target<Store> skip,
+    ray_intersection<Store> &o_hit,
+    ray_intersections<Store> &t_hits,
+    real t_near,
+    real t_far,
+    geom_allocator *a)
+{
+    prim_set checked;
+    size_t h_start = t_hits.size();
+    bool hit = false;
+
+    // a ray from the camera can skip the precomputed path
+    auto node = tree.locate(tree.has_path(target.origin) && t_near == 0 ? tree.path_end : tree.root(),target,t_near);
+    for(;;) {
+        if(tree.is_leaf(node) && tree.leaf(node).intersects(target,skip,o_hit,t_hits,checked,a)) hit = true;
+
+        typename kd_flat_tree<Store>::node_ref next;
+        real t_exit = tree.cell_exit(node,target,invdir,next);
+
+        /* a primitive can span more than one cell, so a hit can be beyond the
+           current cell, in which case a nearer one may still exist */
+        if((hit && o_hit.dist <= t_exit) || t_exit >= t_far || !next) break;
+
+        node = tree.locate(next,target,t_exit);
+    }
+
+    if(hit) trim_intersections(t_hits,o_hit.dist,h_start);
+    return hit;
+}
+
+template<typename Store> HOT_FUNC bool kd_rope_occludes(
+    const kd_flat_tree<Store> &tree,
+    const ray<Store> &target,
+    const vector<Store> &invdir,
+    real ldistance,
+    intersection_target<Store> skip,
+    shadow_filter<Store> &filter,
+    real t_near,
+    real t_far,
+    geom_allocator *a)
+{
+    t_far = std::min(t_far,ldistance);
+
+    prim_set checked;
+    auto node = tree.locate(tree.root(),target,t_near);
+    for(;;) {
+        if(tree.is_leaf(node) && tree.leaf(node).occludes(target,ldistance,skip,filter,checked,a)) return true;
+
+        typename kd_flat_tree<Store>::node_ref next;
+        real t_exit = tree.cell_exit(node,target,invdir,next);
+        if(t_exit >= t_far || !next) return false;
+
+        node = tree.locate(next,target,t_exit);
+    }
+}
+#endif
+
+/* "invdir" is the reciprocal of the ray's direction, which the caller already
+   needed to find where the ray enters the scene */
+template<typename Store> inline bool intersects(
+    const kd_flat_tree<Store> &tree,
+    const ray<Store> &target,
+    const vector<Store> &invdir,
+    intersection_target<Store> skip,
+    ray_intersection<Store> &o_hit,
+    ray_intersections<Store> &t_hits,
+    real t_near,
+    real t_far,
+    geom_allocator *a=nullptr)
+{
+#ifdef KD_ROPES
+    return kd_rope_intersects(tree,target,invdir,skip,o_hit,t_hits,t_near,t_far,a);
+#else
+    kd_node_intersection<Store,kd_flat_tree<Store>> ki{tree,target,invdir,skip,o_hit,t_hits,a};
+    if(tree.has_path(target.origin)) return ki.along_path(tree.path,tree.path_size,tree.path_end,t_near,t_far);
+    return ki(tree.root(),t_near,t_far);
+#endif
+}
+
+/* Finds the nearest intersections of a packet of up to v_real::size rays that
+   all have the same origin, such as the primary rays from the camera. Since the
+   rays start on the same side of every split plane, the packet walks the tree
+   together, computing the split distances for all of its rays at once, and is
+   only divided where the rays' paths diverge. The primitives themselves are
+   still tested one ray at a time. */
+template<typename Store,typename Tree=kd_pointer_tree<Store>> struct kd_node_packet_intersection {
+    typedef unsigned int lane_mask;
+    typedef typename Tree::node_ref node_ref;
+
+    const Tree &tree;
+    const ray<Store> *targets;
+    const vector<Store,v_real> direction;
+    const vector<Store,v_real> invdir;
+    ray_intersection<Store> *o_hits;
+    ray_intersections<Store> *t_hits;
+    prim_set *checked;
+    geom_allocator *a;
+
+    // which rays have hit an opaque primitive
+    lane_mask hits;
+
+    kd_node_packet_intersection(
+            const Tree &tree,
+            const ray<Store> *targets,
+            ray_intersection<Store> *o_hits,
+            ray_intersections<Store> *t_hits,
+            prim_set *checked,
+            geom_allocator *a)
+        : tree{tree},
+          targets{targets},
+          direction{deinterleave<Store,v_real::size>(targets[0].dimension(),[=](size_t i) { return targets[i].direction; })},
+          invdir{deinterleave<Store,v_real::size>(targets[0].dimension(),[=](size_t i) { return vector<Store>{1/targets[i].direction}; })},
+          o_hits{o_hits}, t_hits{t_hits}, checked{checked}, a{a}, hits{0} {}
+
+    void operator()(node_ref node,v_real t_near,v_real t_far,lane_mask active);
+    void along_path(const node_ref *path,size_t size,node_ref end,v_real t_near,v_real t_far,lane_mask active);
+};
+
+template<typename Store,typename Tree> HOT_FUNC void kd_node_packet_intersection<Store,Tree>::operator()(node_ref node,v_real t_near,v_real t_far,lane_mask active) {
+    const vector<Store> &origin = targets[0].origin;
+
+    while(tree.valid(node) && active) {
+        if(tree.is_leaf(node)) {
+            auto &&leaf = tree.leaf(node);
+            for(size_t i=0; i<v_real::size; ++i) {
+                if((active & (1u << i)) && leaf.intersects(targets[i],{},o_hits[i],t_hits[i],checked[i],a)) {
+                    assert(o_hits[i].target.p);
+                    hits |= 1u << i;
+                }
+            }
+            return;
+        }
+
+        size_t axis = tree.axis(node);
+        real split = tree.split(node);
+
+        if(origin[axis] == split) {
+            // the rays go to whichever side they are pointing at
+            lane_mask left = active & (direction[axis] < v_real::zeros()).to_bits();
+            if(left) operator()(tree.left(node),t_near,t_far,left);
+            active &= ~left;
+            node = tree.right(node);
+            continue;
+        }
+
+        v_real t = v_real::repeat(split - origin[axis]) * invdir[axis];
+
+        auto n_near = origin[axis] > split ? tree.right(node) : tree.left(node);
+        auto n_far = origin[axis] > split ? tree.left(node) : tree.right(node);
+
+        /* rays parallel to the split plane end up in near_only. Their "t" is
+           not finite, and comparisons with it are not reliable when compiled
+           with -ffinite-math-only, so they are found by their direction. */
+        auto near_only_m = direction[axis] == v_real::zeros() || t < v_real::zeros() || t > t_far;
+        auto far_only_m = t < t_near;
+        auto both_m = !(near_only_m || far_only_m);
+
+        lane_mask near_only = active & near_only_m.to_bits();
+        lane_mask both = active & both_m.to_bits();
+        lane_mask far = active & ~near_only;
+
+        if(tree.valid(n_near) && (near_only | both)) {
+            operator()(n_near,t_near,simd::mask_blend(both_m,t,t_far),near_only | both);
+
+            // rays that hit something before reaching the split plane are done
+            for(size_t i=0; i<v_real::size; ++i) {
+                if((both & hits & (1u << i)) && o_hits[i].dist <= t[i]) far &= ~(1u << i);
+            }
+        }
+
+        node = n_far;
+        t_near = simd::mask_blend(both_m,t,t_near);
+        active = far;
+    }
+}
+
+/* The packet version of kd_node_intersection::along_path. Rays that only
+   pass through the far side of a branch on the path leave the path there. */
+template<typename Store,typename Tree> HOT_FUNC void kd_node_packet_intersection<Store,Tree>::along_path(
+    const node_ref *path,
+    size_t size,
+    node_ref end,
+    v_real t_near,
+    v_real t_far,
+    lane_mask active)
+{
+    struct pending {
+        node_ref node;
+        v_real t_near;
+        v_real t_far;
+        lane_mask active;
+    };
+
+    const vector<Store> &origin = targets[0].origin;
+    pending stack[KD_ORIGIN_PATH_MAX];
+    size_t depth = 0;
+
+    for(size_t i=0; i<size && active; ++i) {
+        size_t axis = tree.axis(path[i]);
+        real split = tree.split(path[i]);
+        auto n_far = origin[axis] > split ? tree.left(path[i]) : tree.right(path[i]);
+
+        v_real t = v_real::repeat(split - origin[axis]) * invdir[axis];
+
+        // as in operator(), parallel rays are found by their direction
+        auto near_only_m = direction[axis] == v_real::zeros() || t < v_real::zeros() || t > t_far;
+        auto both_m = !(near_only_m || t < t_near);
+
+        lane_mask both = active & both_m.to_bits();
+        lane_mask far_only = active & ~(near_only_m.to_bits() | both);
+
+        if(far_only) {
+            if(tree.valid(n_far)) operator()(n_far,t_near,t_far,far_only);
+            active &= ~far_only;
+        }
+        if(both) stack[depth++] = {n_far,t,t_far,both};
+        t_far = simd::mask_blend(both_m,t,t_far);
+    }
+
+    if(active) operator()(end,t_near,t_far,active);
+
+    while(depth) {
+        const pending &p = stack[--depth];
+        if(!tree.valid(p.node)) continue;
+
+        lane_mask lanes = p.active;
+        for(size_t i=0; i<v_real::size; ++i) {
+            if((lanes & hits & (1u << i)) && o_hits[i].dist <= p.t_near[i]) lanes &= ~(1u << i);
+        }
+        if(lanes) operator()(p.node,p.t_near,p.t_far,lanes);
+    }
+}
+
+/* "leaf_occludes" is called with each leaf that the ray passes through, in
+   order, until it returns true */
+template<typename Store,typename Tree,typename F> HOT_FUNC bool _occludes(const Tree &tree,typename Tree::node_ref node,const ray<Store> &target,const vector<Store> &invdir,real ldistance,real t_near,real t_far,F &leaf_occludes) {
+    while(tree.valid(node)) {
+        if(tree.is_leaf(node)) return leaf_occludes(tree.leaf(node));
+
+        size_t axis = tree.axis(node);
+        real split = tree.split(node);
+
+        if(target.direction[axis]) {
+            if(target.origin[axis] == split) {
+                node = target.direction[axis] > 0 ? tree.right(node) : tree.left(node);
+                continue;
+            }
+
+            real t = (split - target.origin[axis]) * invdir[axis];
+
+            auto n_near = tree.left(node);
+            auto n_far = tree.right(node);
+            if(target.origin[axis] > split) {
+                n_near = tree.right(node);
+                n_far = tree.left(node);
+            }
+
+            if(t < 0 || t > t_far) {
+                node = n_near;
+                continue;
+            }
+            if(t < t_near) {
+                node = n_far;
+                continue;
+            }
+
+            if(tree.valid(n_near)) {
+                if(!tree.valid(n_far)) {
+                    t_far = t;
+                    node = n_near;
+                    continue;
+                }
+                if(_occludes<Store>(tree,n_near,target,invdir,ldistance,t_near,t,leaf_occludes)) return true;
+            }
+
+            assert(tree.valid(n_far));
+            if(t >= ldistance) return false;
+            t_near = t;
+            node = n_far;
+            continue;
+        }
+
+        node = target.origin[axis] >= split ? tree.right(node) : tree.left(node);
+    }
+    return false;
+}
+
+/* Every transparent primitive found is added to "hits", in an arbitrary order
+   and possibly more than once */
+template<typename Store> inline bool occludes(const kd_node<Store> *node,const ray<Store> &target,real ldistance,intersection_target<Store> skip,ray_intersections<Store> &hits,real t_near,real t_far,geom_allocator *a=nullptr) {
+    auto leaf_occludes = [&](const kd_leaf<Store> &leaf) { return leaf.occludes(target,ldistance,skip,hits,a); };
+    return _occludes<Store>(kd_pointer_tree<Store>{},node,target,vector<Store>{1/target.direction,a},ldistance,t_near,t_far,leaf_occludes);
+}
+
+/* Unlike the above, the transparent primitives found filter "filter" in
+   place, which can block the light before an opaque primitive is found */
+template<typename Store> inline bool occludes(const kd_flat_tree<Store> &tree,const ray<Store> &target,const vector<Store> &invdir,real ldistance,intersection_target<Store> skip,shadow_filter<Store> &filter,real t_near,real t_far,geom_allocator *a=nullptr) {
+#ifdef KD_ROPES
+    return kd_rope_occludes(tree,target,invdir,ldistance,skip,filter,t_near,t_far,a);
+#else
+    prim_set checked;
+    auto leaf_occludes = [&](const auto &leaf) { return leaf.occludes(target,ldistance,skip,filter,checked,a); };
+    return _occludes<Store>(tree,tree.root(),target,invdir,ldistance,t_near,t_far,leaf_occludes);
+#endif
+}
+
+/* A bounding volume hierarchy, as an alternative to a k-d tree. Every
+   primitive is in exactly one leaf, so, unlike with a k-d tree, the number of
+   references doesn't grow with the number of primitives that straddle a
+   split, which matters most at high dimensions, but the nodes can overlap.
+
+   The nodes are stored contiguously in depth-first order, so the left child of
+   a branch always immediately follows it. Each node has its own bounding box,
+   stored in "bounds" as the "dimension" values of its start followed by the
+   "dimension" values of its end. */
+struct bvh_node {
+    /* for a branch, the index of the right child (or of the node, in a
+       bvh_wide_node), otherwise the first item */
+    uint32_t index;
+
+    // the number of items, or zero for a branch
+    uint32_t size;
+
+    // the number of leading items that are instances of primitive_batch
+    uint32_t batches;
+};
+
+struct bvh_nodes {
+    size_t dimension;
+    std::vector<bvh_node> nodes;
+    std::vector<real> bounds;
+
+    explicit bvh_nodes(size_t dimension) : dimension(dimension) {}
+
+    const real *start(size_t n) const { return bounds.data() + n*dimension*2; }
+    const real *end(size_t n) const { return start(n) + dimension; }
 };
 
-template<typename Store> kd_node<Store> *kd_node<Store>::clone() const {
-    if(type == LEAF) return static_cast<const kd_leaf<Store>*>(this)->clone();
-    assert(type == BRANCH);
-    return static_cast<const kd_branch<Store>*>(this)->clone();
+/* Half the surface area of a box given as "d" start values followed by "d" end
+   values. Since only ratios between areas are needed, the half doesn't matter.
+   The extents are clamped to "min_extent" so that a box that is flat along
+   some axes still has an area. */
+inline real bvh_box_area(const real *box,size_t d,real min_extent) {
+    real volume = 1;
+    real inv_sum = 0;
+    for(size_t i=0; i<d; ++i) {
+        real e = std::max(box[d+i] - box[i],min_extent);
+        volume *= e;
+        inv_sum += 1 / e;
+    }
+    return volume * inv_sum;
 }
 
-template<typename Store> struct kd_node_intersection {
-    const ray<Store> &target;
-    const vector<Store> invdir;
-    intersection_target<Store> skip;
-    ray_intersection<Store> &o_hit;
-    ray_intersections<Store> &t_hits;
-    prim_list checked;
-    geom_allocator *a;
+/* The result of building a BVH. The items are owned references to the
+   primitives, in the order the leaves refer to them. */
+template<typename Store> struct bvh_data : bvh_nodes {
+    std::vector<py::object> items;
 
-    kd_node_intersection(
-            const ray<Store> &target,
-            intersection_target<Store> skip,
-            ray_intersection<Store> &o_hit,
-            ray_intersections<Store> &t_hits,
-            geom_allocator *a)
-        : target{target}, invdir{1/target.direction}, skip{skip}, o_hit{o_hit}, t_hits{t_hits}, a{a} {}
+    explicit bvh_data(size_t dimension) : bvh_nodes(dimension) {}
+};
 
-    bool operator()(const kd_node<Store> *node,real t_near,real t_far);
+/* A node of a BVH with up to BVH_WIDTH children. Each child is either a leaf
+   or another wide node. The children's boxes are stored by bvh_tree so that a
+   ray can be tested against all of them at once. */
+struct bvh_wide_node {
+    bvh_node children[BVH_WIDTH];
+    uint32_t count;
 };
 
-template<typename Store> HOT_FUNC bool kd_node_intersection<Store>::operator()(const kd_node<Store> *node,real t_near,real t_far) {
-    while(node) {
-        if(node->type == LEAF) {
-            bool r = static_cast<const kd_leaf<Store>*>(node)->intersects(target,skip,o_hit,t_hits,checked,a);
-            assert(!r || o_hit.target.p);
-            return r;
-        }
+/* A copy of a BVH, in the form used by composite_scene for tracing. Like
+   kd_flat_tree, unless the tree is frozen, the primitive references in "items"
+   are borrowed from the bvh_data instance it was made from.
 
-        assert(node->type == BRANCH);
-        assert(target.dimension() == o_hit.normal.dimension());
-        auto bnode = static_cast<const kd_branch<Store>*>(node);
+   The binary tree is collapsed into a tree of bvh_wide_node instances, to make
+   it shallower. For each node, "bounds" holds, for each axis, the start of
+   every child's box along that axis followed by the ends. The boxes of unused
+   children are left as zeros, a degenerate box at the origin, and
+   "clip_children" drops them from its result by masking out all but the first
+   "count" children. */
+template<typename Store> struct bvh_tree {
+    typedef kd_item_ptr<Store> item_t;
 
-        if(target.direction[bnode->axis]) {
-            if(target.origin[bnode->axis] == bnode->split) {
-                node = (target.direction[bnode->axis] > 0 ? bnode->right : bnode->left).get();
-                continue;
-            }
+    // the most entries a traversal stack can hold
+    static constexpr size_t stack_size = BVH_MAX_DEPTH * (BVH_WIDTH - 1) + 1;
 
-            real t = (bnode->split - target.origin[bnode->axis]) * invdir[bnode->axis];
+    size_t dimension;
+    std::vector<bvh_wide_node> nodes;
+    std::vector<real> bounds;
+    std::vector<item_t> items;
+    std::unique_ptr<kd_frozen_primitives<Store>> frozen;
+    kd_origin_cache<Store> origins;
 
-            auto n_near = target.origin[bnode->axis] > bnode->split ? bnode->right.get() : bnode->left.get();
-            auto n_far = target.origin[bnode->axis] > bnode->split ? bnode->left.get() : bnode->right.get();
+    bvh_tree(const bvh_data<Store> &data,bool freeze=false) : dimension(data.dimension), origins(data.dimension) {
+        real widest = 0;
+        for(size_t i=0; i<dimension; ++i) widest = std::max(widest,data.end(0)[i] - data.start(0)[i]);
+        collapse(data,0,widest > 0 ? widest * real(1e-6) : real(1));
 
-            if(t < 0 || t > t_far) {
-                node = n_near;
-                continue;
-            }
-            if(t < t_near) {
-                node = n_far;
-                continue;
-            }
+        items.reserve(data.items.size());
+        for(auto &item : data.items) items.push_back(reinterpret_cast<item_t>(item.ref()));
 
-            if(n_near) {
-                size_t h_start = t_hits.size();
-                bool hit = operator()(n_near,t_near,t);
-                if((hit && o_hit.dist <= t) || !n_far) return hit;
+        if(freeze) frozen.reset(new kd_frozen_primitives<Store>(items,dimension));
+        origins.assign(items);
+    }
 
-                if(hit) {
-                    /* If dist is greater than t, the intersection was in a
-                       farther division (a primitive can span multiple
-                       divisions) and a closer primitive may exist, but if the
-                       intersection is with a primitive that is embedded in the
-                       split plane, dist can also be greater than t due to an
-                       error from limited precision, so we can't assume the
-                       primitive is also in t_far. */
+    void set_origin(const vector<Store> &o) {
+        origins.set_origin(o);
+    }
 
-                    if(operator()(n_far,t,t_far)) {
-                        /* if there is a closer intersection, some of the
-                        transparent hits from before, might be invalid */
-                        trim_intersections(t_hits,o_hit.dist,h_start);
+    auto leaf(const bvh_node &node) const {
+        assert(node.size);
+        const uint32_t *slots = origins.slots.empty() ? nullptr : origins.slots.data() + node.index;
+        if constexpr(v_real::size > 1) {
+            return kd_leaf_items<Store,item_t>{items.data() + node.index,node.size,node.batches,&origins,slots};
+        } else {
+            return kd_leaf_items<Store,item_t>{items.data() + node.index,node.size,&origins,slots};
+        }
+    }
+
+    /* Test a ray against the boxes of every child of node "n" at once and
+       return a bit for each child that the ray passes through between "t_near"
+       and "t_far". Where the ray enters each child is stored in "t_enter".
+       "axis(i)" gives the ray's direction and the reciprocal of its direction
+       along axis "i". Like aabb_distance, axes along which the direction is
+       zero are tested separately, since their reciprocals are not finite. */
+    template<typename F> FORCE_INLINE unsigned int clip_children(size_t n,const vector<Store> &origin,F &&axis,real t_near,real t_far,real *t_enter) const {
+        typedef bvh_v_real V;
+
+        const real *b = bounds.data() + n*dimension*BVH_WIDTH*2;
+        unsigned int r = 0;
+        for(size_t c=0; c<BVH_WIDTH; c+=V::size) {
+            V tn = V::repeat(t_near);
+            V tf = V::repeat(t_far);
+            auto inside = tn <= tf;
+            for(size_t i=0; i<dimension; ++i) {
+                V s = V::loadu(b + i*BVH_WIDTH*2 + c);
+                V e = V::loadu(b + i*BVH_WIDTH*2 + BVH_WIDTH + c);
+                V o = V::repeat(origin[i]);
+                auto [d,inv_d] = axis(i);
+                if(d) {
+                    V t1 = (s - o) * V::repeat(inv_d);
+                    V t2 = (e - o) * V::repeat(inv_d);
+                    tn = simd::max(tn,simd::min(t1,t2));
+                    tf = simd::min(tf,simd::max(t1,t2));
+                } else {
+                    inside = inside && s <= o && o <= e;
+                }
+            }
+            tn.storeu(t_enter + c);
+            r |= (inside && tn <= tf).to_bits() << c;
+        }
+        return r & ((1u << nodes[n].count) - 1);
+    }
+
+    FORCE_INLINE unsigned int clip_children(size_t n,const ray<Store> &target,const vector<Store> &invdir,real t_near,real t_far,real *t_enter) const {
+        return clip_children(n,target.origin,[&](size_t i) { return std::make_pair(target.direction[i],invdir[i]); },t_near,t_far,t_enter);
+    }
+
+private:
+    /* Add a wide node with the children of the binary node "n", or just "n"
+       if it's a leaf, and return its index. While there is room, the branch
+       child with the largest surface area is replaced by its children. */
+    uint32_t collapse(const bvh_nodes &data,size_t n,real min_extent) {
+        auto index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+        bounds.resize(nodes.size()*dimension*BVH_WIDTH*2);
+
+        size_t children[BVH_WIDTH];
+        size_t count = 0;
+        if(data.nodes[n].size) {
+            children[count++] = n;
+        } else {
+            children[count++] = n + 1;
+            children[count++] = data.nodes[n].index;
+            while(count < BVH_WIDTH) {
+                size_t best = count;
+                real best_area = -1;
+                for(size_t i=0; i<count; ++i) {
+                    if(data.nodes[children[i]].size) continue;
+                    real area = bvh_box_area(data.start(children[i]),dimension,min_extent);
+                    if(area > best_area) {
+                        best = i;
+                        best_area = area;
                     }
-                    return true;
                 }
+                if(best == count) break;
+
+                size_t c = children[best];
+                children[best] = c + 1;
+                children[count++] = data.nodes[c].index;
             }
+        }
 
-            assert(n_far);
-            node = n_far;
-            t_near = t;
-            continue;
+        nodes[index].count = static_cast<uint32_t>(count);
+        for(size_t i=0; i<count; ++i) {
+            real *b = bounds.data() + index*dimension*BVH_WIDTH*2;
+            for(size_t j=0; j<dimension; ++j) {
+                b[j*BVH_WIDTH*2 + i] = data.start(children[i])[j];
+                b[j*BVH_WIDTH*2 + BVH_WIDTH + i] = data.end(children[i])[j];
+            }
+
+            const bvh_node &child = data.nodes[children[i]];
+            bvh_node wide_child = child;
+            if(!child.size) wide_child.index = collapse(data,children[i],min_extent);
+
+            // "nodes" may have been reallocated by the recursive call
+            nodes[index].children[i] = wide_child;
         }
+        for(size_t i=count; i<BVH_WIDTH; ++i) nodes[index].children[i] = {0,0,0};
 
-        node = (target.origin[bnode->axis] >= bnode->split ? bnode->right : bnode->left).get();
+        return index;
     }
-    return false;
-}
+};
 
-template<typename Store> inline bool intersects(
-    const kd_node<Store> *node,
+template<typename Store> HOT_FUNC bool intersects(
+    const bvh_tree<Store> &tree,
     const ray<Store> &target,
+    const vector<Store> &invdir,
     intersection_target<Store> skip,
     ray_intersection<Store> &o_hit,
     ray_intersections<Store> &t_hits,
@@ -1252,62 +3098,236 @@ template<typename Store> inline bool intersects(
     real t_far,
     geom_allocator *a=nullptr)
 {
-    return kd_node_intersection<Store>{target,skip,o_hit,t_hits,a}(node,t_near,t_far);
+    struct entry {
+        bvh_node node;
+        real t_near;
+    };
+
+    no_prim_set checked;
+    size_t h_start = t_hits.size();
+    bool hit = false;
+
+    entry stack[bvh_tree<Store>::stack_size];
+    size_t depth = 0;
+    stack[depth++] = {{0,0,0},t_near};
+
+    while(depth) {
+        entry e = stack[--depth];
+        if(e.t_near > o_hit.dist) continue;
+
+        if(e.node.size) {
+            if(tree.leaf(e.node).intersects(target,skip,o_hit,t_hits,checked,a)) hit = true;
+            continue;
+        }
+
+        real t_enter[BVH_WIDTH];
+        unsigned int mask = tree.clip_children(e.node.index,target,invdir,t_near,std::min(t_far,o_hit.dist),t_enter);
+
+        /* the children are pushed farthest first, so that the nearest is
+           visited first */
+        size_t first = depth;
+        for(size_t i=0; mask; ++i, mask >>= 1) {
+            if(!(mask & 1)) continue;
+            entry c{tree.nodes[e.node.index].children[i],t_enter[i]};
+            size_t j = depth++;
+            for(; j > first && stack[j-1].t_near < c.t_near; --j) stack[j] = stack[j-1];
+            stack[j] = c;
+        }
+    }
+
+    /* a transparent primitive found in one leaf can be farther than an opaque
+       primitive found in a later leaf */
+    if(hit) trim_intersections(t_hits,o_hit.dist,h_start);
+    return hit;
 }
 
-template<typename Store> HOT_FUNC bool _occludes(const kd_node<Store> *node,const ray<Store> &target,const vector<Store> &invdir,real ldistance,intersection_target<Store> skip,ray_intersections<Store> &hits,real t_near,real t_far,geom_allocator *a) {
-    while(node) {
-        if(node->type == LEAF) return static_cast<const kd_leaf<Store>*>(node)->occludes(target,ldistance,skip,hits,a);
+template<typename Store> HOT_FUNC bool occludes(
+    const bvh_tree<Store> &tree,
+    const ray<Store> &target,
+    const vector<Store> &invdir,
+    real ldistance,
+    intersection_target<Store> skip,
+    shadow_filter<Store> &filter,
+    real t_near,
+    real t_far,
+    geom_allocator *a=nullptr)
+{
+    t_far = std::min(t_far,ldistance);
 
-        assert(node->type == BRANCH);
-        auto bnode = static_cast<const kd_branch<Store>*>(node);
-        if(target.direction[bnode->axis]) {
-            if(target.origin[bnode->axis] == bnode->split) {
-                node = (target.direction[bnode->axis] > 0 ? bnode->right : bnode->left).get();
-                continue;
-            }
+    no_prim_set checked;
+    bvh_node stack[bvh_tree<Store>::stack_size];
+    size_t depth = 0;
+    stack[depth++] = {0,0,0};
 
-            real t = (bnode->split - target.origin[bnode->axis]) * invdir[bnode->axis];
+    while(depth) {
+        bvh_node node = stack[--depth];
+        if(node.size) {
+            if(tree.leaf(node).occludes(target,ldistance,skip,filter,checked,a)) return true;
+            continue;
+        }
 
-            auto n_near = bnode->left.get();
-            auto n_far = bnode->right.get();
-            if(target.origin[bnode->axis] > bnode->split) {
-                n_near = bnode->right.get();
-                n_far = bnode->left.get();
-            }
+        real t_enter[BVH_WIDTH];
+        unsigned int mask = tree.clip_children(node.index,target,invdir,t_near,t_far,t_enter);
+        for(size_t i=0; mask; ++i, mask >>= 1) {
+            if(mask & 1) stack[depth++] = tree.nodes[node.index].children[i];
+        }
+    }
+    return false;
+}
 
-            if(t < 0 || t > t_far) {
-                node = n_near;
-                continue;
+/* Finds the nearest intersections of a packet of up to v_real::size rays that
+   all have the same origin. Each ray is tested against all the children of a
+   node at once, and a child is skipped when none of the rays that are still
+   active reach it before their nearest hit so far. */
+template<typename Store> struct bvh_packet_intersection {
+    typedef unsigned int lane_mask;
+
+    const bvh_tree<Store> &tree;
+    const ray<Store> *targets;
+    const vector<Store,v_real> invdir;
+    ray_intersection<Store> *o_hits;
+    ray_intersections<Store> *t_hits;
+    geom_allocator *a;
+
+    // which rays have hit an opaque primitive
+    lane_mask hits;
+
+    bvh_packet_intersection(
+            const bvh_tree<Store> &tree,
+            const ray<Store> *targets,
+            ray_intersection<Store> *o_hits,
+            ray_intersections<Store> *t_hits,
+            geom_allocator *a)
+        : tree{tree},
+          targets{targets},
+          invdir{deinterleave<Store,v_real::size>(targets[0].dimension(),[=](size_t i) { return vector<Store>{1/targets[i].direction}; })},
+          o_hits{o_hits}, t_hits{t_hits}, a{a}, hits{0} {}
+
+    void operator()(v_real t_near,v_real t_far,lane_mask active);
+};
+
+template<typename Store> HOT_FUNC void bvh_packet_intersection<Store>::operator()(v_real t_near,v_real t_far,lane_mask active) {
+    struct entry {
+        v_real t_near;
+        bvh_node node;
+        lane_mask active;
+
+        // the nearest entry point of any of the active rays
+        real key;
+    };
+
+    const vector<Store> &origin = targets[0].origin;
+    no_prim_set checked;
+    entry stack[bvh_tree<Store>::stack_size];
+    size_t depth = 0;
+    stack[depth++] = {t_near,{0,0,0},active,0};
+
+    while(depth) {
+        entry e = stack[--depth];
+        for(size_t i=0; i<v_real::size; ++i) {
+            if(e.t_near[i] > o_hits[i].dist) e.active &= ~(1u << i);
+        }
+        if(!e.active) continue;
+
+        if(e.node.size) {
+            auto &&leaf = tree.leaf(e.node);
+            for(size_t i=0; i<v_real::size; ++i) {
+                if((e.active & (1u << i)) && leaf.intersects(targets[i],{},o_hits[i],t_hits[i],checked,a)) {
+                    assert(o_hits[i].target.p);
+                    hits |= 1u << i;
+                }
             }
-            if(t < t_near) {
-                node = n_far;
-                continue;
+            continue;
+        }
+
+        entry children[BVH_WIDTH];
+        for(auto &c : children) {
+            c.active = 0;
+            c.key = std::numeric_limits<real>::max();
+        }
+
+        for(size_t i=0; i<v_real::size; ++i) {
+            if(!(e.active & (1u << i))) continue;
+
+            real t_enter[BVH_WIDTH];
+            unsigned int mask = tree.clip_children(
+                e.node.index,
+                origin,
+                [&](size_t j) { return std::make_pair(targets[i].direction[j],invdir[j][i]); },
+                e.t_near[i],
+                std::min(t_far[i],o_hits[i].dist),
+                t_enter);
+            for(size_t j=0; mask; ++j, mask >>= 1) {
+                if(!(mask & 1)) continue;
+                children[j].active |= 1u << i;
+                children[j].t_near[i] = t_enter[j];
+                children[j].key = std::min(children[j].key,t_enter[j]);
             }
+        }
 
-            if(n_near) {
-                if(!n_far) {
-                    t_far = t;
-                    node = n_near;
-                    continue;
-                }
-                if(_occludes(n_near,target,invdir,ldistance,skip,hits,t_near,t,a)) return true;
+        /* the children are pushed farthest first, so that the nearest is
+           visited first */
+        size_t first = depth;
+        for(size_t j=0; j<BVH_WIDTH; ++j) {
+            entry &c = children[j];
+            if(!c.active) continue;
+            c.node = tree.nodes[e.node.index].children[j];
+            for(size_t i=0; i<v_real::size; ++i) {
+                if(!(c.active & (1u << i))) c.t_near[i] = std::numeric_limits<real>::max();
             }
 
-            assert(n_far);
-            if(t < ldistance) return false;
-            t_near = t;
-            node = n_far;
-            continue;
+            size_t k = depth++;
+            for(; k > first && stack[k-1].key < c.key; --k) stack[k] = stack[k-1];
+            stack[k] = c;
         }
+    }
+}
 
-        node = (target.origin[bnode->axis] >= bnode->split ? bnode->right : bnode->left).get();
+/* Trace a packet of rays with the same origin through either kind of tree,
+   and return which rays hit an opaque primitive. "checked" is only used by k-d
+   trees. */
+template<typename Store> inline unsigned int intersects_packet(
+    const kd_flat_tree<Store> &tree,
+    const ray<Store> *targets,
+    ray_intersection<Store> *o_hits,
+    ray_intersections<Store> *t_hits,
+    prim_set *checked,
+    v_real t_near,
+    v_real t_far,
+    unsigned int active,
+    geom_allocator *a=nullptr)
+{
+#ifdef KD_ROPES
+    // the rays' paths through the cells diverge, so they are traced separately
+    unsigned int hits = 0;
+    for(size_t i=0; i<v_real::size; ++i) {
+        if((active & (1u << i)) && kd_rope_intersects(tree,targets[i],vector<Store>{1/targets[i].direction,a},{},o_hits[i],t_hits[i],t_near[i],t_far[i],a)) {
+            hits |= 1u << i;
+        }
     }
-    return false;
+    return hits;
+#else
+    kd_node_packet_intersection<Store,kd_flat_tree<Store>> packet{tree,targets,o_hits,t_hits,checked,a};
+    if(tree.has_path(targets[0].origin)) packet.along_path(tree.path,tree.path_size,tree.path_end,t_near,t_far,active);
+    else packet(tree.root(),t_near,t_far,active);
+    return packet.hits;
+#endif
 }
 
-template<typename Store> inline bool occludes(const kd_node<Store> *node,const ray<Store> &target,real ldistance,intersection_target<Store> skip,ray_intersections<Store> &hits,real t_near,real t_far,geom_allocator *a=nullptr) {
-    return _occludes<Store>(node,target,1/target.direction,ldistance,skip,hits,t_near,t_far,a);
+template<typename Store> inline unsigned int intersects_packet(
+    const bvh_tree<Store> &tree,
+    const ray<Store> *targets,
+    ray_intersection<Store> *o_hits,
+    ray_intersections<Store> *t_hits,
+    prim_set*,
+    v_real t_near,
+    v_real t_far,
+    unsigned int active,
+    geom_allocator *a=nullptr)
+{
+    bvh_packet_intersection<Store> packet{tree,targets,o_hits,t_hits,a};
+    packet(t_near,t_far,active);
+    return packet.hits;
 }
 
 template<typename Store> inline void kd_node_deleter<Store>::operator()(kd_node<Store> *ptr) const {
@@ -1323,6 +3343,7 @@ template<typename Store> inline void kd_node_deleter<Store>::operator()(kd_node<
 template<typename Store> struct solid_prototype;
 template<typename Store> struct triangle_prototype;
 template<typename Store> struct triangle_batch_prototype;
+template<typename Store> struct solid_batch_prototype;
 
 template<typename Store> struct aabb {
     explicit aabb(size_t dimension,geom_allocator *a=nullptr)
@@ -1348,6 +3369,7 @@ template<typename Store> struct aabb {
     bool intersects_flat(const triangle_batch_prototype<Store> &tp,size_t skip,geom_allocator *a=nullptr) const;
     bool box_axis_test(const solid<Store> *c,const vector<Store> &axis) const;
     bool intersects(const solid_prototype<Store> &sp,geom_allocator *a=nullptr) const;
+    bool intersects(const solid_batch_prototype<Store> &sp,geom_allocator *a=nullptr) const;
 
     void swap(aabb &b) {
         start.swap(b.start);
@@ -1421,16 +3443,22 @@ template<typename Store> struct triangle_batch_prototype : primitive_prototype<S
     }
 
     /* NOTE: multiple invocations of t_prototypes with the same argument must
-       return the same instance */
-    template<typename F> triangle_batch_prototype(size_t dimension,F t_prototypes) :
-        primitive_prototype<Store>(t_prototypes(0)->boundary,py::new_ref(triangle_batch<Store>::from_triangles([=](size_t i){ return t_prototypes(i)->pt(); }))),
+       return the same instance. Only "t_prototypes(0)" to
+       "t_prototypes(lanes-1)" are used. The remaining lanes are filled with
+       copies of the first triangle. */
+    template<typename F> triangle_batch_prototype(size_t dimension,F t_prototypes,size_t lanes=v_real::size) :
+        triangle_batch_prototype(dimension,[=](size_t i){ return t_prototypes(i < lanes ? i : 0); },lanes,nullptr) {}
+
+private:
+    template<typename F> triangle_batch_prototype(size_t dimension,F t_prototypes,size_t lanes,std::nullptr_t) :
+        primitive_prototype<Store>(t_prototypes(0)->boundary,py::new_ref(triangle_batch<Store>::from_triangles([=](size_t i){ return t_prototypes(i)->pt(); },lanes))),
         flexible_struct(dimension,[=](size_t i) {
             return triangle_point<Store,v_real>(
                 deinterleave<Store,v_real::size>(dimension,[=](size_t j){ return t_prototypes(j)->items()[i].point; }),
                 i > 0 ? pt()->items()[i-1] : first_edge_normal);
         }),
         first_edge_normal(deinterleave<Store,v_real::size>(dimension,[=](size_t i){ return t_prototypes(i)->first_edge_normal; })) {
-        for(size_t i=1; i<v_real::size; ++i) {
+        for(size_t i=1; i<lanes; ++i) {
             const aabb<Store> &ibound = t_prototypes(i)->boundary;
             v_expr(this->boundary.start) = min(v_expr(this->boundary.start),v_expr(ibound.start));
             v_expr(this->boundary.end) = max(v_expr(this->boundary.end),v_expr(ibound.end));
@@ -1438,6 +3466,33 @@ template<typename Store> struct triangle_batch_prototype : primitive_prototype<S
     }
 };
 
+template<typename Store> struct solid_batch_prototype : primitive_prototype<Store> {
+    /* Copies of the prototypes of the individual solids. The bounding box
+       intersection test is done on each solid separately. */
+    std::vector<solid_prototype<Store>> lane_prototypes;
+
+    solid_batch<Store> *pb() {
+        return reinterpret_cast<solid_batch<Store>*>(this->p.ref());
+    }
+    const solid_batch<Store> *pb() const {
+        return reinterpret_cast<const solid_batch<Store>*>(this->p.ref());
+    }
+
+    /* Only "s_prototypes(0)" to "s_prototypes(lanes-1)" are used. The solids
+       must all have the same type. This must be called with the GIL held. */
+    template<typename F> solid_batch_prototype(F s_prototypes,size_t lanes=v_real::size) :
+        primitive_prototype<Store>(s_prototypes(0)->boundary,py::new_ref(solid_batch<Store>::from_solids([=](size_t i){ return s_prototypes(i)->ps(); },lanes))) {
+        lane_prototypes.reserve(lanes);
+        for(size_t i=0; i<lanes; ++i) {
+            lane_prototypes.push_back(*s_prototypes(i));
+
+            const aabb<Store> &ibound = s_prototypes(i)->boundary;
+            v_expr(this->boundary.start) = min(v_expr(this->boundary.start),v_expr(ibound.start));
+            v_expr(this->boundary.end) = max(v_expr(this->boundary.end),v_expr(ibound.end));
+        }
+    }
+};
+
 
 real clamp(real x) {
     if(x > 1) return 1;
@@ -1627,7 +3682,7 @@ template<typename Store> bool aabb<Store>::intersects_flat(const triangle_batch_
 }
 
 template<typename Store> bool aabb<Store>::box_axis_test(const solid<Store> *c,const vector<Store> &axis) const {
-    real a_po = dot(c->position,axis);
+    real a_po = dot(c->world_position,axis);
     real b_po = dot(center(),axis);
 
     real a_max = 0;
@@ -1661,17 +3716,30 @@ template<typename Store> bool aabb<Store>::intersects(const solid_prototype<Stor
 
     assert(sp.ps()->type == SPHERE);
 
+    /* In the sphere's local space, where it is the unit sphere at the origin,
+       the box is centered at "-box_p" and spanned by "component". */
     vector<Store> box_p{sp.ps()->position - sp.ps()->inv_orientation * center(),a};
 
     vector<Store> closest{dimension(),real(0),a};
 
     for(size_t i=0; i<dimension(); ++i) {
-        // equivalent to: sp.p->orientation.transpose() * vector<Store>::axis(dimension(),i,(end[i] - start[i])/2)
-        vector<Store> component{sp.ps()->orientation[i] * ((end[i] - start[i])/2),a};
+        // equivalent to: sp.p->inv_orientation * vector<Store>::axis(dimension(),i,(end[i] - start[i])/2)
+        vector<Store> component{sp.ps()->inv_orientation.column(i) * ((end[i] - start[i])/2),a};
         closest += clamp(dot(box_p,component)/component.square()) * component;
     }
 
-    return (sp.ps()->position - closest).square() < 1;
+    return (box_p - closest).square() < 1;
+}
+
+template<typename Store> bool aabb<Store>::intersects(const solid_batch_prototype<Store> &sp,geom_allocator *a) const {
+    /* like the test for a single solid, only cubes are rejected using the
+       bounding box */
+    if(sp.pb()->type == CUBE && (v_expr(end) <= v_expr(sp.boundary.start) || v_expr(start) >= v_expr(sp.boundary.end)).any()) return false;
+
+    for(auto &p : sp.lane_prototypes) {
+        if(intersects(p,a)) return true;
+    }
+    return false;
 }
 
 
@@ -1697,6 +3765,175 @@ template<typename Store> struct global_light {
     }
 };
 
+/* A bounding volume hierarchy over the point lights of a scene. Each light is
+   treated as a sphere, outside of which even its brightest component, shining
+   straight at a surface, is dimmer than LIGHT_THRESHOLD. Shading a point then
+   only needs the lights whose spheres contain it.
+
+   The nodes are stored in depth-first order, so the left child of a branch
+   always immediately follows it. "bounds" holds the box of each node as
+   "dimension" starts followed by "dimension" ends. */
+template<typename Store> struct point_light_tree {
+    struct node {
+        /* for a branch, the index of the right child, otherwise the index in
+           "order" of the first light */
+        uint32_t index;
+
+        // the number of lights, or zero for a branch
+        uint32_t size;
+    };
+
+    size_t dimension = 0;
+    std::vector<node> nodes;
+    std::vector<real> bounds;
+
+    // the indices of the lights, grouped by leaf
+    std::vector<uint32_t> order;
+
+    /* the center of each light followed by its radius, in the same order as
+       the lights the tree was built from */
+    std::vector<real> spheres;
+
+    static real radius(const point_light<Store> &pl) {
+        real brightest = std::max(pl.c.r(),std::max(pl.c.g(),pl.c.b()));
+        if(brightest <= 0) return 0;
+
+        // pad the radius so rounding errors can't exclude a light that counts
+        return std::pow(brightest / LIGHT_THRESHOLD,real(1) / static_cast<real>(pl.dimension() - 1)) * (1 + ROUNDING_FUZZ);
+    }
+
+    const real *sphere(uint32_t light) const {
+        return spheres.data() + light * (dimension + 1);
+    }
+
+    // the number of lights the tree was built from
+    size_t size() const {
+        return order.size();
+    }
+
+    // return true if the tree was built from lights equal to "lights"
+    bool matches(const std::vector<point_light<Store>> &lights) const {
+        if(lights.size() * (dimension + 1) != spheres.size()) return false;
+
+        const real *s = spheres.data();
+        for(auto &pl : lights) {
+            if(pl.dimension() != dimension) return false;
+            for(size_t i=0; i<dimension; ++i) {
+                if(s[i] != pl.position[i]) return false;
+            }
+            if(s[dimension] != radius(pl)) return false;
+            s += dimension + 1;
+        }
+        return true;
+    }
+
+    void build(const std::vector<point_light<Store>> &lights) {
+        dimension = lights.empty() ? 0 : lights[0].dimension();
+        nodes.clear();
+        bounds.clear();
+        order.clear();
+        spheres.clear();
+        if(lights.empty()) return;
+
+        if(lights.size() > std::numeric_limits<uint32_t>::max()) throw std::length_error("too many lights");
+
+        spheres.reserve(lights.size() * (dimension + 1));
+        for(auto &pl : lights) {
+            for(size_t i=0; i<dimension; ++i) spheres.push_back(pl.position[i]);
+            spheres.push_back(radius(pl));
+        }
+
+        order.resize(lights.size());
+        for(size_t i=0; i<lights.size(); ++i) order[i] = static_cast<uint32_t>(i);
+
+        add(0,order.size());
+    }
+
+    /* Set the bit of every light whose sphere contains "p", in "out", which
+       must have a bit for every light. Bit "i % 64" of "out[i / 64]" is used
+       for light "i". */
+    void lights_at(const vector<Store> &p,uint64_t *out) const {
+        if(nodes.empty()) return;
+
+        // the tree is balanced, so its depth can't exceed the bits of "order"'s size
+        uint32_t stack[std::numeric_limits<uint32_t>::digits + 1];
+        size_t depth = 0;
+        stack[depth++] = 0;
+
+        while(depth) {
+            uint32_t n = stack[--depth];
+
+            const real *b = bounds.data() + n*dimension*2;
+            size_t i=0;
+            for(; i<dimension; ++i) {
+                if(p[i] < b[i] || p[i] > b[dimension + i]) break;
+            }
+            if(i < dimension) continue;
+
+            if(nodes[n].size) {
+                for(uint32_t j=0; j<nodes[n].size; ++j) {
+                    uint32_t light = order[nodes[n].index + j];
+                    const real *s = sphere(light);
+                    real dist_sq = 0;
+                    for(size_t k=0; k<dimension; ++k) {
+                        real x = p[k] - s[k];
+                        dist_sq += x*x;
+                    }
+                    if(dist_sq <= s[dimension] * s[dimension]) out[light / 64] |= uint64_t(1) << (light % 64);
+                }
+            } else {
+                stack[depth++] = nodes[n].index;
+                stack[depth++] = n + 1;
+            }
+        }
+    }
+
+private:
+    /* add a node for the lights "order[start]" to "order[end-1]" and return
+       its index */
+    uint32_t add(size_t start,size_t end) {
+        auto n = static_cast<uint32_t>(nodes.size());
+        nodes.push_back({static_cast<uint32_t>(start),static_cast<uint32_t>(end - start)});
+
+        size_t b = bounds.size();
+        bounds.resize(b + dimension*2);
+        for(size_t i=0; i<dimension; ++i) {
+            bounds[b + i] = std::numeric_limits<real>::max();
+            bounds[b + dimension + i] = std::numeric_limits<real>::lowest();
+        }
+
+        // the lights are split at the median of the axis their centers span the most
+        std::vector<real> c_start(dimension,std::numeric_limits<real>::max());
+        std::vector<real> c_end(dimension,std::numeric_limits<real>::lowest());
+        for(size_t j=start; j<end; ++j) {
+            const real *s = sphere(order[j]);
+            for(size_t i=0; i<dimension; ++i) {
+                bounds[b + i] = std::min(bounds[b + i],s[i] - s[dimension]);
+                bounds[b + dimension + i] = std::max(bounds[b + dimension + i],s[i] + s[dimension]);
+                c_start[i] = std::min(c_start[i],s[i]);
+                c_end[i] = std::max(c_end[i],s[i]);
+            }
+        }
+
+        if(end - start <= LIGHT_TREE_LEAF_SIZE) return n;
+
+        size_t axis = 0;
+        for(size_t i=1; i<dimension; ++i) {
+            if(c_end[i] - c_start[i] > c_end[axis] - c_start[axis]) axis = i;
+        }
+
+        size_t mid = (start + end) / 2;
+        std::nth_element(order.begin() + start,order.begin() + mid,order.begin() + end,[=](uint32_t a,uint32_t b) {
+            return sphere(a)[axis] < sphere(b)[axis];
+        });
+
+        add(start,mid);
+        uint32_t right = add(mid,end);
+        nodes[n] = {right,0};
+        return n;
+    }
+};
+
 
 template<typename Store> void append_specular(color &c,float &a,const material *m,const color &light_c,const vector<Store> &target,const vector<Store> &normal,const vector<Store> &light_dir) {
     // Blinn-Phong model
@@ -1720,11 +3957,50 @@ template<typename Store> struct composite_scene final : scene {
     color ambient, bg1, bg2, bg3;
     camera<Store> cam;
     aabb<Store> boundary;
+
+    /* "boundary", enlarged by a tiny margin, so that rounding errors in where
+       a ray leaves the scene can't cut off primitives that lie on the
+       boundary's faces */
+    aabb<Store> padded_boundary;
+
+    // only one of these is used, depending on which structure the scene uses
     kd_node_unique_ptr<Store> root;
+    std::shared_ptr<const bvh_data<Store>> bvh_root;
+
+    /* A copy of "root" or "bvh_root" in the form used for tracing. It is never
+       modified, other than by "set_origin". If the scene is frozen, it has its
+       own copies of the primitives and "root" or "bvh_root" is discarded. */
+    std::variant<kd_flat_tree<Store>,bvh_tree<Store>> accel;
+
     std::vector<point_light<Store>> point_lights;
     std::vector<global_light<Store>> global_lights;
 
-    template<typename T> composite_scene(const aabb<Store> &boundary,T &&data)
+    /* Built from "point_lights" by "set_view_size", when they differ from
+       what it was last built from. The lights can't change while the scene is
+       locked, so renderers must lock the scene before calling
+       "set_view_size". */
+    point_light_tree<Store> light_tree;
+
+    template<typename T> composite_scene(const aabb<Store> &boundary,T &&data,bool frozen=false)
+        : locked(0),
+          shadows(false),
+          camera_light(true),
+          fov(real(0.8)),
+          max_reflect_depth(4),
+          bg_gradient_axis(default_bg_gradient_axis),
+          ambient(0,0,0),
+          bg1(1,1,1),
+          bg2(0,0,0),
+          bg3(0,1,1),
+          cam(boundary.dimension()),
+          boundary(boundary),
+          padded_boundary(pad_boundary(boundary)),
+          root{std::forward<T>(data)},
+          accel{std::in_place_type<kd_flat_tree<Store>>,root.get(),boundary,frozen} {
+        if(frozen) root.reset();
+    }
+
+    composite_scene(const aabb<Store> &boundary,std::shared_ptr<const bvh_data<Store>> data,bool frozen=false)
         : locked(0),
           shadows(false),
           camera_light(true),
@@ -1737,35 +4013,79 @@ template<typename Store> struct composite_scene final : scene {
           bg3(0,1,1),
           cam(boundary.dimension()),
           boundary(boundary),
-          root{std::forward<T>(data)} {}
+          padded_boundary(pad_boundary(boundary)),
+          bvh_root{std::move(data)},
+          accel{std::in_place_type<bvh_tree<Store>>,*bvh_root,frozen} {
+        if(frozen) bvh_root.reset();
+    }
+
+    static aabb<Store> pad_boundary(const aabb<Store> &boundary) {
+        real widest = 0;
+        for(size_t i=0; i<boundary.dimension(); ++i) widest = std::max(widest,boundary.end[i] - boundary.start[i]);
+
+        aabb<Store> r{boundary};
+        for(size_t i=0; i<boundary.dimension(); ++i) {
+            real margin = (std::abs(boundary.start[i]) + std::abs(boundary.end[i]) + widest) * SCENE_BOUNDARY_MARGIN;
+            r.start[i] -= margin;
+            r.end[i] += margin;
+        }
+        return r;
+    }
+
+    /* What each rendering thread keeps from one pixel to the next. Renderers
+       only see this as a geom_allocator. */
+    struct thread_state final : geom_allocator {
+        std::unique_ptr<geom_allocator> alloc;
+
+        /* For each light (the point lights, followed by the global lights),
+           the opaque primitive that last blocked it. Neighboring pixels are
+           usually in the same shadow, so this is tested before anything
+           else. */
+        std::vector<intersection_target<Store>> occluders;
+
+        /* One bit for each point light, used by "base_color" to collect the
+           lights that reach a point. The bits are cleared again as the lights
+           are visited. */
+        std::vector<uint64_t> nearby_lights;
+
+        thread_state(geom_allocator *alloc,size_t point_lights,size_t global_lights)
+            : alloc{alloc}, occluders(point_lights + global_lights), nearby_lights((point_lights + 63) / 64) {}
+    };
 
     geom_allocator *new_allocator() const {
-        return Store::new_allocator(dimension(),10);
+        return new thread_state{
+            Store::new_allocator(dimension(),10),
+            point_lights.size(),
+            global_lights.size()};
     }
 
     void set_view_size(int w,int h) {
         origin_source.set_params(w,h,fov);
+        std::visit([&](auto &tree) { tree.set_origin(cam.origin); },accel);
+        if(!light_tree.matches(point_lights)) light_tree.build(point_lights);
     }
 
-    HOT_FUNC bool light_reaches(const ray<Store> &target,real ldistance,intersection_target<Store> skip,color &filtered,geom_allocator *a=nullptr) const {
-        ray_intersections<Store> transparent_hits;
-
-        if(occludes(root.get(),target,ldistance,skip,transparent_hits,0,std::numeric_limits<real>::max(),a)) return false;
-
-        if(transparent_hits) {
-            transparent_hits.sort_and_unique();
+    /* Filter the light "filtered", coming from "ldistance" away along
+       "target", through whatever lies in between, and return false if it's
+       blocked. Light that is filtered down to "cutoff" or below counts as
+       blocked. "occluder" is the light's entry in thread_state::occluders. */
+    HOT_FUNC bool light_reaches(const ray<Store> &target,real ldistance,intersection_target<Store> skip,color &filtered,float cutoff,intersection_target<Store> &occluder,geom_allocator *a=nullptr) const {
+        const vector<Store> invdir{1/target.direction,a};
+        real t_near, t_far;
+        if(!aabb_distance(target,invdir,t_near,t_far)) return true;
 
-            auto data = transparent_hits.data();
-            for(auto itr = data + (transparent_hits.size()-1); itr >= data; --itr) {
-                assert(itr->target.mat()->opacity != 1);
-                filtered *= 1 - itr->target.mat()->opacity;
-            }
-        }
+        if(occluder.p && !(occluder == skip) && occluder.hit_before(target,ldistance,a)) return false;
 
-        return true;
+        shadow_filter<Store> filter{filtered,cutoff};
+        bool blocked = std::visit([&](auto &tree) {
+            return occludes(tree,target,invdir,ldistance,skip,filter,t_near,t_far,a);
+        },accel);
+        if(filter.blocker.p) occluder = filter.blocker;
+        return !blocked;
     }
 
-    HOT_FUNC color base_color(const ray<Store> &target,const ray<Store> &normal,intersection_target<Store> source,int depth,geom_allocator *a=nullptr) const {
+    HOT_FUNC color base_color(const ray<Store> &target,const ray<Store> &normal,intersection_target<Store> source,int depth,thread_state &state) const {
+        geom_allocator *a = state.alloc.get();
         auto m = source.mat();
 
         auto light = color(0,0,0);
@@ -1773,36 +4093,60 @@ template<typename Store> struct composite_scene final : scene {
         auto specular = color(0,0,0);
         float spec_a = 0;
 
-        for(auto &pl : point_lights) {
-            vector<Store> lv{normal.origin - pl.position,a};
-            real dist = lv.absolute();
-            lv /= dist;
-
-            real sine = dot(normal.direction,lv);
-            if(sine > 0) {
-                real strength = pl.strength(dist);
-                if(shadows) {
+        /* The lights are visited in the order they appear in "point_lights",
+           so the result doesn't depend on the shape of "light_tree". If the
+           tree wasn't built from the current lights, every light is visited
+           instead. */
+        size_t light_words = (point_lights.size() + 63) / 64;
+        assert(light_words <= state.nearby_lights.size());
+        if(LIKELY(light_tree.size() == point_lights.size())) {
+            light_tree.lights_at(normal.origin,state.nearby_lights.data());
+        } else {
+            for(size_t w=0; w<light_words; ++w) state.nearby_lights[w] = ~uint64_t(0);
+            if(point_lights.size() % 64) state.nearby_lights[light_words-1] = (uint64_t(1) << (point_lights.size() % 64)) - 1;
+        }
+        for(size_t w=0; w<light_words; ++w) {
+            uint64_t bits = state.nearby_lights[w];
+            state.nearby_lights[w] = 0;
+            for(; bits; bits &= bits - 1) {
+                size_t li = w*64 + count_trailing_zeros(bits);
+                auto &pl = point_lights[li];
+
+                // the direction from the surface to the light
+                vector<Store> lv{pl.position - normal.origin,a};
+                real dist = lv.absolute();
+                lv /= dist;
+
+                real sine = dot(normal.direction,lv);
+                if(sine > 0) {
+                    real strength = pl.strength(dist);
                     if(std::max(pl.c.r(),std::max(pl.c.g(),pl.c.b())) * strength * sine > LIGHT_THRESHOLD) {
-                        color filtered = pl.c;
-                        if(light_reaches(
-                            ray<Store>(
-                                vector<Store>{normal.origin,shallow_copy},
-                                vector<Store>{lv,shallow_copy}),
-                            dist,
-                            source,
-                            filtered,
-                            a))
-                        {
-                            filtered *= strength;
-                            light += filtered * sine;
-                            if(m->specular_intensity) append_specular(specular,spec_a,m,filtered,target.direction,normal.direction,lv);
+                        if(shadows) {
+                            color filtered = pl.c;
+                            if(light_reaches(
+                                ray<Store>(
+                                    vector<Store>{normal.origin,shallow_copy},
+                                    vector<Store>{lv,shallow_copy}),
+                                dist,
+                                source,
+                                filtered,
+                                LIGHT_THRESHOLD / (strength * sine),
+                                state.occluders[li],
+                                a))
+                            {
+                                filtered *= strength;
+                                light += filtered * sine;
+                                if(m->specular_intensity) append_specular(specular,spec_a,m,filtered,target.direction,normal.direction,lv);
+                            }
+                        } else {
+                            light += pl.c * strength * sine;
                         }
                     }
-                } else {
-                    light += pl.c * strength * sine;
                 }
             }
         }
+
+        auto occluder = state.occluders.begin() + point_lights.size();
         for(auto &gl : global_lights) {
             real sine = -dot(normal.direction,gl.direction);
             if(sine > 0) {
@@ -1815,7 +4159,10 @@ template<typename Store> struct composite_scene final : scene {
                             a),
                         std::numeric_limits<real>::max(),
                         source,
-                        filtered))
+                        filtered,
+                        LIGHT_THRESHOLD / sine,
+                        *occluder,
+                        a))
                     {
                         light += filtered * sine;
                         if(m->specular_intensity) append_specular<Store>(specular,spec_a,m,filtered,target.direction,normal.direction,-gl.direction);
@@ -1824,6 +4171,7 @@ template<typename Store> struct composite_scene final : scene {
                     light += gl.c * sine;
                 }
             }
+            ++occluder;
         }
 
         real sine = -dot(target.direction,normal.direction);
@@ -1847,21 +4195,37 @@ template<typename Store> struct composite_scene final : scene {
                     a},
                 depth+1,
                 source,
-                a) * m->reflectivity + r * (1 - m->reflectivity);
+                state) * m->reflectivity + r * (1 - m->reflectivity);
         }
 
         return specular + r * (1 - spec_a);
     }
 
-    HOT_FUNC color ray_color(const ray<Store> &target,int depth,intersection_target<Store> source,geom_allocator *a) const {
+    HOT_FUNC color ray_color(const ray<Store> &target,int depth,intersection_target<Store> source,thread_state &state) const {
+        geom_allocator *a = state.alloc.get();
         ray_intersection<Store> hit{target.dimension(),a};
         ray_intersections<Store> transparent_hits;
-        color r;
 
-        real dist = aabb_distance(target);
+        const vector<Store> invdir{1/target.direction,a};
+        real t_near, t_far;
         hit.dist = std::numeric_limits<real>::max();
-        if(dist >= 0 && intersects(root.get(),target,source,hit,transparent_hits,dist,std::numeric_limits<real>::max(),a)) {
-            r = base_color(target,hit.normal,hit.target,depth,a);
+        bool did_hit = aabb_distance(target,invdir,t_near,t_far) && std::visit([&](auto &tree) {
+            return intersects(tree,target,invdir,source,hit,transparent_hits,t_near,t_far,a);
+        },accel);
+
+        return hit_color(target,did_hit,hit,transparent_hits,depth,state);
+    }
+
+    HOT_FUNC color hit_color(const ray<Store> &target,bool did_hit,const ray_intersection<Store> &hit,ray_intersections<Store> &transparent_hits,int depth,thread_state &state) const {
+        color r;
+
+        if(did_hit) {
+            /* a transparent primitive that spans more than one node can be
+               found in a nearer node while being farther than the opaque
+               primitive that was hit */
+            trim_intersections(transparent_hits,hit.dist);
+
+            r = base_color(target,hit.normal,hit.target,depth,state);
         } else {
             real intensity = target.direction[bg_gradient_axis];
             r = intensity >= 0 ? bg1 * intensity + bg2 * (1 - intensity) : bg3 * -intensity + bg2 * (1 + intensity);
@@ -1873,7 +4237,7 @@ template<typename Store> struct composite_scene final : scene {
             auto data = transparent_hits.data();
             for(auto itr = data + (transparent_hits.size()-1); itr >= data; --itr) {
                 assert(itr->target.mat()->opacity != 1);
-                auto base = base_color(target,itr->normal,itr->target,depth,a);
+                auto base = base_color(target,itr->normal,itr->target,depth,state);
 
                 r = base * itr->target.mat()->opacity + r * (1 - itr->target.mat()->opacity);
             }
@@ -1883,38 +4247,112 @@ template<typename Store> struct composite_scene final : scene {
     }
 
     HOT_FUNC color calculate_color(int x,int y,geom_allocator *a) const {
+        assert(a);
+        auto &state = *static_cast<thread_state*>(a);
         return ray_color({
                 vector<Store>{cam.origin,shallow_copy},
-                origin_source(cam,static_cast<real>(x),static_cast<real>(y),a)},
-            0,{},a);
+                origin_source(cam,static_cast<real>(x),static_cast<real>(y),state.alloc.get())},
+            0,{},state);
+    }
+
+    HOT_FUNC void calculate_colors(int x,int y,int count,int stride,color *out,geom_allocator *a) const {
+        if constexpr(v_real::size > 1) {
+            for(; count > 0; count -= static_cast<int>(v_real::size)) {
+                int n = std::min(count,static_cast<int>(v_real::size));
+                if(n > 1) calculate_color_packet(x,y,n,stride,out,*static_cast<thread_state*>(a));
+                else *out = calculate_color(x,y,a);
+
+                x += n*stride;
+                out += n;
+            }
+        } else {
+            scene::calculate_colors(x,y,count,stride,out,a);
+        }
     }
 
-    HOT_FUNC real aabb_distance(const ray<Store> &target) const {
+    HOT_FUNC void calculate_color_packet(int x,int y,int count,int stride,color *out,thread_state &state) const {
         INSTRUMENTATION_TIMER;
+        assert(count > 0 && count <= static_cast<int>(v_real::size));
 
-        for(size_t i=0; i<dimension(); ++i) {
-            if(target.direction[i]) {
-                real o = target.direction[i] > 0 ? boundary.start[i] : boundary.end[i];
-                real dist = (o - target.origin[i]) / target.direction[i];
-                long skip = static_cast<long>(i);
-                if(dist < 0) {
-                    dist = 0;
-                    skip = -1;
-                }
+        geom_allocator *a = state.alloc.get();
 
-                for(size_t j=0; j<dimension(); ++j) {
-                    if(static_cast<long>(j) != skip) {
-                        o = target.direction[j] * dist + target.origin[j];
-                        if(o >= boundary.end[j] || o <= boundary.start[j]) goto miss;
-                    }
-                }
-                return dist;
+        /* unused lanes are never active, but get a copy of the last ray so
+           that every lane has a valid direction */
+        fixed::init_array<ray<Store>,v_real::size> targets(v_real::size,[&](size_t i) {
+            return ray<Store>{
+                vector<Store>{cam.origin,shallow_copy},
+                origin_source(cam,static_cast<real>(x + std::min(static_cast<int>(i),count-1)*stride),static_cast<real>(y),a)};
+        });
+        fixed::init_array<ray_intersection<Store>,v_real::size> hits(v_real::size,[&](size_t) {
+            return ray_intersection<Store>{dimension(),a};
+        });
+        ray_intersections<Store> transparent_hits[v_real::size];
+        prim_set checked[v_real::size];
+
+        unsigned int active = 0;
+        v_real t_near = v_real::zeros();
+        v_real t_far = v_real::zeros();
+        vector<Store> invdir{dimension(),a};
+        for(int i=0; i<count; ++i) {
+            hits[i].dist = std::numeric_limits<real>::max();
+            invdir = 1/targets[i].direction;
+            if(aabb_distance(targets[i],invdir,t_near[i],t_far[i])) active |= 1u << i;
+        }
 
-                miss: ;
-            }
+        unsigned int did_hit = std::visit([&](auto &tree) {
+            return intersects_packet(tree,&targets[0],&hits[0],transparent_hits,checked,t_near,t_far,active,a);
+        },accel);
+
+        for(int i=0; i<count; ++i) {
+            out[i] = hit_color(targets[i],(did_hit >> i) & 1,hits[i],transparent_hits[i],0,state);
         }
+    }
+
+    /* Find where "target" enters and leaves the scene's boundary, as
+       "t_near" and "t_far", and return whether it passes through it at all.
+       "t_near" is clamped to zero, for rays that start inside. "invdir" is the
+       reciprocal of the ray's direction. The axes are tested v_real::size at a
+       time. Axes along which the direction is zero are tested separately,
+       since their reciprocals are not finite. */
+    HOT_FUNC bool aabb_distance(const ray<Store> &target,const vector<Store> &invdir,real &t_near,real &t_far) const {
+        INSTRUMENTATION_TIMER;
 
-        return -1;
+        const real *start = padded_boundary.start.data();
+        const real *end = padded_boundary.end.data();
+        const real *origin = target.origin.data();
+        const real *direction = target.direction.data();
+
+        v_real tn = v_real::zeros();
+        v_real tf = v_real::repeat(std::numeric_limits<real>::max());
+        auto inside = tn <= tf;
+        size_t i=0;
+        for(; i+v_real::size <= dimension(); i+=v_real::size) {
+            v_real s = v_real::loadu(start + i);
+            v_real e = v_real::loadu(end + i);
+            v_real o = v_real::loadu(origin + i);
+            auto parallel = v_real::loadu(direction + i) == v_real::zeros();
+            v_real inv_d = simd::mask_blend(parallel,v_real::zeros(),v_real::loadu(invdir.data() + i));
+            v_real t1 = (s - o) * inv_d;
+            v_real t2 = (e - o) * inv_d;
+            tn = simd::mask_blend(parallel,tn,simd::max(tn,simd::min(t1,t2)));
+            tf = simd::mask_blend(parallel,tf,simd::min(tf,simd::max(t1,t2)));
+            inside = inside && !(parallel && (o < s || e < o));
+        }
+        if(!inside.all()) return false;
+
+        t_near = simd::reduce_max(tn);
+        t_far = simd::reduce_min(tf);
+        for(; i<dimension(); ++i) {
+            if(direction[i]) {
+                real t1 = (start[i] - origin[i]) * invdir[i];
+                real t2 = (end[i] - origin[i]) * invdir[i];
+                t_near = std::max(t_near,std::min(t1,t2));
+                t_far = std::min(t_far,std::max(t1,t2));
+            } else if(origin[i] < start[i] || end[i] < origin[i]) {
+                return false;
+            }
+        }
+        return t_near <= t_far;
     }
 
     size_t dimension() const { return cam.dimension(); }
@@ -1948,53 +4386,88 @@ real default_cost_intersection(size_t d) {
 }
 
 struct kd_tree_params {
+    enum split_method_t {EXACT,BINNED};
+
     int max_depth;
     int split_threshold;
     real traversal;
     real intersection;
+    split_method_t split_method;
+    int bins;
+
+    /* the number of axes to consider splitting each node along, starting with
+       the widest, or 0 to consider all of them */
+    int split_axes;
 
     kd_tree_params(size_t dimension) :
         max_depth(KD_DEFAULT_MAX_DEPTH),
         split_threshold(KD_DEFAULT_SPLIT_THRESHOLD),
         traversal(default_cost_traversal(dimension)),
-        intersection(default_cost_intersection(dimension)) {}
+        intersection(default_cost_intersection(dimension)),
+        split_method(EXACT),
+        bins(KD_DEFAULT_BINS),
+        split_axes(1) {}
 };
 
 template<typename Store> using proto_array = std::vector<primitive_prototype<Store>*>;
 
-template<typename Store> bool find_split(const aabb<Store> &boundary,size_t axis,const proto_array<Store> &contain_p,const proto_array<Store> &overlap_p,real &pos,const kd_tree_params &params) {
-    real best_cost = std::numeric_limits<real>::max();
+/* The surface area heuristic cost of splitting "boundary" along "axis" */
+template<typename Store> class split_cost {
+    const aabb<Store> &boundary;
+    const size_t axis;
+    const kd_tree_params &params;
+    real side_area;
+    real shaft_area_factor;
+    real area;
 
-    vector<Store> cube_range{boundary.end - boundary.start};
-    real side_area = 1;
-    for(size_t i=0; i<boundary.dimension(); ++i) {
-        if(i != axis) side_area *= cube_range[i];
-    }
+public:
+    split_cost(const aabb<Store> &boundary,size_t axis,const kd_tree_params &params) : boundary(boundary), axis(axis), params(params) {
+        vector<Store> cube_range{boundary.end - boundary.start};
+        side_area = 1;
+        for(size_t i=0; i<boundary.dimension(); ++i) {
+            if(i != axis) side_area *= cube_range[i];
+        }
 
-    real shaft_area_factor = 0;
-    for(size_t i=0; i<boundary.dimension(); ++i) {
-        if(i != axis) {
-            real tmp = 1;
-            for(size_t j=0; j<boundary.dimension(); ++j) {
-                if(j != i && j != axis) tmp *= cube_range[j];
+        shaft_area_factor = 0;
+        for(size_t i=0; i<boundary.dimension(); ++i) {
+            if(i != axis) {
+                real tmp = 1;
+                for(size_t j=0; j<boundary.dimension(); ++j) {
+                    if(j != i && j != axis) tmp *= cube_range[j];
+                }
+                shaft_area_factor += tmp;
             }
-            shaft_area_factor += tmp;
         }
-    }
 
-    /* we actually only compute a value that is one half the surface area of
-       each box, but since we only need the ratios between areas, it doesn't
-       make any difference */
-    real area = side_area + shaft_area_factor * cube_range[axis];
+        /* we actually only compute a value that is one half the surface area of
+           each box, but since we only need the ratios between areas, it doesn't
+           make any difference */
+        area = side_area + shaft_area_factor * cube_range[axis];
+    }
 
-    auto split_cost = [=,&boundary](size_t l_count,size_t r_count,real split) -> real {
+    real operator()(size_t l_count,size_t r_count,real split) const {
         real shaft_area = shaft_area_factor * (split - boundary.start[axis]);
         real l_area = side_area + shaft_area;
         real r_area = area - shaft_area;
 
         return (params.traversal + params.intersection
             * (l_area/area * static_cast<real>(l_count) + r_area/area * static_cast<real>(r_count)));
-    };
+    }
+
+    /* whether a split with cost "cost" is better than not splitting a node with
+       "count" primitives */
+    bool worthwhile(real cost,size_t count) const {
+        real compare = static_cast<real>(count);
+        for(size_t i=0; i<boundary.dimension(); ++i) compare *= boundary.end[i] - boundary.start[i];
+        return cost < compare;
+    }
+};
+
+/* These return the cost of the best split found, and store its position in
+   "pos" */
+template<typename Store> real find_split_exact(const aabb<Store> &boundary,size_t axis,const proto_array<Store> &contain_p,const proto_array<Store> &overlap_p,real &pos,const kd_tree_params &params) {
+    real best_cost = std::numeric_limits<real>::max();
+    split_cost<Store> cost_of{boundary,axis,params};
 
     proto_array<Store> search_l;
     search_l.reserve(contain_p.size()+overlap_p.size());
@@ -2016,7 +4489,7 @@ template<typename Store> bool find_split(const aabb<Store> &boundary,size_t axis
            incorrect values for the l_count and r_count parameters. */
         if(split != last_split) {
             if(boundary.end[axis] > last_split && last_split > boundary.start[axis]) {
-                real cost = split_cost(last_il,search_l.size()-ir,last_split);
+                real cost = cost_of(last_il,search_l.size()-ir,last_split);
                 if(cost < best_cost) {
                     best_cost = cost;
                     pos = last_split;
@@ -2037,7 +4510,7 @@ template<typename Store> bool find_split(const aabb<Store> &boundary,size_t axis
         real split = search_r[ir]->boundary.end[axis];
         if(split != last_split) {
             if(boundary.end[axis] > last_split && last_split > boundary.start[axis]) {
-                real cost = split_cost(search_l.size(),search_l.size()-ir,last_split);
+                real cost = cost_of(search_l.size(),search_l.size()-ir,last_split);
                 if(cost < best_cost) {
                     best_cost = cost;
                     pos = last_split;
@@ -2048,9 +4521,58 @@ template<typename Store> bool find_split(const aabb<Store> &boundary,size_t axis
         ++ir;
     }
 
-    real compare = static_cast<real>(search_l.size());
-    for(size_t i=0; i<boundary.dimension(); ++i) compare *= boundary.end[i] - boundary.start[i];
-    return best_cost < compare;
+    return best_cost;
+}
+
+/* Instead of sorting the primitives, count how many start and end in each of
+   "params.bins" equal slices of the node, and only consider splitting at the
+   boundaries between slices. This takes linear time, but the chosen split is
+   only as good as the bins are fine. */
+template<typename Store> real find_split_binned(const aabb<Store> &boundary,size_t axis,const proto_array<Store> &contain_p,const proto_array<Store> &overlap_p,real &pos,const kd_tree_params &params) {
+    size_t bins = size_t(params.bins);
+    real b_start = boundary.start[axis];
+    real width = (boundary.end[axis] - b_start) / static_cast<real>(bins);
+    if(!(width > 0)) return std::numeric_limits<real>::max();
+
+    std::vector<size_t> start_counts(bins,0);
+    std::vector<size_t> end_counts(bins,0);
+
+    auto bin_of = [=](real x) -> size_t {
+        real b = (x - b_start) / width;
+        if(!(b > 0)) return 0;
+        return std::min(static_cast<size_t>(b),bins-1);
+    };
+    auto add = [&](const proto_array<Store> &ps) {
+        for(auto p : ps) {
+            ++start_counts[bin_of(p->boundary.start[axis])];
+            ++end_counts[bin_of(p->boundary.end[axis])];
+        }
+    };
+    add(contain_p);
+    add(overlap_p);
+
+    size_t total = contain_p.size() + overlap_p.size();
+    split_cost<Store> cost_of{boundary,axis,params};
+    real best_cost = std::numeric_limits<real>::max();
+
+    /* a primitive starting in a bin before the split is at least partly on the
+       left, and one ending in a bin after the split is at least partly on the
+       right */
+    size_t l_count = 0;
+    size_t r_count = total;
+    for(size_t i=1; i<bins; ++i) {
+        l_count += start_counts[i-1];
+        r_count -= end_counts[i-1];
+
+        real split = b_start + width * static_cast<real>(i);
+        real cost = cost_of(l_count,r_count,split);
+        if(cost < best_cost) {
+            best_cost = cost;
+            pos = split;
+        }
+    }
+
+    return best_cost;
 }
 
 template<typename Store> size_t best_axis(const aabb<Store> &boundary) {
@@ -2067,10 +4589,77 @@ template<typename Store> size_t best_axis(const aabb<Store> &boundary) {
     return axis;
 }
 
+template<typename Store> real find_split_on(const aabb<Store> &boundary,size_t axis,const proto_array<Store> &contain_p,const proto_array<Store> &overlap_p,real &pos,const kd_tree_params &params) {
+    if(params.split_method == kd_tree_params::BINNED
+            && contain_p.size() + overlap_p.size() > size_t(params.bins) * KD_BINNED_EXACT_RATIO)
+        return find_split_binned(boundary,axis,contain_p,overlap_p,pos,params);
+
+    return find_split_exact(boundary,axis,contain_p,overlap_p,pos,params);
+}
+
+template<typename Store> class kd_node_worker_pool;
+
+/* Find the best split among the "params.split_axes" widest axes of "boundary"
+   (every axis if "params.split_axes" is 0). If the node is large enough, the
+   axes are shared between this thread and as many extra threads as "wpool"
+   has not started yet. Returns false if no split is better than not
+   splitting. */
+template<typename Store> bool find_split(const aabb<Store> &boundary,const proto_array<Store> &contain_p,const proto_array<Store> &overlap_p,size_t &axis,real &pos,const kd_tree_params &params,kd_node_worker_pool<Store> &wpool) {
+    size_t d = boundary.dimension();
+    size_t count = params.split_axes ? std::min(size_t(params.split_axes),d) : d;
+    size_t total = contain_p.size() + overlap_p.size();
+    real cost;
+
+    if(count == 1) {
+        axis = best_axis(boundary);
+        cost = find_split_on(boundary,axis,contain_p,overlap_p,pos,params);
+    } else {
+        vector<Store> widths = boundary.end - boundary.start;
+        std::vector<size_t> axes(d);
+        for(size_t i=0; i<d; ++i) axes[i] = i;
+        std::partial_sort(axes.begin(),axes.begin()+count,axes.end(),[&](size_t a,size_t b){ return widths[a] > widths[b]; });
+
+        std::vector<real> positions(count);
+        std::vector<real> costs(count);
+
+        /* thread "t" of "threads" evaluates every "threads"th axis, starting
+           with axis "t" */
+        auto evaluate = [&](size_t t,size_t threads) {
+            for(size_t i=t; i<count; i+=threads) costs[i] = find_split_on(boundary,axes[i],contain_p,overlap_p,positions[i],params);
+        };
+
+        size_t extra = total >= KD_PARALLEL_SPLIT_THRESHOLD ? wpool.reserve_threads(static_cast<unsigned int>(count-1)) : 0;
+        if(extra) {
+            struct reservation {
+                kd_node_worker_pool<Store> &wpool;
+                unsigned int count;
+                ~reservation() { wpool.release_threads(count); }
+            } _{wpool,static_cast<unsigned int>(extra)};
+
+            std::vector<std::future<void>> results;
+            results.reserve(extra);
+            for(size_t t=1; t<=extra; ++t) results.push_back(std::async(std::launch::async,evaluate,t,extra+1));
+            evaluate(0,extra+1);
+            for(auto &r : results) r.get();
+        } else {
+            evaluate(0,1);
+        }
+
+        size_t best = std::min_element(costs.begin(),costs.end()) - costs.begin();
+        axis = axes[best];
+        pos = positions[best];
+        cost = costs[best];
+    }
+
+    return cost < std::numeric_limits<real>::max() && split_cost<Store>{boundary,axis,params}.worthwhile(cost,total);
+}
+
+
 template<typename Store> bool overlap_intersects(const aabb<Store> &bound,const primitive_prototype<Store> *pp,long skip,size_t axis,bool right) {
     if(skip < 0) {
         if(pp->p.type() == triangle_obj_common::pytype()) return bound.intersects(*static_cast<const triangle_prototype<Store>*>(pp));
         if(pp->p.type() == solid_obj_common::pytype()) return bound.intersects(*static_cast<const solid_prototype<Store>*>(pp));
+        if(pp->p.type() == solid_batch_obj_common::pytype()) return bound.intersects(*static_cast<const solid_batch_prototype<Store>*>(pp));
 
         assert(pp->p.type() == triangle_batch_obj_common::pytype());
         return bound.intersects(*static_cast<const triangle_batch_prototype<Store>*>(pp));
@@ -2115,8 +4704,6 @@ public:
 };
 
 
-template<typename Store> class kd_node_worker_pool;
-
 /* The primitives are divided into the lists: contain_p and overlap_p.
    Primitives in contain_p are entirely inside boundary, and are much easier to
    partition. The rest of the primitives are in overlap_p.
@@ -2127,140 +4714,237 @@ template<typename Store> class kd_node_worker_pool;
    split (hyper)plane, in which case it should be on the right side. */
 template<typename Store> kd_node_unique_ptr<Store> create_node(kd_node_worker_pool<Store> &wpool,int depth,aabb<Store> &boundary,const proto_array<Store> &contain_p,const proto_array<Store> &overlap_p,const kd_tree_params &params);
 
+template<typename Store> void discard_build_tree(kd_node_unique_ptr<Store> &node);
+
 
+/* Each thread, including the one that creates the pool, has its own queue of
+   jobs. A thread adds and takes jobs from the back of its own queue, so it
+   works depth-first on the nodes it created, and takes from the front of the
+   other threads' queues when its own is empty, where the largest subtrees
+   are. */
 template<typename Store> class kd_node_worker_pool {
+    typedef std::tuple<kd_node_unique_ptr<Store>*,int,aabb<Store>,proto_array<Store>,proto_array<Store>,const kd_tree_params&> job_values;
+
+    struct job_queue {
+        std::mutex mut;
+        std::deque<job_values> jobs;
+    };
+
     std::vector<std::thread> threads;
     unsigned int max_threads;
-    volatile unsigned int busy_threads;
+    std::unique_ptr<job_queue[]> queues;
+    static thread_local job_queue *local_queue;
+
+    // the number of jobs in the queues
+    std::atomic<size_t> pending;
+
+    // the number of jobs in the queues or being run
+    std::atomic<size_t> outstanding;
+
+    std::atomic<unsigned int> sleeping;
+
+    // the number of threads in "threads"
+    std::atomic<size_t> started;
+
+    /* the number of threads, out of "max_threads", that are neither in
+       "threads" nor reserved by "reserve_threads" */
+    std::atomic<unsigned int> spare;
     volatile enum {NORMAL,FINISHING,QUITTING} state;
 
     std::mutex mut;
     std::condition_variable start;
 
-    typedef std::tuple<kd_node_unique_ptr<Store>*,int,aabb<Store>,proto_array<Store>,proto_array<Store>,const kd_tree_params&> job_values;
-    std::deque<job_values> jobs;
-
     std::exception_ptr exc;
 
-    void worker() {
-        std::unique_lock<std::mutex> lock{mut};
+    // branches that were abandoned while jobs could still write to them
+    std::vector<kd_node_unique_ptr<Store>> orphans;
 
-        for(;;) {
-            --busy_threads;
-
-            while(jobs.empty()) {
-                if(state == QUITTING) return;
-                /* we wait until all threads are idle in case a thread will add
-                   another job */
-                else if(state == FINISHING && !busy_threads) {
-                    lock.unlock();
-                    start.notify_all();
-                    return;
-                }
+    job_queue &own_queue() {
+        return local_queue ? *local_queue : queues[0];
+    }
 
-                start.wait(lock);
+    bool take_job(job_queue &own,std::optional<job_values> &values) {
+        {
+            std::lock_guard<std::mutex> lock{own.mut};
+            if(!own.jobs.empty()) {
+                values.emplace(std::move(own.jobs.back()));
+                own.jobs.pop_back();
+                --pending;
+                return true;
             }
+        }
 
-            if(state == QUITTING) return;
-
-            ++busy_threads;
+        size_t count = started + 1;
+        size_t offset = &own - queues.get();
+        for(size_t i=1; i<count; ++i) {
+            job_queue &other = queues[(offset + i) % count];
+            std::lock_guard<std::mutex> lock{other.mut};
+            if(!other.jobs.empty()) {
+                values.emplace(std::move(other.jobs.front()));
+                other.jobs.pop_front();
+                --pending;
+                return true;
+            }
+        }
+        return false;
+    }
 
-            auto values = std::move(jobs.front());
-            jobs.pop_front();
+    /* returns false if an exception was raised */
+    bool run_job(std::optional<job_values> &values) {
+        try {
+            *std::get<0>(*values) = ::create_node(
+                *this,
+                std::get<1>(*values),
+                std::get<2>(*values),
+                std::get<3>(*values),
+                std::get<4>(*values),
+                std::get<5>(*values));
+            values.reset();
+        } catch(...) {
+            std::lock_guard<std::mutex> lock{mut};
 
-            lock.unlock();
-            try {
-                *std::get<0>(values) = ::create_node(
-                    *this,
-                    std::get<1>(values),
-                    std::get<2>(values),
-                    std::get<3>(values),
-                    std::get<4>(values),
-                    std::get<5>(values));
-            } catch(...) {
-                lock.lock();
+            if(!exc) exc = std::current_exception();
+            state = QUITTING;
+            start.notify_all();
+            return false;
+        }
 
-                if(!exc) exc = std::current_exception();
-                state = QUITTING;
-                --busy_threads;
+        if(--outstanding == 0) {
+            std::lock_guard<std::mutex> lock{mut};
+            start.notify_all();
+        }
+        return true;
+    }
 
-                lock.unlock();
+    /* Wait until there is a job to take, or no jobs are left. Returns false if
+       no more jobs will be added or an exception was raised. */
+    bool wait_for_job(bool main_thread) {
+        std::unique_lock<std::mutex> lock{mut};
 
-                start.notify_all();
-                return;
+        ++sleeping;
+        for(;;) {
+            if(state == QUITTING) break;
+            if(pending) {
+                --sleeping;
+                return true;
             }
-            lock.lock();
+            if((main_thread || state == FINISHING) && !outstanding) break;
+            start.wait(lock);
         }
+        --sleeping;
+        return false;
+    }
+
+    void worker(job_queue *queue) {
+        local_queue = queue;
+
+        std::optional<job_values> values;
+        do {
+            while(take_job(*queue,values)) {
+                if(!run_job(values)) return;
+            }
+        } while(wait_for_job(false));
     }
 
 public:
     kd_node_worker_pool(int _max_threads=-1)
-        : max_threads(_max_threads >= 0 ? _max_threads : (std::thread::hardware_concurrency()-1)), busy_threads(0), state(NORMAL) {
+        : max_threads(_max_threads >= 0 ? _max_threads : (std::thread::hardware_concurrency()-1)),
+        queues(new job_queue[max_threads+1]),
+        pending(0),
+        outstanding(0),
+        sleeping(0),
+        started(0),
+        spare(max_threads),
+        state(NORMAL) {
         if(max_threads) threads.reserve(max_threads);
     }
 
     ~kd_node_worker_pool() {
-        if(!threads.empty()) finish(true);
-        assert(!busy_threads);
+        if(!threads.empty() || !orphans.empty()) finish(true);
     }
 
     bool create_node(kd_node_unique_ptr<Store> &dest,int depth,aabb<Store> &boundary,proto_array<Store> &&contain_p,proto_array<Store> &&overlap_p,const kd_tree_params &params) {
-        {
-            std::lock_guard<std::mutex> lock{mut};
+        if(state == QUITTING) return false;
 
-            if(state == QUITTING) return false;
+        job_queue &own = own_queue();
+        ++outstanding;
+        {
+            std::lock_guard<std::mutex> lock{own.mut};
+            own.jobs.emplace_back(&dest,depth,aabb<Store>{boundary.start,boundary.end,nullptr},std::move(contain_p),std::move(overlap_p),params);
 
-            jobs.emplace_back(&dest,depth,aabb<Store>{boundary.start,boundary.end,nullptr},std::move(contain_p),std::move(overlap_p),params);
+            /* this is incremented while the queue is locked so that it can't
+               be decremented first */
+            ++pending;
+        }
 
-            if(threads.size() < max_threads && busy_threads == threads.size()) {
-                ++busy_threads;
-                threads.push_back(std::thread(&kd_node_worker_pool::worker,this));
-            }
+        /* only one sleeping thread is woken, and a new thread is only started
+           if none are sleeping */
+        if(sleeping) {
+            std::lock_guard<std::mutex> lock{mut};
+            start.notify_one();
+        } else if(reserve_threads(1)) {
+            std::lock_guard<std::mutex> lock{mut};
+            if(state == NORMAL) {
+                threads.push_back(std::thread(&kd_node_worker_pool::worker,this,&queues[threads.size()+1]));
+                started = threads.size();
+            } else release_threads(1);
         }
-        start.notify_one();
 
         return true;
     }
 
+    /* Reserve up to "wanted" of the threads that haven't been started, for
+       work that isn't a job, and return how many were reserved. They must be
+       given back with "release_threads". */
+    unsigned int reserve_threads(unsigned int wanted) {
+        unsigned int available = spare;
+        unsigned int n;
+        do {
+            n = std::min(available,wanted);
+            if(!n) return 0;
+        } while(!spare.compare_exchange_weak(available,available - n));
+        return n;
+    }
+
+    void release_threads(unsigned int n) {
+        spare += n;
+    }
+
+    /* Keep "node" until the worker threads have stopped, then destroy it with
+       discard_build_tree. This is for a branch that is being abandoned
+       because of an exception, when one of its children was given to the
+       pool and may still be written to. */
+    void orphan(kd_node_unique_ptr<Store> &&node) {
+        std::lock_guard<std::mutex> lock{mut};
+        orphans.push_back(std::move(node));
+    }
+
     void finish(bool quit=false) {
         {
-            std::unique_lock<std::mutex> lock{mut};
+            std::lock_guard<std::mutex> lock{mut};
 
             if(quit) state = QUITTING;
             else if(state == NORMAL) state = FINISHING;
 
             start.notify_all();
+        }
 
-            while((busy_threads || !jobs.empty()) && state != QUITTING) {
-                if(jobs.empty()) {
-                    start.wait(lock);
-                } else {
-                    auto values = std::move(jobs.front());
-                    jobs.pop_front();
-
-                    lock.unlock();
-                    try {
-                        *std::get<0>(values) = ::create_node(
-                            *this,
-                            std::get<1>(values),
-                            std::get<2>(values),
-                            std::get<3>(values),
-                            std::get<4>(values),
-                            std::get<5>(values));
-                    } catch(...) {
-                        lock.lock();
-
-                        if(!exc) exc = std::current_exception();
-                        state = QUITTING;
-                        break;
-                    }
-                    lock.lock();
+        if(!quit) {
+            std::optional<job_values> values;
+            do {
+                while(take_job(queues[0],values)) {
+                    if(!run_job(values)) break;
                 }
-            }
+            } while(wait_for_job(true));
         }
 
         for(auto &t : threads) t.join();
+        spare += static_cast<unsigned int>(threads.size());
         threads.clear();
+        started = 0;
+
+        for(auto &n : orphans) discard_build_tree(n);
+        orphans.clear();
 
         if(exc) std::rethrow_exception(exc);
     }
@@ -2270,15 +4954,56 @@ public:
     }
 };
 
+template<typename Store> thread_local typename kd_node_worker_pool<Store>::job_queue *kd_node_worker_pool<Store>::local_queue = nullptr;
 
 
 
+
+/* Leaves are created without the GIL, so they don't own references to their
+   primitives until adopt_leaf_refs is called on the finished tree. A tree that
+   hasn't been adopted must be destroyed with discard_build_tree. */
 template<typename Store> kd_node_unique_ptr<Store> create_leaf(const proto_array<Store> &contain_p,const proto_array<Store> &overlap_p) {
-    py::acquire_gil gil;
+    size_t size = contain_p.size() + overlap_p.size();
+    auto item = [&](size_t i) { return (i < contain_p.size() ? contain_p[i] : overlap_p[i-contain_p.size()])->p.ref(); };
+
+    if constexpr(v_real::size > 1) {
+        /* kd_leaf would partition the items itself, but copying py::object
+           instances would change their reference counts */
+        std::vector<PyObject*> items(size);
+        for(size_t i=0; i<size; ++i) items[i] = item(i);
+        size_t batches = std::partition(ITR_RANGE(items),&is_primitive_batch) - items.begin();
+
+        return kd_node_unique_ptr<Store>(kd_leaf<Store>::create(
+            size,
+            batches,
+            [&](size_t i){ return py::new_ref(items[i]); }));
+    } else {
+        return kd_node_unique_ptr<Store>(kd_leaf<Store>::create(
+            size,
+            [&](size_t i){ return py::new_ref(item(i)); }));
+    }
+}
+
+/* Take a reference to every primitive in the leaves of "node". The GIL must be
+   held. */
+template<typename Store> void adopt_leaf_refs(const kd_node<Store> *node) {
+    if(!node) return;
+    if(node->type == LEAF) {
+        for(auto &item : static_cast<const kd_leaf<Store>*>(node)->items()) Py_INCREF(item.ref());
+    } else {
+        assert(node->type == BRANCH);
+        adopt_leaf_refs(static_cast<const kd_branch<Store>*>(node)->left.get());
+        adopt_leaf_refs(static_cast<const kd_branch<Store>*>(node)->right.get());
+    }
+}
 
-    return kd_node_unique_ptr<Store>(kd_leaf<Store>::create(
-        contain_p.size() + overlap_p.size(),
-        [&](size_t i){ return py::borrowed_ref((i < contain_p.size() ? contain_p[i] : overlap_p[i-contain_p.size()])->p.ref()); }));
+/* destroy a tree whose leaves were made by create_leaf and not yet adopted */
+template<typename Store> void discard_build_tree(kd_node_unique_ptr<Store> &node) {
+    if(node) {
+        py::acquire_gil gil;
+        adopt_leaf_refs(node.get());
+        node.reset();
+    }
 }
 
 template<typename Store> kd_node_unique_ptr<Store> create_node(
@@ -2290,14 +5015,14 @@ template<typename Store> kd_node_unique_ptr<Store> create_node(
     const kd_tree_params &params)
 {
     ++depth;
-    size_t axis = best_axis(boundary);
 
     if(contain_p.empty() && overlap_p.empty()) return nullptr;
 
+    size_t axis;
     real split;
     if(depth >= params.max_depth
         || contain_p.size() + overlap_p.size() <= size_t(params.split_threshold)
-        || !find_split(boundary,axis,contain_p,overlap_p,split,params))
+        || !find_split(boundary,contain_p,overlap_p,axis,split,params,wpool))
         return create_leaf(contain_p,overlap_p);
 
     proto_array<Store> l_contain_p, r_contain_p;
@@ -2344,11 +5069,21 @@ template<typename Store> kd_node_unique_ptr<Store> create_node(
     auto branch = new kd_branch<Store>(axis,split);
     kd_node_unique_ptr<Store> r{branch};
 
-    if(wpool) {
+    bool queued = wpool && l_contain_p.size() + l_overlap_p.size() > KD_INLINE_BUILD_THRESHOLD;
+    if(queued) {
         if(!wpool.create_node(branch->left,depth,sb.left(),std::move(l_contain_p),std::move(l_overlap_p),params)) return nullptr;
     } else branch->left = create_node<Store>(wpool,depth,sb.left(),l_contain_p,l_overlap_p,params);
 
-    branch->right = create_node<Store>(wpool,depth,sb.right(),r_contain_p,r_overlap_p,params);
+    try {
+        branch->right = create_node<Store>(wpool,depth,sb.right(),r_contain_p,r_overlap_p,params);
+    } catch(...) {
+        /* if branch->left was given to the worker pool, a worker thread may
+           still be writing to it, so the pool destroys the branch once its
+           threads have stopped */
+        if(queued) wpool.orphan(std::move(r));
+        else discard_build_tree(branch->left);
+        throw;
+    }
 
     return r;
 }
@@ -2372,7 +5107,7 @@ template<typename Store> real grouping_metric(const primitive_prototype<Store> *
 }
 
 template<typename Store> struct batch_candidate {
-    typename std::vector<primitive_prototype_py_ptr<Store>>::iterator itr;
+    size_t index;
     real metric;
 };
 
@@ -2392,34 +5127,106 @@ template<typename Store> void add_sorted(std::vector<batch_candidate<Store>> &ba
     }
 }
 
-template<typename Store> void group_primitives(std::vector<primitive_prototype_py_ptr<Store>> &primitives,size_t axis) {
-    if constexpr(v_real::size > 1) {
-        size_t dimension = primitives[0]->get_base().dimension();
+/* Interleave the bits of the coordinates of "point", quantized to the extent
+   of "bound", so that sorting by the result puts points in the order of a
+   Z-order (Morton) curve. Only the first 64 axes are used. */
+template<typename Store> uint64_t morton_code(const aabb<Store> &bound,const vector<Store> &point) {
+    size_t d = std::min(bound.dimension(),size_t(64));
+    size_t bits = std::min(64 / d,size_t(32));
+    real max_q = static_cast<real>((uint64_t(1) << bits) - 1);
+
+    uint64_t code = 0;
+    for(size_t i=0; i<d; ++i) {
+        real width = bound.end[i] - bound.start[i];
+        real q = width > 0 ? (point[i] - bound.start[i]) / width * max_q : 0;
+        uint64_t qi = static_cast<uint64_t>(std::min(std::max(q,real(0)),max_q));
+        for(size_t b=0; b<bits; ++b) code |= ((qi >> b) & 1) << (b*d + i);
+    }
+    return code;
+}
 
-        std::sort(ITR_RANGE(primitives),[=](const primitive_prototype_py_ptr<Store> &a,const primitive_prototype_py_ptr<Store> &b){
-            return a->get_base().boundary.center()[axis] < b->get_base().boundary.center()[axis];
-        });
+/* The primitives for which "member" returns true are sorted along a Morton
+   curve, so that primitives near each other in space are near each other in
+   the sorted list. Each batch is then formed from an ungrouped primitive and
+   the v_real::size-1 primitives that fit best with it, among the next
+   GROUPING_WINDOW ungrouped primitives. Every such primitive ends up in a
+   batch. The batched primitives are set to null. */
+template<typename Store,typename Fp,typename Fb> void group_primitives_of(
+    std::vector<primitive_prototype_py_ptr<Store>> &primitives,
+    const aabb<Store> &boundary,
+    Fp member,
+    Fb make_batch)
+{
+    struct sort_item {
+        uint64_t code;
+        primitive_prototype_py_ptr<Store> *p;
+    };
+    std::vector<sort_item> order;
+    for(auto &p : primitives) {
+        if(p && member(p->get_base())) {
+            vector<Store> c = p->get_base().boundary.center();
+            order.push_back({morton_code(boundary,c),&p});
+        }
+    }
+    std::sort(ITR_RANGE(order),[](const sort_item &a,const sort_item &b){ return a.code < b.code; });
 
-        std::vector<batch_candidate<Store>> batch;
-        batch.reserve(v_real::size);
+    std::vector<bool> used(order.size(),false);
+    std::vector<batch_candidate<Store>> batch;
+    batch.reserve(v_real::size);
 
-        for(auto pitr = std::begin(primitives); pitr != std::end(primitives); ++pitr) {
-            if(!*pitr || (*pitr)->get_base().p.type() != triangle_obj_common::pytype()) continue;
+    for(size_t i=0; i<order.size(); ++i) {
+        if(used[i]) continue;
 
-            batch.push_back({pitr,0});
+        batch.push_back({i,0});
+        auto &first = (*order[i].p)->get_base();
 
-            for(auto pnitr = pitr+1; pnitr != std::end(primitives); ++pnitr) {
-                if(pnitr == pitr || !*pnitr || (*pnitr)->get_base().p.type() != triangle_obj_common::pytype()) continue;
-                add_sorted(batch,{pnitr,grouping_metric(&(*pitr)->get_base(),&(*pnitr)->get_base())});
-            }
+        size_t searched = 0;
+        for(size_t j=i+1; j<order.size() && searched < GROUPING_WINDOW; ++j) {
+            if(used[j]) continue;
+            add_sorted(batch,{j,grouping_metric(&first,&(*order[j].p)->get_base())});
+            ++searched;
+        }
 
-            if(batch.size() < v_real::size) break;
+        /* the batch will only be partially filled if fewer than v_real::size
+           primitives are left */
+        order[i].p->reset(make_batch([&](size_t k){ return &(*order[batch[k].index].p)->get_base(); },batch.size()));
+        for(size_t k=1; k<batch.size(); ++k) {
+            used[batch[k].index] = true;
+            *order[batch[k].index].p = {};
+        }
+        batch.clear();
+    }
+}
 
-            batch[0].itr->reset(py::new_ref(new(dimension) wrapped_type<triangle_batch_prototype<Store>>(dimension,[&](size_t i){ return static_cast<triangle_prototype<Store>*>(&(*(batch[i].itr))->get_base()); })));
-            for(size_t i=1; i<v_real::size; ++i) {
-                *(batch[i].itr) = {};
-            }
-            batch.clear();
+/* Group triangles into triangle batches and solids into solid batches. Cubes
+   and spheres are grouped separately. */
+template<typename Store> void group_primitives(std::vector<primitive_prototype_py_ptr<Store>> &primitives,const aabb<Store> &boundary) {
+    if constexpr(v_real::size > 1) {
+        size_t dimension = primitives[0]->get_base().dimension();
+
+        group_primitives_of(
+            primitives,
+            boundary,
+            [](const primitive_prototype<Store> &p) { return p.p.type() == triangle_obj_common::pytype(); },
+            [=](auto item,size_t lanes) {
+                return py::new_ref(new(dimension) wrapped_type<triangle_batch_prototype<Store>>(
+                    dimension,
+                    [=](size_t k){ return static_cast<triangle_prototype<Store>*>(item(k)); },
+                    lanes));
+            });
+
+        for(solid_type type : {CUBE,SPHERE}) {
+            group_primitives_of(
+                primitives,
+                boundary,
+                [=](const primitive_prototype<Store> &p) {
+                    return p.p.type() == solid_obj_common::pytype() && static_cast<const solid_prototype<Store>&>(p).ps()->type == type;
+                },
+                [](auto item,size_t lanes) {
+                    return py::new_ref(new wrapped_type<solid_batch_prototype<Store>>(
+                        [=](size_t k){ return static_cast<solid_prototype<Store>*>(item(k)); },
+                        lanes));
+                });
         }
 
         primitives.resize(std::remove(ITR_RANGE(primitives),primitive_prototype_py_ptr<Store>{}) - primitives.begin());
@@ -2437,21 +5244,243 @@ template<typename Store> std::tuple<aabb<Store>,kd_node_unique_ptr<Store>> build
         v_expr(boundary.end) = max(v_expr(boundary.end),v_expr(p_objs[i]->get_base().boundary.end));
     }
 
-    group_primitives<Store>(p_objs,best_axis(boundary));
+    group_primitives<Store>(p_objs,boundary);
     proto_array<Store> primitives;
     primitives.reserve(p_objs.size());
     for(auto &p : p_objs) primitives.push_back(&p->get_base());
 
     kd_node_unique_ptr<Store> node;
+    std::exception_ptr exc;
 
     {
         py::allow_threads _;
-        kd_node_worker_pool<Store> wpool(max_threads);
-        node = create_node(wpool,-1,boundary,primitives,{},params);
-        wpool.finish();
+        try {
+            kd_node_worker_pool<Store> wpool(max_threads);
+            node = create_node(wpool,-1,boundary,primitives,{},params);
+            wpool.finish();
+        } catch(...) {
+            exc = std::current_exception();
+        }
     }
 
+    adopt_leaf_refs(node.get());
+    if(exc) std::rethrow_exception(exc);
+
     return std::tuple<aabb<Store>,kd_node_unique_ptr<Store>>(boundary,std::move(node));
 }
 
+struct bvh_params {
+    int max_depth;
+    int split_threshold;
+    real traversal;
+    real intersection;
+    int bins;
+
+    bvh_params() :
+        max_depth(BVH_MAX_DEPTH),
+        split_threshold(BVH_DEFAULT_SPLIT_THRESHOLD),
+        traversal(BVH_DEFAULT_COST_TRAVERSAL),
+        intersection(BVH_DEFAULT_COST_INTERSECTION),
+        bins(KD_DEFAULT_BINS) {}
+};
+
+/* Builds a BVH from the top down. Each node is split where the surface area
+   heuristic, evaluated at the boundaries between "params.bins" equal slices of
+   the range of the primitives' centers along every axis, gives the lowest
+   cost, or made into a leaf if that is cheaper. Since a node's primitives are
+   always a contiguous range of "order", the leaves end up referring to
+   consecutive ranges of it. */
+template<typename Store> class bvh_builder {
+    const proto_array<Store> &primitives;
+    const bvh_params &params;
+    bvh_nodes &out;
+    size_t d;
+    std::vector<real> centers;
+    real min_extent;
+
+    struct bin {
+        size_t count;
+        std::vector<real> box;
+    };
+    std::vector<bin> bins;
+    std::vector<real> right_area;
+
+    static void empty_box(real *box,size_t d) {
+        std::fill_n(box,d,std::numeric_limits<real>::max());
+        std::fill_n(box+d,d,std::numeric_limits<real>::lowest());
+    }
+
+    void expand(real *box,const aabb<Store> &b) const {
+        for(size_t i=0; i<d; ++i) {
+            box[i] = std::min(box[i],b.start[i]);
+            box[d+i] = std::max(box[d+i],b.end[i]);
+        }
+    }
+
+    void expand(real *box,const real *b) const {
+        for(size_t i=0; i<d; ++i) {
+            box[i] = std::min(box[i],b[i]);
+            box[d+i] = std::max(box[d+i],b[d+i]);
+        }
+    }
+
+    real area(const real *box) const {
+        return bvh_box_area(box,d,min_extent);
+    }
+
+    size_t bin_of(uint32_t p,size_t axis,real c_start,real scale) const {
+        auto b = static_cast<size_t>((centers[p*d + axis] - c_start) * scale);
+        return std::min(b,bins.size()-1);
+    }
+
+public:
+    std::vector<uint32_t> order;
+
+    bvh_builder(const proto_array<Store> &primitives,const aabb<Store> &boundary,const bvh_params &params,bvh_nodes &out)
+            : primitives(primitives), params(params), out(out), d(boundary.dimension()), bins(params.bins), right_area(params.bins) {
+        if(primitives.size() > std::numeric_limits<uint32_t>::max()) throw std::length_error("too many primitives");
+
+        centers.resize(primitives.size() * d);
+        order.resize(primitives.size());
+        for(size_t i=0; i<primitives.size(); ++i) {
+            order[i] = static_cast<uint32_t>(i);
+            for(size_t j=0; j<d; ++j) centers[i*d + j] = (primitives[i]->boundary.start[j] + primitives[i]->boundary.end[j]) * real(0.5);
+        }
+
+        real widest = 0;
+        for(size_t i=0; i<d; ++i) widest = std::max(widest,boundary.end[i] - boundary.start[i]);
+        min_extent = widest > 0 ? widest * real(1e-6) : real(1);
+
+        for(auto &b : bins) b.box.resize(d*2);
+    }
+
+    uint32_t operator()(size_t begin,size_t end,int depth) {
+        if(out.nodes.size() >= std::numeric_limits<uint32_t>::max()) throw std::length_error("BVH is too large");
+        auto index = static_cast<uint32_t>(out.nodes.size());
+        out.nodes.emplace_back();
+
+        std::vector<real> box(d*2);
+        std::vector<real> c_box(d*2);
+        empty_box(box.data(),d);
+        empty_box(c_box.data(),d);
+        for(size_t i=begin; i<end; ++i) {
+            expand(box.data(),primitives[order[i]]->boundary);
+            const real *c = centers.data() + order[i]*d;
+            for(size_t j=0; j<d; ++j) {
+                c_box[j] = std::min(c_box[j],c[j]);
+                c_box[d+j] = std::max(c_box[d+j],c[j]);
+            }
+        }
+        out.bounds.insert(out.bounds.end(),ITR_RANGE(box));
+
+        size_t count = end - begin;
+        size_t best_axis = d;
+        size_t best_split = 0;
+        real best_cost = params.intersection * static_cast<real>(count);
+
+        if(count > size_t(params.split_threshold) && depth < params.max_depth) {
+            real node_area = area(box.data());
+
+            for(size_t axis=0; axis<d; ++axis) {
+                real c_start = c_box[axis];
+                real c_width = c_box[d+axis] - c_start;
+                if(!(c_width > 0)) continue;
+                real scale = static_cast<real>(bins.size()) / c_width;
+
+                for(auto &b : bins) {
+                    b.count = 0;
+                    empty_box(b.box.data(),d);
+                }
+                for(size_t i=begin; i<end; ++i) {
+                    bin &b = bins[bin_of(order[i],axis,c_start,scale)];
+                    ++b.count;
+                    expand(b.box.data(),primitives[order[i]]->boundary);
+                }
+
+                std::vector<real> acc(d*2);
+                empty_box(acc.data(),d);
+                for(size_t k=bins.size()-1; k>0; --k) {
+                    expand(acc.data(),bins[k].box.data());
+                    right_area[k] = area(acc.data());
+                }
+
+                empty_box(acc.data(),d);
+                size_t l_count = 0;
+                for(size_t k=1; k<bins.size(); ++k) {
+                    l_count += bins[k-1].count;
+                    if(bins[k-1].count) expand(acc.data(),bins[k-1].box.data());
+                    size_t r_count = count - l_count;
+                    if(!l_count || !r_count) continue;
+
+                    real cost = params.traversal + params.intersection
+                        * (area(acc.data()) * static_cast<real>(l_count) + right_area[k] * static_cast<real>(r_count)) / node_area;
+                    if(cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = k;
+                    }
+                }
+            }
+        }
+
+        if(best_axis == d) {
+            bvh_node &n = out.nodes[index];
+            n.index = static_cast<uint32_t>(begin);
+            n.size = static_cast<uint32_t>(count);
+            n.batches = 0;
+            if constexpr(v_real::size > 1) {
+                n.batches = static_cast<uint32_t>(std::stable_partition(
+                    order.begin() + begin,
+                    order.begin() + end,
+                    [&](uint32_t p) { return is_primitive_batch(primitives[p]->p.ref()); }) - (order.begin() + begin));
+            }
+            return index;
+        }
+
+        real c_start = c_box[best_axis];
+        real scale = static_cast<real>(bins.size()) / (c_box[d+best_axis] - c_start);
+        size_t mid = std::partition(
+            order.begin() + begin,
+            order.begin() + end,
+            [&](uint32_t p) { return bin_of(p,best_axis,c_start,scale) < best_split; }) - order.begin();
+        assert(mid > begin && mid < end);
+
+        operator()(begin,mid,depth+1);
+        uint32_t right = operator()(mid,end,depth+1);
+
+        bvh_node &n = out.nodes[index];
+        n.index = right;
+        n.size = 0;
+        n.batches = 0;
+        return index;
+    }
+};
+
+template<typename Store> std::tuple<aabb<Store>,std::shared_ptr<const bvh_data<Store>>> build_bvh(std::vector<primitive_prototype_py_ptr<Store>> &p_objs,const bvh_params &params) {
+    assert(p_objs.size());
+
+    aabb<Store> boundary = p_objs[0]->get_base().boundary;
+    for(size_t i=1; i<p_objs.size(); ++i) {
+        v_expr(boundary.start) = min(v_expr(boundary.start),v_expr(p_objs[i]->get_base().boundary.start));
+        v_expr(boundary.end) = max(v_expr(boundary.end),v_expr(p_objs[i]->get_base().boundary.end));
+    }
+
+    group_primitives<Store>(p_objs,boundary);
+    proto_array<Store> primitives;
+    primitives.reserve(p_objs.size());
+    for(auto &p : p_objs) primitives.push_back(&p->get_base());
+
+    auto data = std::make_shared<bvh_data<Store>>(boundary.dimension());
+    bvh_builder<Store> builder{primitives,boundary,params,*data};
+    {
+        py::allow_threads _;
+        builder(0,primitives.size(),0);
+    }
+
+    data->items.reserve(primitives.size());
+    for(uint32_t p : builder.order) data->items.push_back(primitives[p]->p);
+
+    return {boundary,std::move(data)};
+}
+
 #endif
@@ -39,7 +39,7 @@ namespace impl {
         constexpr size_t size = simd::v_sizes<typename F::item_t>::value[SI];
         if constexpr(F::v_score >= V_SCORE_THRESHHOLD && size > 1) {
             if constexpr(F::max_items >= size) {
-                for(; i<(n - (size - 1)); i+= size) f.template operator()<size>(i);
+                for(; i + size <= n; i+= size) f.template operator()<size>(i);
             }
 
             _v_rep<F,SI+1>(n,i,f);
@@ -58,7 +58,7 @@ namespace impl {
         constexpr size_t size = simd::v_sizes<typename F::item_t>::value[SI];
         if constexpr(F::v_score >= V_SCORE_THRESHHOLD && size > 1) {
             if constexpr(F::max_items >= size) {
-                for(; i<(n - (size - 1)); i+= size) {
+                for(; i + size <= n; i+= size) {
                     if(f.template operator()<size>(i)) return true;
                 }
             }